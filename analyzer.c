@@ -1,15 +1,11 @@
 #include "compilium.h"
 
-static struct Node *in_function;  // ASTFuncDef
-static int reg_used_table[NUM_OF_SCRATCH_REGS];
-static struct Node *reg_node_table[NUM_OF_SCRATCH_REGS];
-
 static void AllocReg(struct Node *n) {
   assert(n);
   for (int i = 1; i <= NUM_OF_SCRATCH_REGS; i++) {
-    if (!reg_used_table[i]) {
-      reg_used_table[i] = 1;
-      reg_node_table[i] = n;
+    if (!compiler->reg_used_table[i]) {
+      compiler->reg_used_table[i] = 1;
+      compiler->reg_node_table[i] = n;
       n->reg = i;
       return;
     }
@@ -17,8 +13,8 @@ static void AllocReg(struct Node *n) {
   fprintf(stderr, "\n**** Allocated regs ****\n");
   for (int i = 1; i <= NUM_OF_SCRATCH_REGS; i++) {
     fprintf(stderr, "reg[%d]:\n", i);
-    if (reg_node_table[i]->op) {
-      PrintTokenLine(reg_node_table[i]->op);
+    if (compiler->reg_node_table[i]->op) {
+      PrintTokenLine(compiler->reg_node_table[i]->op);
     } else {
       fprintf(stderr, "Op info not found\n");
     }
@@ -30,8 +26,122 @@ static void AllocReg(struct Node *n) {
 
 static void FreeReg(int reg) {
   assert(1 <= reg && reg <= NUM_OF_SCRATCH_REGS);
-  reg_used_table[reg] = 0;
-  reg_node_table[reg] = NULL;
+  compiler->reg_used_table[reg] = 0;
+  compiler->reg_node_table[reg] = NULL;
+}
+
+static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx);
+
+static bool IsNullPointerConstant(struct Node *n) {
+  return n->type == kASTExpr && IsTokenWithType(n->op, kTokenIntegerConstant) &&
+         strtol(n->op->begin, NULL, 0) == 0;
+}
+
+static struct Node *GetTypeOfConditionalExpr(struct Node *node) {
+  // cond ? left : right
+  struct Node *left_type = GetRValueType(node->left->expr_type);
+  struct Node *right_type = GetRValueType(node->right->expr_type);
+  if (IsSameTypeExceptAttr(left_type, right_type)) return right_type;
+  if (left_type->type == kTypeBase && right_type->type == kTypeBase) {
+    // The usual arithmetic conversions: integers smaller than int are
+    // promoted to int, and then the larger one is taken.
+    int left_size = GetSizeOfType(left_type);
+    int right_size = GetSizeOfType(right_type);
+    int int_size = GetSizeOfType(GetIntType());
+    if (left_size <= int_size && right_size <= int_size) return GetIntType();
+    return left_size < right_size ? right_type : left_type;
+  }
+  if (IsPointerType(left_type) && IsNullPointerConstant(node->right)) {
+    return left_type;
+  }
+  if (IsPointerType(right_type) && IsNullPointerConstant(node->left)) {
+    return right_type;
+  }
+  ErrorWithToken(node->op, "Type mismatch in the conditional expression");
+}
+
+static struct Node *AddLocalVarToFrame(struct SymbolEntry **ctx,
+                                       const char *key, struct Node *type) {
+  assert(compiler->in_function);
+  struct Node *local_var = AddLocalVar(ctx, key, type);
+  if (compiler->in_function->stack_size_needed < local_var->byte_offset) {
+    compiler->in_function->stack_size_needed = local_var->byte_offset;
+  }
+  return local_var;
+}
+
+static int IsBinaryExprOnChain(struct Node *n) {
+  return n->type == kASTExpr && n->op && n->left && n->right && !n->cond &&
+         !IsEqualTokenWithCStr(n->op, "(") &&
+         !IsEqualTokenWithCStr(n->op, "[") &&
+         !IsEqualTokenWithCStr(n->op, ".") &&
+         !IsEqualTokenWithCStr(n->op, "->");
+}
+
+static void AnalyzeBinaryExprResult(struct Node *node) {
+  if (IsEqualTokenWithCStr(node->op, "=") ||
+      IsEqualTokenWithCStr(node->op, ",")) {
+    FreeReg(node->left->reg);
+    node->reg = node->right->reg;
+    node->expr_type = GetRValueType(node->right->expr_type);
+    return;
+  }
+  FreeReg(node->right->reg);
+  node->reg = node->left->reg;
+  node->expr_type = GetRValueType(node->left->expr_type);
+}
+
+// Analyzes a left-deep chain of binary operators such as a + b + c + ...
+// from left to right, in the order of evaluation, without recursion
+static void AnalyzeBinaryExprChain(struct Node *node,
+                                   struct SymbolEntry **ctx) {
+  struct Node *chain = AllocList();
+  for (struct Node *n = node; IsBinaryExprOnChain(n); n = n->left) {
+    PushToList(chain, n);
+  }
+  int size = GetSizeOfList(chain);
+  AnalyzeNode(GetNodeAt(chain, size - 1)->left, ctx);
+  for (int i = size - 1; i >= 0; i--) {
+    struct Node *n = GetNodeAt(chain, i);
+    AnalyzeNode(n->right, ctx);
+    AnalyzeBinaryExprResult(n);
+  }
+}
+
+void DeclareFuncDef(struct Node *node, struct SymbolEntry **ctx) {
+  // The symbol of the function outlives the arena of its body
+  struct Arena *saved_arena = SwitchArena(compiler->unit_arena);
+  AddFuncDef(ctx, CreateTokenStr(node->func_name_token), node);
+  SwitchArena(saved_arena);
+}
+
+void AnalyzeFuncDefBody(struct Node *node, struct SymbolEntry *ctx) {
+  // ctx should contain the function itself (see DeclareFuncDef).
+  // Local symbols are pushed only onto this copy of ctx, so the bodies of
+  // functions can be analyzed independently of each other.
+  struct Node *arg_type_list = GetArgTypeList(node->func_type);
+  assert(arg_type_list);
+  node->arg_var_list = AllocList();
+  assert(!compiler->in_function);
+  compiler->in_function = node;
+  node->stack_size_needed = 0;
+  for (int i = 0; i < GetSizeOfList(arg_type_list); i++) {
+    struct Node *arg_type_with_attr = GetNodeAt(arg_type_list, i);
+    struct Node *arg_ident_token =
+        GetIdentifierTokenFromTypeAttr(arg_type_with_attr);
+    if (!arg_ident_token) {
+      PushToList(node->arg_var_list, NULL);
+      continue;
+    }
+    struct Node *arg_type = GetTypeWithoutAttr(arg_type_with_attr);
+    assert(arg_type);
+    struct Node *local_var =
+        AddLocalVarToFrame(&ctx, CreateTokenStr(arg_ident_token), arg_type);
+    PushToList(node->arg_var_list, local_var);
+  }
+  AnalyzeNode(node->func_body, &ctx);
+  node->stack_size_needed = (node->stack_size_needed + 0xF) & ~0xF;
+  compiler->in_function = NULL;
 }
 
 static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
@@ -43,7 +153,6 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
     return;
   }
   if (node->type == kASTExprFuncCall) {
-    node->stack_size_needed = (GetLastLocalVarOffset(*ctx) + 0xF) & ~0xF;
     AllocReg(node);
     AnalyzeNode(node->func_expr, ctx);
     FreeReg(node->func_expr->reg);
@@ -56,30 +165,8 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
     }
     return;
   } else if (node->type == kASTFuncDef) {
-    AddFuncDef(ctx, CreateTokenStr(node->func_name_token), node);
-    struct SymbolEntry *saved_ctx = *ctx;
-    struct Node *arg_type_list = GetArgTypeList(node->func_type);
-    assert(arg_type_list);
-    node->arg_var_list = AllocList();
-    for (int i = 0; i < GetSizeOfList(arg_type_list); i++) {
-      struct Node *arg_type_with_attr = GetNodeAt(arg_type_list, i);
-      struct Node *arg_ident_token =
-          GetIdentifierTokenFromTypeAttr(arg_type_with_attr);
-      if (!arg_ident_token) {
-        PushToList(node->arg_var_list, NULL);
-        continue;
-      }
-      struct Node *arg_type = GetTypeWithoutAttr(arg_type_with_attr);
-      assert(arg_type);
-      struct Node *local_var =
-          AddLocalVar(ctx, CreateTokenStr(arg_ident_token), arg_type);
-      PushToList(node->arg_var_list, local_var);
-    }
-    assert(!in_function);
-    in_function = node;
-    AnalyzeNode(node->func_body, ctx);
-    in_function = NULL;
-    *ctx = saved_ctx;
+    DeclareFuncDef(node, ctx);
+    AnalyzeFuncDefBody(node, *ctx);
     return;
   }
   assert(node->op);
@@ -87,11 +174,11 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
     if (IsTokenWithType(node->op, kTokenIntegerConstant) ||
         IsTokenWithType(node->op, kTokenCharLiteral)) {
       AllocReg(node);
-      node->expr_type = CreateTypeBase(CreateToken("int"));
+      node->expr_type = GetIntType();
       return;
     } else if (IsTokenWithType(node->op, kTokenStringLiteral)) {
       AllocReg(node);
-      node->expr_type = CreateTypePointer(CreateTypeBase(CreateToken("char")));
+      node->expr_type = CreateTypePointer(GetCharType());
       return;
     } else if (IsEqualTokenWithCStr(node->op, "(")) {
       AnalyzeNode(node->right, ctx);
@@ -189,10 +276,8 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
       AnalyzeNode(node->right, ctx);
       FreeReg(node->left->reg);
       FreeReg(node->right->reg);
-      assert(
-          IsSameTypeExceptAttr(node->left->expr_type, node->right->expr_type));
       node->reg = node->cond->reg;
-      node->expr_type = GetRValueType(node->right->expr_type);
+      node->expr_type = GetTypeOfConditionalExpr(node);
       return;
     } else if (!node->left && node->right) {
       AnalyzeNode(node->right, ctx);
@@ -206,7 +291,7 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
       if (IsTokenWithType(node->op, kTokenKwSizeof)) {
         FreeReg(node->right->reg);
         AllocReg(node);
-        node->expr_type = CreateTypeBase(CreateToken("int"));
+        node->expr_type = GetIntType();
         return;
       }
       node->reg = node->right->reg;
@@ -234,18 +319,7 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
         return;
       }
     } else if (node->left && node->right) {
-      AnalyzeNode(node->left, ctx);
-      AnalyzeNode(node->right, ctx);
-      if (IsEqualTokenWithCStr(node->op, "=") ||
-          IsEqualTokenWithCStr(node->op, ",")) {
-        FreeReg(node->left->reg);
-        node->reg = node->right->reg;
-        node->expr_type = GetRValueType(node->right->expr_type);
-        return;
-      }
-      FreeReg(node->right->reg);
-      node->reg = node->left->reg;
-      node->expr_type = GetRValueType(node->left->expr_type);
+      AnalyzeBinaryExprChain(node, ctx);
       return;
     }
     assert(false);
@@ -273,7 +347,7 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
     struct Node *type = GetTypeWithoutAttr(raw_type);
     assert(type);
 
-    if (!in_function) {
+    if (!compiler->in_function) {
       // Top-level definitions
       if (IsASTDeclOfTypedef(node)) {
         return;
@@ -303,7 +377,7 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
     }
     // Local definitions
     assert(type_ident);
-    AddLocalVar(ctx, CreateTokenStr(type_ident), type);
+    AddLocalVarToFrame(ctx, CreateTokenStr(type_ident), type);
     assert(node->right->type == kASTDecltor);
     if (node->right->decltor_init_expr) {
       struct Node *left_expr = AllocNode(kASTExpr);
@@ -361,7 +435,14 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
 struct SymbolEntry *Analyze(struct Node *ast) {
   // Returns root context of symbols (including global vars)
   struct SymbolEntry *root_ctx = NULL;
-  in_function = NULL;
+  compiler->in_function = NULL;
   AnalyzeNode(ast, &root_ctx);
   return root_ctx;
 }
+
+void AnalyzeExternalDecl(struct Node *node, struct SymbolEntry **ctx) {
+  // Analyzes one declaration or function definition at the top level.
+  // ctx is updated to include the symbols declared by node.
+  compiler->in_function = NULL;
+  AnalyzeNode(node, ctx);
+}
@@ -0,0 +1,157 @@
+#include "compilium.h"
+
+// Arena
+//  Objects which die together (e.g. the AST and local symbols of a function)
+//  are carved out of large chunks and released at once by ResetArena().
+//  Chunks are kept for reuse, so the memory held by an arena is bounded by
+//  the largest group of objects allocated between two resets.
+//  NULL stands for the permanent heap, which is never released.
+//  Objects which live as long as the translation unit are allocated in
+//  compiler->unit_arena, which is NULL (the heap) except in the library.
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;
+  size_t used;
+};
+
+struct Arena {
+  struct ArenaChunk *chunks;
+  struct ArenaChunk *current;
+  size_t used;
+  size_t peak;
+};
+
+struct Arena *AllocArena(void) {
+  return calloc(1, sizeof(struct Arena));
+}
+
+static struct ArenaChunk *AllocArenaChunk(size_t size) {
+  if (size < ARENA_CHUNK_SIZE) size = ARENA_CHUNK_SIZE;
+  struct ArenaChunk *c = malloc(sizeof(struct ArenaChunk) + ARENA_ALIGN + size);
+  assert(c);
+  c->next = NULL;
+  c->size = size;
+  c->used = 0;
+  return c;
+}
+
+static char *GetArenaChunkData(struct ArenaChunk *c) {
+  // Skip the header so that the first object is aligned
+  return (char *)c + (sizeof(struct ArenaChunk) + ARENA_ALIGN - 1) /
+                         ARENA_ALIGN * ARENA_ALIGN;
+}
+
+void *AllocMemoryInArena(struct Arena *a, size_t size) {
+  // Returns zero-filled memory which lives until the arena is reset
+  if (!a) {
+    void *p = calloc(1, size);
+    assert(p);
+    return p;
+  }
+  size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  if (!a->current) {
+    a->chunks = a->current = AllocArenaChunk(size);
+  }
+  while (a->current->size - a->current->used < size) {
+    if (!a->current->next) a->current->next = AllocArenaChunk(size);
+    a->current = a->current->next;
+  }
+  char *p = GetArenaChunkData(a->current) + a->current->used;
+  a->current->used += size;
+  a->used += size;
+  if (a->peak < a->used) a->peak = a->used;
+  memset(p, 0, size);
+  return p;
+}
+
+void *AllocMemory(size_t size) {
+  return AllocMemoryInArena(compiler->current_arena, size);
+}
+
+char *AllocString(const char *begin, int length) {
+  char *s = AllocMemory(length + 1);
+  memcpy(s, begin, length);
+  s[length] = 0;
+  return s;
+}
+
+void ResetArena(struct Arena *a) {
+  assert(a);
+  for (struct ArenaChunk *c = a->chunks; c; c = c->next) {
+    c->used = 0;
+  }
+  a->current = a->chunks;
+  a->used = 0;
+}
+
+void FreeArena(struct Arena *a) {
+  assert(a);
+  for (struct ArenaChunk *c = a->chunks; c;) {
+    struct ArenaChunk *next = c->next;
+    free(c);
+    c = next;
+  }
+  free(a);
+}
+
+size_t GetPeakUsageOfArena(struct Arena *a) {
+  assert(a);
+  return a->peak;
+}
+
+struct Arena *GetCurrentArena(void) {
+  return compiler->current_arena;
+}
+
+struct Arena *SwitchArena(struct Arena *a) {
+  // Returns the previous arena so that the caller can switch back to it
+  struct Arena *prev = compiler->current_arena;
+  compiler->current_arena = a;
+  return prev;
+}
+
+void TestArena() {
+  fprintf(stderr, "Testing Arena...");
+  struct Arena *a = AllocArena();
+  struct Arena *prev = SwitchArena(a);
+  assert(prev == NULL);
+  struct Node *n1 = AllocNode(kNodeNone);
+  struct Node *n2 = AllocNode(kNodeNone);
+  assert(n1 != n2);
+  assert(((unsigned long)n1 % ARENA_ALIGN) == 0);
+  n1->size = 123;
+  // Objects larger than a chunk get their own chunk
+  char *big = AllocMemory(ARENA_CHUNK_SIZE * 2);
+  big[ARENA_CHUNK_SIZE * 2 - 1] = 1;
+  struct Node *list = AllocList();
+  for (int i = 0; i < 1000; i++) {
+    PushToList(list, n2);
+  }
+  assert(GetNodeAt(list, 999) == n2);
+  size_t peak = GetPeakUsageOfArena(a);
+  assert(peak > ARENA_CHUNK_SIZE * 2);
+  // Memory is reused after reset and zero-filled again
+  ResetArena(a);
+  struct Node *n3 = AllocNode(kNodeNone);
+  assert(n3 == n1);
+  assert(n3->size == 0);
+  for (int i = 0; i < 100; i++) {
+    ResetArena(a);
+    AllocMemory(ARENA_CHUNK_SIZE * 2);
+    list = AllocList();
+    for (int k = 0; k < 1000; k++) {
+      PushToList(list, n2);
+    }
+  }
+  assert(GetPeakUsageOfArena(a) == peak);
+  // Strings
+  const char *s = AllocString("hello, world", 5);
+  assert(strcmp(s, "hello") == 0);
+  SwitchArena(prev);
+  fprintf(stderr, "PASS\n");
+  exit(EXIT_SUCCESS);
+}
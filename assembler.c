@@ -0,0 +1,1420 @@
+#include "compilium.h"
+
+// Assembler
+//  Encodes the assembly printed by the generator into an ELF64 relocatable
+//  object without running an external assembler. Only the instructions and
+//  directives which the generator emits are supported. Jumps are always
+//  encoded with 32-bit displacements, so the code is not the same as the one
+//  from as, but it has the same behavior.
+//  The input is the text rather than the machine IR, because the functions
+//  from the parallel backend, the function cache and the unit cache reach
+//  the output only as text, and one parser serves all of them.
+//  The assembled code can also be run in this process (see JIT below).
+
+#define NUM_OF_SYMBOL_BUCKETS 16384
+#define REG_RIP 16
+#define REG_NONE -1
+
+struct AsmBuffer {
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+struct AsmSymbol {
+  struct AsmSymbol *next;  // in the same bucket
+  struct AsmSymbol *next_in_order;
+  const char *name;
+  struct AsmSection *section;  // NULL if undefined
+  long offset;
+  bool is_global;
+  int elf_index;
+  int got_index;  // --run: 1-based index in the GOT, 0 if not referred
+};
+
+struct AsmFixup {
+  // A 32-bit field at offset which refers to symbol
+  struct AsmFixup *next;
+  struct AsmSection *section;
+  long offset;
+  struct AsmSymbol *symbol;
+  long addend;
+  int reloc_type;
+};
+
+struct AsmSection {
+  const char *name;
+  int type;
+  int flags;
+  int align;
+  struct AsmBuffer contents;
+  long bss_size;  // .bss has no contents
+  struct AsmBuffer relocs;
+  int num_of_relocs;
+  int elf_index;
+  int elf_symbol_index;
+  char *jit_addr;  // --run: where the contents are loaded
+};
+
+enum AsmOperandKind {
+  kOperandReg,
+  kOperandImm,
+  kOperandMem,
+  kOperandSymbol,
+};
+
+struct AsmOperand {
+  enum AsmOperandKind kind;
+  int size;  // 0 if not known
+  int reg;
+  long imm;
+  // kOperandMem: [base + scale * index + disp + symbol]
+  int base;
+  int index;
+  int scale;
+  long disp;
+  struct AsmSymbol *symbol;
+  bool is_gotpcrel;
+};
+
+enum {
+  kSectionText,
+  kSectionData,
+  kSectionBss,
+  kSectionRodata,
+  kNumOfSections,
+};
+
+struct Assembler {
+  struct AsmSection sections[kNumOfSections];
+  struct AsmSection *current;
+  struct AsmSymbol *buckets[NUM_OF_SYMBOL_BUCKETS];
+  struct AsmSymbol *first_symbol;
+  struct AsmSymbol **last_symbol_holder;
+  struct AsmFixup *fixups;
+  struct AsmFixup **last_fixup_holder;
+  int line;
+  struct FunctionStats *stats;  // counts the instructions if not NULL
+};
+
+// ELF64
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB 2
+#define SHT_STRTAB 3
+#define SHT_RELA 4
+#define SHT_NOBITS 8
+#define SHF_WRITE 0x1
+#define SHF_ALLOC 0x2
+#define SHF_EXECINSTR 0x4
+#define SHF_INFO_LINK 0x40
+#define STB_LOCAL 0
+#define STB_GLOBAL 1
+#define STT_NOTYPE 0
+#define STT_SECTION 3
+#define R_X86_64_PC32 2
+#define R_X86_64_REX_GOTPCRELX 42
+
+struct ElfHeader {
+  unsigned char ident[16];
+  unsigned short type;
+  unsigned short machine;
+  unsigned int version;
+  unsigned long entry;
+  unsigned long phoff;
+  unsigned long shoff;
+  unsigned int flags;
+  unsigned short ehsize;
+  unsigned short phentsize;
+  unsigned short phnum;
+  unsigned short shentsize;
+  unsigned short shnum;
+  unsigned short shstrndx;
+};
+
+struct ElfSectionHeader {
+  unsigned int name;
+  unsigned int type;
+  unsigned long flags;
+  unsigned long addr;
+  unsigned long offset;
+  unsigned long size;
+  unsigned int link;
+  unsigned int info;
+  unsigned long addralign;
+  unsigned long entsize;
+};
+
+struct ElfSymbol {
+  unsigned int name;
+  unsigned char info;
+  unsigned char other;
+  unsigned short shndx;
+  unsigned long value;
+  unsigned long size;
+};
+
+struct ElfRela {
+  unsigned long offset;
+  unsigned long info;
+  long addend;
+};
+
+static _Noreturn void AsmError(struct Assembler *as, const char *msg,
+                               const char *s) {
+  Error("Assembler: %s at line %d: %s", msg, as->line, s);
+}
+
+static void AppendBytes(struct AsmBuffer *b, const void *p, size_t size) {
+  if (b->size + size > b->capacity) {
+    b->capacity = (b->size + size) * 2;
+    b->data = realloc(b->data, b->capacity);
+    assert(b->data);
+  }
+  memcpy(b->data + b->size, p, size);
+  b->size += size;
+}
+
+static void EmitByte(struct Assembler *as, int c) {
+  unsigned char b = c;
+  AppendBytes(&as->current->contents, &b, 1);
+}
+
+static void EmitInt32(struct Assembler *as, long v) {
+  for (int i = 0; i < 4; i++) EmitByte(as, (v >> (i * 8)) & 0xff);
+}
+
+static void EmitInt64(struct Assembler *as, long v) {
+  for (int i = 0; i < 8; i++) EmitByte(as, (v >> (i * 8)) & 0xff);
+}
+
+static long GetCurrentOffset(struct Assembler *as) {
+  return as->current->contents.size;
+}
+
+// Symbols
+
+static struct AsmSymbol *GetSymbol(struct Assembler *as, const char *name,
+                                   int len) {
+  unsigned long h = 2166136261UL;
+  for (int i = 0; i < len; i++) h = (h ^ (unsigned char)name[i]) * 16777619UL;
+  struct AsmSymbol **holder = &as->buckets[h % NUM_OF_SYMBOL_BUCKETS];
+  for (struct AsmSymbol *s = *holder; s; s = s->next) {
+    if (strncmp(s->name, name, len) == 0 && !s->name[len]) return s;
+  }
+  struct AsmSymbol *s = calloc(1, sizeof(struct AsmSymbol));
+  assert(s);
+  s->name = strndup(name, len);
+  s->next = *holder;
+  *holder = s;
+  *as->last_symbol_holder = s;
+  as->last_symbol_holder = &s->next_in_order;
+  return s;
+}
+
+static void DefineSymbol(struct Assembler *as, struct AsmSymbol *s) {
+  if (s->section) AsmError(as, "Symbol is already defined", s->name);
+  s->section = as->current;
+  s->offset = GetCurrentOffset(as);
+}
+
+static void EmitSymbolRef(struct Assembler *as, struct AsmSymbol *s,
+                          int reloc_type, int num_of_trailing_bytes) {
+  // Emits a 32-bit field relative to the end of the instruction, which is
+  // num_of_trailing_bytes after the field.
+  struct AsmFixup *f = calloc(1, sizeof(struct AsmFixup));
+  assert(f);
+  f->section = as->current;
+  f->offset = GetCurrentOffset(as);
+  f->symbol = s;
+  f->addend = -4 - num_of_trailing_bytes;
+  f->reloc_type = reloc_type;
+  *as->last_fixup_holder = f;
+  as->last_fixup_holder = &f->next;
+  EmitInt32(as, 0);
+}
+
+static void AddRelocation(struct AsmSection *sec, long offset, int sym_index,
+                          int type, long addend) {
+  struct ElfRela r = {.offset = offset,
+                      .info = ((unsigned long)sym_index << 32) | type,
+                      .addend = addend};
+  AppendBytes(&sec->relocs, &r, sizeof(r));
+  sec->num_of_relocs++;
+}
+
+static void ResolveFixups(struct Assembler *as) {
+  // Jumps and references within a section are resolved here. The others
+  // are left to the linker as relocations.
+  for (struct AsmFixup *f = as->fixups; f; f = f->next) {
+    struct AsmSymbol *s = f->symbol;
+    if (f->reloc_type == R_X86_64_PC32 && s->section == f->section &&
+        !s->is_global) {
+      int v = s->offset + f->addend - f->offset;
+      memcpy(f->section->contents.data + f->offset, &v, 4);
+      continue;
+    }
+    if (s->section && !s->is_global && f->reloc_type == R_X86_64_PC32) {
+      AddRelocation(f->section, f->offset, s->section->elf_symbol_index,
+                    f->reloc_type, s->offset + f->addend);
+      continue;
+    }
+    AddRelocation(f->section, f->offset, s->elf_index, f->reloc_type,
+                  f->addend);
+  }
+}
+
+// Operands
+
+static const char *reg_names[3][16] = {
+    {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10",
+     "r11", "r12", "r13", "r14", "r15"},
+    {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d",
+     "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"},
+    {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b",
+     "r11b", "r12b", "r13b", "r14b", "r15b"},
+};
+static const int reg_sizes[3] = {8, 4, 1};
+
+static bool FindRegister(const char *s, int len, int *reg, int *size) {
+  for (int k = 0; k < 3; k++) {
+    for (int i = 0; i < 16; i++) {
+      if ((int)strlen(reg_names[k][i]) == len &&
+          strncmp(reg_names[k][i], s, len) == 0) {
+        *reg = i;
+        *size = reg_sizes[k];
+        return true;
+      }
+    }
+  }
+  if (len == 3 && strncmp(s, "rip", 3) == 0) {
+    *reg = REG_RIP;
+    *size = 8;
+    return true;
+  }
+  return false;
+}
+
+static const char *SkipSpaces(const char *p) {
+  while (*p == ' ' || *p == '\t') p++;
+  return p;
+}
+
+static bool IsSymbolChar(char c) {
+  return ('0' <= c && c <= '9') || ('A' <= c && c <= 'Z') ||
+         ('a' <= c && c <= 'z') || c == '_' || c == '.' || c == '$' ||
+         c == '@';
+}
+
+static int GetWordLength(const char *p) {
+  int len = 0;
+  while (IsSymbolChar(p[len])) len++;
+  return len;
+}
+
+static const char *ParseMemoryOperand(struct Assembler *as, const char *p,
+                                      struct AsmOperand *op) {
+  // p points to the next of '['
+  op->kind = kOperandMem;
+  op->base = REG_NONE;
+  op->index = REG_NONE;
+  op->scale = 1;
+  int sign = 1;
+  for (;;) {
+    p = SkipSpaces(p);
+    if (*p == ']') return p + 1;
+    if (*p == '+' || *p == '-') {
+      sign = *p == '-' ? -1 : 1;
+      p++;
+      continue;
+    }
+    if ('0' <= *p && *p <= '9') {
+      char *end;
+      long v = strtol(p, &end, 10);
+      p = SkipSpaces(end);
+      if (*p == '*') {
+        // scale * index
+        p = SkipSpaces(p + 1);
+        int len = GetWordLength(p);
+        int size;
+        if (!FindRegister(p, len, &op->index, &size)) {
+          AsmError(as, "Expected an index register", p);
+        }
+        op->scale = v;
+        p += len;
+        continue;
+      }
+      op->disp += sign * v;
+      continue;
+    }
+    int len = GetWordLength(p);
+    if (!len) AsmError(as, "Unexpected character in memory operand", p);
+    int reg, size;
+    if (FindRegister(p, len, &reg, &size)) {
+      if (op->base == REG_NONE) {
+        op->base = reg;
+      } else {
+        op->index = reg;
+      }
+      p += len;
+      continue;
+    }
+    if (len > 9 && strncmp(p + len - 9, "@GOTPCREL", 9) == 0) {
+      op->is_gotpcrel = true;
+      op->symbol = GetSymbol(as, p, len - 9);
+    } else {
+      op->symbol = GetSymbol(as, p, len);
+    }
+    p += len;
+  }
+}
+
+static const char *ParseOperand(struct Assembler *as, const char *p,
+                                struct AsmOperand *op) {
+  p = SkipSpaces(p);
+  memset(op, 0, sizeof(*op));
+  static const struct {
+    const char *name;
+    int size;
+  } ptr_sizes[] = {{"qword", 8}, {"dword", 4}, {"byte", 1}};
+  for (int i = 0; i < 3; i++) {
+    int len = strlen(ptr_sizes[i].name);
+    if (strncmp(p, ptr_sizes[i].name, len) == 0 && p[len] == ' ') {
+      op->size = ptr_sizes[i].size;
+      p = SkipSpaces(p + len);
+      if (strncmp(p, "ptr", 3) != 0) AsmError(as, "Expected ptr", p);
+      p = SkipSpaces(p + 3);
+      break;
+    }
+  }
+  if (*p == '[') return ParseMemoryOperand(as, p + 1, op);
+  if (*p == '-' || ('0' <= *p && *p <= '9')) {
+    char *end;
+    op->kind = kOperandImm;
+    op->imm = strtol(p, &end, 0);
+    return end;
+  }
+  int len = GetWordLength(p);
+  if (!len) AsmError(as, "Expected an operand", p);
+  if (FindRegister(p, len, &op->reg, &op->size)) {
+    op->kind = kOperandReg;
+  } else {
+    op->kind = kOperandSymbol;
+    op->symbol = GetSymbol(as, p, len);
+  }
+  return p + len;
+}
+
+// Instructions
+
+static bool IsInt8(long v) { return -128 <= v && v <= 127; }
+static bool IsInt32(long v) { return -2147483648L <= v && v <= 2147483647L; }
+
+static void EmitREX(struct Assembler *as, int size, int reg,
+                    struct AsmOperand *rm) {
+  int rex = 0;
+  if (size == 8) rex |= 8;
+  if (reg >= 8) rex |= 4;
+  if (rm->kind == kOperandMem) {
+    if (rm->index != REG_NONE && rm->index >= 8) rex |= 2;
+    if (rm->base != REG_NONE && rm->base != REG_RIP && rm->base >= 8) rex |= 1;
+  } else if (rm->reg >= 8) {
+    rex |= 1;
+  }
+  // spl, bpl, sil and dil are encoded with REX
+  bool has_byte_reg = size == 1 && ((4 <= reg && reg < 8) ||
+                                    (rm->kind == kOperandReg &&
+                                     4 <= rm->reg && rm->reg < 8));
+  if (rex || has_byte_reg) EmitByte(as, 0x40 | rex);
+}
+
+static void EmitModRM(struct Assembler *as, int reg, struct AsmOperand *rm,
+                      int num_of_trailing_bytes) {
+  reg &= 7;
+  if (rm->kind == kOperandReg) {
+    EmitByte(as, 0xc0 | (reg << 3) | (rm->reg & 7));
+    return;
+  }
+  if (rm->base == REG_RIP) {
+    EmitByte(as, 0x05 | (reg << 3));
+    int type = rm->is_gotpcrel ? R_X86_64_REX_GOTPCRELX : R_X86_64_PC32;
+    EmitSymbolRef(as, rm->symbol, type, num_of_trailing_bytes);
+    return;
+  }
+  if (rm->base == REG_NONE || rm->symbol) {
+    AsmError(as, "Absolute addresses are not supported", "");
+  }
+  int mod = 2;
+  if (rm->disp == 0 && (rm->base & 7) != 5) {
+    mod = 0;
+  } else if (IsInt8(rm->disp)) {
+    mod = 1;
+  }
+  bool needs_sib = rm->index != REG_NONE || (rm->base & 7) == 4;
+  EmitByte(as, (mod << 6) | (reg << 3) | (needs_sib ? 4 : (rm->base & 7)));
+  if (needs_sib) {
+    int scale_bits = rm->scale == 8 ? 3 : rm->scale == 4 ? 2
+                                          : rm->scale == 2 ? 1
+                                                           : 0;
+    int index = rm->index == REG_NONE ? 4 : (rm->index & 7);
+    EmitByte(as, (scale_bits << 6) | (index << 3) | (rm->base & 7));
+  }
+  if (mod == 1) EmitByte(as, rm->disp);
+  if (mod == 2) EmitInt32(as, rm->disp);
+}
+
+static void EmitOp(struct Assembler *as, int size, const char *opcode,
+                   int opcode_len, int reg, struct AsmOperand *rm,
+                   int num_of_trailing_bytes) {
+  // Emits [REX] opcode ModRM [SIB] [disp]. reg is a register or an opcode
+  // extension.
+  EmitREX(as, size, reg, rm);
+  for (int i = 0; i < opcode_len; i++) EmitByte(as, opcode[i]);
+  EmitModRM(as, reg, rm, num_of_trailing_bytes);
+}
+
+static int GetOperandSize(struct Assembler *as, struct AsmOperand *a,
+                          struct AsmOperand *b) {
+  if (a->kind == kOperandReg) return a->size;
+  if (b && b->kind == kOperandReg) return b->size;
+  if (a->size) return a->size;
+  AsmError(as, "Operand size is not specified", "");
+}
+
+static const char *condition_codes[] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a",
+    "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+static int FindConditionCode(const char *s) {
+  if (strcmp(s, "z") == 0) return 4;
+  if (strcmp(s, "nz") == 0) return 5;
+  for (int i = 0; i < 16; i++) {
+    if (strcmp(condition_codes[i], s) == 0) return i;
+  }
+  return -1;
+}
+
+static const struct {
+  const char *name;
+  int opcode;  // op r/m, r (8-bit)
+  int ext;     // op r/m, imm
+} alu_ops[] = {
+    {"add", 0x00, 0}, {"or", 0x08, 1},  {"and", 0x20, 4},
+    {"sub", 0x28, 5}, {"xor", 0x30, 6}, {"cmp", 0x38, 7},
+};
+
+static const struct {
+  const char *name;
+  int ext;
+} unary_ops[] = {
+    {"not", 2}, {"neg", 3}, {"mul", 4}, {"imul", 5}, {"div", 6}, {"idiv", 7},
+};
+
+static const struct {
+  const char *name;
+  int ext;
+} shift_ops[] = {
+    {"shl", 4},
+    {"sal", 4},
+    {"shr", 5},
+    {"sar", 7},
+};
+
+static void AssembleALU(struct Assembler *as, int opcode, int ext,
+                        struct AsmOperand *dst, struct AsmOperand *src) {
+  int size = GetOperandSize(as, dst, src);
+  int w = size == 1 ? 0 : 1;
+  if (src->kind == kOperandImm) {
+    if (size == 1) {
+      EmitOp(as, size, "\x80", 1, ext, dst, 1);
+      EmitByte(as, src->imm);
+    } else if (IsInt8(src->imm)) {
+      EmitOp(as, size, "\x83", 1, ext, dst, 1);
+      EmitByte(as, src->imm);
+    } else {
+      EmitOp(as, size, "\x81", 1, ext, dst, 4);
+      EmitInt32(as, src->imm);
+    }
+    return;
+  }
+  char op;
+  if (src->kind == kOperandReg) {
+    op = opcode + w;
+    EmitOp(as, size, &op, 1, src->reg, dst, 0);
+    return;
+  }
+  if (dst->kind != kOperandReg) AsmError(as, "Invalid operands", "");
+  op = opcode + 2 + w;
+  EmitOp(as, size, &op, 1, dst->reg, src, 0);
+}
+
+static void AssembleMov(struct Assembler *as, struct AsmOperand *dst,
+                        struct AsmOperand *src) {
+  int size = GetOperandSize(as, dst, src);
+  int w = size == 1 ? 0 : 1;
+  char op;
+  if (src->kind == kOperandImm) {
+    if (dst->kind == kOperandReg && (size != 8 || !IsInt32(src->imm))) {
+      // mov r, imm
+      EmitREX(as, size, 0, dst);
+      EmitByte(as, (size == 1 ? 0xb0 : 0xb8) + (dst->reg & 7));
+      if (size == 8) {
+        EmitInt64(as, src->imm);
+      } else if (size == 4) {
+        EmitInt32(as, src->imm);
+      } else {
+        EmitByte(as, src->imm);
+      }
+      return;
+    }
+    op = 0xc6 + w;
+    EmitOp(as, size, &op, 1, 0, dst, size == 1 ? 1 : 4);
+    if (size == 1) {
+      EmitByte(as, src->imm);
+    } else {
+      EmitInt32(as, src->imm);
+    }
+    return;
+  }
+  if (src->kind == kOperandReg) {
+    op = 0x88 + w;
+    EmitOp(as, size, &op, 1, src->reg, dst, 0);
+    return;
+  }
+  if (dst->kind != kOperandReg) AsmError(as, "Invalid operands", "");
+  op = 0x8a + w;
+  EmitOp(as, size, &op, 1, dst->reg, src, 0);
+}
+
+static void AssembleJump(struct Assembler *as, int cc, struct AsmOperand *op) {
+  // cc: -1 for jmp
+  if (op->kind == kOperandReg) {
+    EmitOp(as, 4, "\xff", 1, 4, op, 0);
+    return;
+  }
+  if (op->kind != kOperandSymbol) AsmError(as, "Expected a label", "");
+  if (cc < 0) {
+    EmitByte(as, 0xe9);
+  } else {
+    EmitByte(as, 0x0f);
+    EmitByte(as, 0x80 + cc);
+  }
+  EmitSymbolRef(as, op->symbol, R_X86_64_PC32, 0);
+}
+
+static void AssembleInstruction(struct Assembler *as, const char *mnemonic,
+                                int num_of_ops, struct AsmOperand *ops) {
+  struct AsmOperand *dst = &ops[0];
+  struct AsmOperand *src = &ops[1];
+  if (strcmp(mnemonic, "ret") == 0 && num_of_ops == 0) {
+    EmitByte(as, 0xc3);
+    return;
+  }
+  if ((strcmp(mnemonic, "push") == 0 || strcmp(mnemonic, "pop") == 0) &&
+      num_of_ops == 1 && dst->kind == kOperandReg) {
+    if (dst->reg >= 8) EmitByte(as, 0x41);
+    EmitByte(as, (mnemonic[1] == 'u' ? 0x50 : 0x58) + (dst->reg & 7));
+    return;
+  }
+  if (strcmp(mnemonic, "call") == 0 && num_of_ops == 1) {
+    if (dst->kind == kOperandSymbol) {
+      EmitByte(as, 0xe8);
+      EmitSymbolRef(as, dst->symbol, R_X86_64_PC32, 0);
+      return;
+    }
+    EmitOp(as, 4, "\xff", 1, 2, dst, 0);
+    return;
+  }
+  if (strcmp(mnemonic, "jmp") == 0 && num_of_ops == 1) {
+    AssembleJump(as, -1, dst);
+    return;
+  }
+  if (mnemonic[0] == 'j' && num_of_ops == 1) {
+    int cc = FindConditionCode(mnemonic + 1);
+    if (cc >= 0) {
+      AssembleJump(as, cc, dst);
+      return;
+    }
+  }
+  if (strncmp(mnemonic, "set", 3) == 0 && num_of_ops == 1) {
+    int cc = FindConditionCode(mnemonic + 3);
+    if (cc >= 0) {
+      char op[2] = {0x0f, 0x90 + cc};
+      EmitOp(as, 1, op, 2, 0, dst, 0);
+      return;
+    }
+  }
+  if (num_of_ops == 2) {
+    for (int i = 0; i < (int)(sizeof(alu_ops) / sizeof(alu_ops[0])); i++) {
+      if (strcmp(mnemonic, alu_ops[i].name) == 0) {
+        AssembleALU(as, alu_ops[i].opcode, alu_ops[i].ext, dst, src);
+        return;
+      }
+    }
+    for (int i = 0; i < (int)(sizeof(shift_ops) / sizeof(shift_ops[0])); i++) {
+      if (strcmp(mnemonic, shift_ops[i].name) != 0) continue;
+      int size = GetOperandSize(as, dst, NULL);
+      if (src->kind == kOperandImm) {
+        EmitOp(as, size, size == 1 ? "\xc0" : "\xc1", 1, shift_ops[i].ext,
+               dst, 1);
+        EmitByte(as, src->imm);
+        return;
+      }
+      if (src->kind != kOperandReg || src->reg != 1 || src->size != 1) {
+        AsmError(as, "Shift count should be cl or an immediate", mnemonic);
+      }
+      EmitOp(as, size, size == 1 ? "\xd2" : "\xd3", 1, shift_ops[i].ext, dst,
+             0);
+      return;
+    }
+  }
+  if (strcmp(mnemonic, "mov") == 0 && num_of_ops == 2) {
+    AssembleMov(as, dst, src);
+    return;
+  }
+  if (dst->kind == kOperandReg && num_of_ops == 2) {
+    if (strcmp(mnemonic, "lea") == 0 && src->kind == kOperandMem) {
+      EmitOp(as, 8, "\x8d", 1, dst->reg, src, 0);
+      return;
+    }
+    if (strcmp(mnemonic, "movsxd") == 0) {
+      EmitOp(as, 8, "\x63", 1, dst->reg, src, 0);
+      return;
+    }
+    if (strcmp(mnemonic, "movsx") == 0 || strcmp(mnemonic, "movsxb") == 0 ||
+        strcmp(mnemonic, "movzx") == 0) {
+      // Only 8-bit sources are used
+      const char *op = mnemonic[3] == 'z' ? "\x0f\xb6" : "\x0f\xbe";
+      int size = dst->size;
+      if (src->kind == kOperandReg && 4 <= src->reg && src->reg < 8) {
+        // spl, bpl, sil and dil need REX even for 32-bit destinations
+        size = 8;
+      }
+      EmitOp(as, size, op, 2, dst->reg, src, 0);
+      return;
+    }
+    if (strcmp(mnemonic, "imul") == 0) {
+      EmitOp(as, dst->size, "\x0f\xaf", 2, dst->reg, src, 0);
+      return;
+    }
+  }
+  if (strcmp(mnemonic, "imul") == 0 && num_of_ops == 3 &&
+      dst->kind == kOperandReg && ops[2].kind == kOperandImm) {
+    if (IsInt8(ops[2].imm)) {
+      EmitOp(as, dst->size, "\x6b", 1, dst->reg, src, 1);
+      EmitByte(as, ops[2].imm);
+    } else {
+      EmitOp(as, dst->size, "\x69", 1, dst->reg, src, 4);
+      EmitInt32(as, ops[2].imm);
+    }
+    return;
+  }
+  if (num_of_ops == 1 && dst->kind != kOperandImm) {
+    for (int i = 0; i < (int)(sizeof(unary_ops) / sizeof(unary_ops[0])); i++) {
+      if (strcmp(mnemonic, unary_ops[i].name) != 0) continue;
+      int size = GetOperandSize(as, dst, NULL);
+      EmitOp(as, size, size == 1 ? "\xf6" : "\xf7", 1, unary_ops[i].ext, dst,
+             0);
+      return;
+    }
+    if (strcmp(mnemonic, "inc") == 0 || strcmp(mnemonic, "dec") == 0) {
+      int size = GetOperandSize(as, dst, NULL);
+      EmitOp(as, size, size == 1 ? "\xfe" : "\xff", 1, mnemonic[0] == 'd',
+             dst, 0);
+      return;
+    }
+  }
+  AsmError(as, "Unsupported instruction", mnemonic);
+}
+
+// Directives
+
+static struct AsmSection *FindSection(struct Assembler *as, const char *name) {
+  for (int i = 0; i < kNumOfSections; i++) {
+    if (strcmp(as->sections[i].name, name) == 0) return &as->sections[i];
+  }
+  return NULL;
+}
+
+static const char *EmitStringLiteral(struct Assembler *as, const char *p) {
+  // p points to the opening quote. Returns the next of the closing quote.
+  if (*p != '"') AsmError(as, "Expected a string literal", p);
+  p++;
+  while (*p != '"') {
+    if (!*p) AsmError(as, "Unterminated string literal", "");
+    if (*p != '\\') {
+      EmitByte(as, *p++);
+      continue;
+    }
+    p++;
+    if ('0' <= *p && *p <= '7') {
+      int v = 0;
+      for (int i = 0; i < 3 && '0' <= *p && *p <= '7'; i++) {
+        v = v * 8 + (*p++ - '0');
+      }
+      EmitByte(as, v);
+      continue;
+    }
+    if (*p == 'x') {
+      char *end;
+      EmitByte(as, strtol(p + 1, &end, 16));
+      p = end;
+      continue;
+    }
+    static const char escapes[] = "n\nt\tr\rb\bf\fv\va\a";
+    char c = *p;
+    for (int i = 0; escapes[i]; i += 2) {
+      if (escapes[i] == *p) c = escapes[i + 1];
+    }
+    EmitByte(as, c);
+    p++;
+  }
+  return p + 1;
+}
+
+static void AssembleDirective(struct Assembler *as, const char *name,
+                              const char *p) {
+  if (strcmp(name, ".intel_syntax") == 0) return;
+  if (strcmp(name, ".global") == 0 || strcmp(name, ".globl") == 0) {
+    int len = GetWordLength(p);
+    GetSymbol(as, p, len)->is_global = true;
+    return;
+  }
+  char section_name[32];
+  if (strcmp(name, ".section") == 0) {
+    int len = GetWordLength(p);
+    if (len >= (int)sizeof(section_name)) AsmError(as, "Unknown section", p);
+    memcpy(section_name, p, len);
+    section_name[len] = 0;
+    name = section_name;
+  }
+  struct AsmSection *section = FindSection(as, name);
+  if (section) {
+    as->current = section;
+    return;
+  }
+  if (as->current->type == SHT_NOBITS) {
+    if (strcmp(name, ".zero") == 0) {
+      as->current->bss_size += strtol(p, NULL, 10);
+      return;
+    }
+    AsmError(as, "Only .zero is allowed in .bss", name);
+  }
+  if (strcmp(name, ".asciz") == 0 || strcmp(name, ".string") == 0) {
+    EmitStringLiteral(as, p);
+    EmitByte(as, 0);
+    return;
+  }
+  if (strcmp(name, ".byte") == 0) {
+    for (;;) {
+      char *end;
+      EmitByte(as, strtol(p, &end, 0));
+      p = SkipSpaces(end);
+      if (*p != ',') break;
+      p++;
+    }
+    return;
+  }
+  if (strcmp(name, ".zero") == 0) {
+    long size = strtol(p, NULL, 10);
+    for (long i = 0; i < size; i++) EmitByte(as, 0);
+    return;
+  }
+  AsmError(as, "Unsupported directive", name);
+}
+
+// Lines
+
+static int FindCommentBegin(const char *line, int len) {
+  // Comments begin with # or //, which may appear in string literals
+  bool in_string = false;
+  for (int i = 0; i < len; i++) {
+    if (in_string) {
+      if (line[i] == '\\') {
+        i++;
+      } else if (line[i] == '"') {
+        in_string = false;
+      }
+      continue;
+    }
+    if (line[i] == '"') in_string = true;
+    if (line[i] == '#') return i;
+    if (line[i] == '/' && i + 1 < len && line[i + 1] == '/') return i;
+  }
+  return len;
+}
+
+static void CountInstruction(struct FunctionStats *stats, const char *mnemonic,
+                             int num_of_ops, struct AsmOperand *ops) {
+  // Memory operands of push, pop and lea are not counted as loads or stores.
+  // A memory destination of an instruction other than mov is also read.
+  stats->num_of_insts++;
+  if (strcmp(mnemonic, "push") == 0) {
+    stats->num_of_pushes++;
+    return;
+  }
+  if (strcmp(mnemonic, "pop") == 0) {
+    stats->num_of_pops++;
+    return;
+  }
+  if (strcmp(mnemonic, "call") == 0) stats->num_of_calls++;
+  if (strcmp(mnemonic, "idiv") == 0) stats->num_of_idivs++;
+  if (strcmp(mnemonic, "lea") == 0) return;
+  for (int i = 0; i < num_of_ops; i++) {
+    if (ops[i].kind != kOperandMem) continue;
+    if (i == 0) stats->num_of_stores++;
+    if (i != 0 || strcmp(mnemonic, "mov") != 0) stats->num_of_loads++;
+  }
+}
+
+static void AssembleLine(struct Assembler *as, const char *p) {
+  for (;;) {
+    p = SkipSpaces(p);
+    if (!*p) return;
+    int len = GetWordLength(p);
+    if (!len) AsmError(as, "Unexpected character", p);
+    if (p[len] == ':') {
+      DefineSymbol(as, GetSymbol(as, p, len));
+      p += len + 1;
+      continue;
+    }
+    char mnemonic[32];
+    if (len >= (int)sizeof(mnemonic)) AsmError(as, "Unknown mnemonic", p);
+    memcpy(mnemonic, p, len);
+    mnemonic[len] = 0;
+    p = SkipSpaces(p + len);
+    if (mnemonic[0] == '.') {
+      AssembleDirective(as, mnemonic, p);
+      return;
+    }
+    struct AsmOperand ops[3];
+    int num_of_ops = 0;
+    while (*p) {
+      if (num_of_ops >= 3) AsmError(as, "Too many operands", mnemonic);
+      p = SkipSpaces(ParseOperand(as, p, &ops[num_of_ops++]));
+      if (*p == ',') {
+        p++;
+      } else if (*p) {
+        AsmError(as, "Unexpected character after operand", p);
+      }
+    }
+    AssembleInstruction(as, mnemonic, num_of_ops, ops);
+    if (as->stats) CountInstruction(as->stats, mnemonic, num_of_ops, ops);
+    return;
+  }
+}
+
+static void InitAssembler(struct Assembler *as) {
+  static const struct {
+    const char *name;
+    int type;
+    int flags;
+    int align;
+  } sections[kNumOfSections] = {
+      {".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16},
+      {".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 8},
+      {".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE, 8},
+      {".rodata", SHT_PROGBITS, SHF_ALLOC, 8},
+  };
+  memset(as, 0, sizeof(*as));
+  for (int i = 0; i < kNumOfSections; i++) {
+    as->sections[i].name = sections[i].name;
+    as->sections[i].type = sections[i].type;
+    as->sections[i].flags = sections[i].flags;
+    as->sections[i].align = sections[i].align;
+  }
+  as->current = &as->sections[kSectionText];
+  as->last_symbol_holder = &as->first_symbol;
+  as->last_fixup_holder = &as->fixups;
+}
+
+static void AssembleText(struct Assembler *as, const char *text, size_t size) {
+  char *line = NULL;
+  int capacity = 0;
+  for (size_t i = 0; i < size;) {
+    size_t end = i;
+    while (end < size && text[end] != '\n') end++;
+    int len = FindCommentBegin(text + i, end - i);
+    if (len + 1 > capacity) {
+      capacity = (len + 1) * 2;
+      line = realloc(line, capacity);
+      assert(line);
+    }
+    memcpy(line, text + i, len);
+    line[len] = 0;
+    as->line++;
+    AssembleLine(as, line);
+    i = end + 1;
+  }
+  free(line);
+}
+
+// ELF writer
+
+struct ObjectLayout {
+  // Contents of the object file after the header
+  struct AsmBuffer *parts[2 * kNumOfSections + 4];
+  unsigned long offsets[2 * kNumOfSections + 4];
+  int num_of_parts;
+  unsigned long size;
+  struct AsmBuffer section_headers;
+  struct AsmBuffer shstrtab;
+};
+
+static void AppendString(struct AsmBuffer *strtab, const char *s,
+                         unsigned int *offset) {
+  *offset = strtab->size;
+  AppendBytes(strtab, s, strlen(s) + 1);
+}
+
+static void AddSectionHeader(struct ObjectLayout *l, const char *name,
+                             struct ElfSectionHeader *shdr,
+                             struct AsmBuffer *contents) {
+  // contents: NULL if the section has no contents in the file
+  l->size = (l->size + shdr->addralign - 1) / shdr->addralign *
+            shdr->addralign;
+  shdr->offset = l->size;
+  if (contents) {
+    shdr->size = contents->size;
+    l->parts[l->num_of_parts] = contents;
+    l->offsets[l->num_of_parts++] = l->size;
+    l->size += contents->size;
+  }
+  AppendString(&l->shstrtab, name, &shdr->name);
+  AppendBytes(&l->section_headers, shdr, sizeof(*shdr));
+}
+
+static void WriteObject(struct Assembler *as, FILE *fp) {
+  struct AsmBuffer strtab = {0};
+  struct AsmBuffer symtab = {0};
+  AppendBytes(&strtab, "", 1);
+  struct ElfSymbol null_symbol = {0};
+  AppendBytes(&symtab, &null_symbol, sizeof(null_symbol));
+  // Symbols of sections are referred from relocations to local labels
+  int num_of_sections = 1;
+  int num_of_symbols = 1;
+  for (int i = 0; i < kNumOfSections; i++) {
+    struct AsmSection *sec = &as->sections[i];
+    if (i != kSectionText && !sec->contents.size && !sec->bss_size) continue;
+    sec->elf_index = num_of_sections++;
+    sec->elf_symbol_index = num_of_symbols++;
+    struct ElfSymbol sym = {.info = (STB_LOCAL << 4) | STT_SECTION,
+                            .shndx = sec->elf_index};
+    AppendBytes(&symtab, &sym, sizeof(sym));
+  }
+  int first_global_symbol = num_of_symbols;
+  for (struct AsmSymbol *s = as->first_symbol; s; s = s->next_in_order) {
+    if (s->section && !s->is_global) continue;
+    s->elf_index = num_of_symbols++;
+    struct ElfSymbol sym = {.info = (STB_GLOBAL << 4) | STT_NOTYPE};
+    AppendString(&strtab, s->name, &sym.name);
+    if (s->section) {
+      sym.shndx = s->section->elf_index;
+      sym.value = s->offset;
+    }
+    AppendBytes(&symtab, &sym, sizeof(sym));
+  }
+  ResolveFixups(as);
+
+  struct ObjectLayout l = {.size = sizeof(struct ElfHeader)};
+  AppendBytes(&l.shstrtab, "", 1);
+  struct ElfSectionHeader null_shdr = {0};
+  AppendBytes(&l.section_headers, &null_shdr, sizeof(null_shdr));
+  for (int i = 0; i < kNumOfSections; i++) {
+    struct AsmSection *sec = &as->sections[i];
+    if (!sec->elf_index) continue;
+    struct ElfSectionHeader shdr = {
+        .type = sec->type, .flags = sec->flags, .addralign = sec->align};
+    if (sec->type == SHT_NOBITS) {
+      shdr.size = sec->bss_size;
+      AddSectionHeader(&l, sec->name, &shdr, NULL);
+    } else {
+      AddSectionHeader(&l, sec->name, &shdr, &sec->contents);
+    }
+  }
+  int symtab_index = num_of_sections;
+  for (int i = 0; i < kNumOfSections; i++) {
+    struct AsmSection *sec = &as->sections[i];
+    if (!sec->num_of_relocs) continue;
+    symtab_index++;
+  }
+  for (int i = 0; i < kNumOfSections; i++) {
+    struct AsmSection *sec = &as->sections[i];
+    if (!sec->num_of_relocs) continue;
+    char name[32];
+    snprintf(name, sizeof(name), ".rela%s", sec->name);
+    struct ElfSectionHeader shdr = {.type = SHT_RELA,
+                                    .flags = SHF_INFO_LINK,
+                                    .link = symtab_index,
+                                    .info = sec->elf_index,
+                                    .addralign = 8,
+                                    .entsize = sizeof(struct ElfRela)};
+    AddSectionHeader(&l, name, &shdr, &sec->relocs);
+  }
+  struct ElfSectionHeader symtab_shdr = {.type = SHT_SYMTAB,
+                                         .link = symtab_index + 1,
+                                         .info = first_global_symbol,
+                                         .addralign = 8,
+                                         .entsize = sizeof(struct ElfSymbol)};
+  AddSectionHeader(&l, ".symtab", &symtab_shdr, &symtab);
+  struct ElfSectionHeader strtab_shdr = {.type = SHT_STRTAB, .addralign = 1};
+  AddSectionHeader(&l, ".strtab", &strtab_shdr, &strtab);
+  // The stack of the linked program should not be executable
+  struct ElfSectionHeader note_shdr = {.type = SHT_PROGBITS, .addralign = 1};
+  AddSectionHeader(&l, ".note.GNU-stack", &note_shdr, NULL);
+  struct ElfSectionHeader shstrtab_shdr = {.type = SHT_STRTAB, .addralign = 1};
+  AppendString(&l.shstrtab, ".shstrtab", &shstrtab_shdr.name);
+  // The name of .shstrtab is in itself, so it is added by hand
+  l.size = (l.size + 7) / 8 * 8;
+  shstrtab_shdr.offset = l.size;
+  shstrtab_shdr.size = l.shstrtab.size;
+  l.parts[l.num_of_parts] = &l.shstrtab;
+  l.offsets[l.num_of_parts++] = l.size;
+  l.size += l.shstrtab.size;
+  AppendBytes(&l.section_headers, &shstrtab_shdr, sizeof(shstrtab_shdr));
+  l.size = (l.size + 7) / 8 * 8;
+
+  int num_of_shdrs = l.section_headers.size / sizeof(struct ElfSectionHeader);
+  struct ElfHeader ehdr = {.ident = {0x7f, 'E', 'L', 'F', 2, 1, 1},
+                           .type = 1,      // ET_REL
+                           .machine = 62,  // EM_X86_64
+                           .version = 1,
+                           .shoff = l.size,
+                           .ehsize = sizeof(struct ElfHeader),
+                           .shentsize = sizeof(struct ElfSectionHeader),
+                           .shnum = num_of_shdrs,
+                           .shstrndx = num_of_shdrs - 1};
+  fwrite(&ehdr, sizeof(ehdr), 1, fp);
+  unsigned long written = sizeof(ehdr);
+  for (int i = 0; i < l.num_of_parts; i++) {
+    for (; written < l.offsets[i]; written++) fputc(0, fp);
+    fwrite(l.parts[i]->data, 1, l.parts[i]->size, fp);
+    written += l.parts[i]->size;
+  }
+  for (; written < l.size; written++) fputc(0, fp);
+  fwrite(l.section_headers.data, 1, l.section_headers.size, fp);
+  free(l.section_headers.data);
+  free(l.shstrtab.data);
+  free(symtab.data);
+  free(strtab.data);
+}
+
+static void FreeAssembler(struct Assembler *as) {
+  for (int i = 0; i < kNumOfSections; i++) {
+    free(as->sections[i].contents.data);
+    free(as->sections[i].relocs.data);
+  }
+  for (struct AsmSymbol *s = as->first_symbol; s;) {
+    struct AsmSymbol *next = s->next_in_order;
+    free((char *)s->name);
+    free(s);
+    s = next;
+  }
+  for (struct AsmFixup *f = as->fixups; f;) {
+    struct AsmFixup *next = f->next;
+    free(f);
+    f = next;
+  }
+}
+
+void WriteObjectFile(const char *assembly, size_t size, FILE *fp) {
+  // Assembles the output of the generator into fp as an ELF64 object
+  struct Assembler *as = malloc(sizeof(struct Assembler));
+  assert(as);
+  InitAssembler(as);
+  AssembleText(as, assembly, size);
+  WriteObject(as, fp);
+  FreeAssembler(as);
+  free(as);
+}
+
+// Machine IR
+//  --stats encodes the instructions of a function from the machine IR, so
+//  that they are counted without printing them.
+
+static struct AsmSymbol *GetLabelSymbol(struct Assembler *as, int label) {
+  char name[16];
+  snprintf(name, sizeof(name), "L%d", label);
+  return GetSymbol(as, name, strlen(name));
+}
+
+static int FindMachineRegister(struct Assembler *as, const char *name) {
+  int reg, size;
+  if (!FindRegister(name, strlen(name), &reg, &size)) {
+    AsmError(as, "Unknown register", name);
+  }
+  return reg;
+}
+
+static void ConvertMachineOperand(struct Assembler *as,
+                                  struct MachineOperand *o,
+                                  struct AsmOperand *op) {
+  memset(op, 0, sizeof(*op));
+  if (o->kind == kMachineOperandReg || o->kind == kMachineOperandFixedReg) {
+    const char *name = o->kind == kMachineOperandReg
+                           ? GetMachineRegName(o->reg, o->size)
+                           : o->name;
+    op->kind = kOperandReg;
+    if (!FindRegister(name, strlen(name), &op->reg, &op->size)) {
+      AsmError(as, "Unknown register", name);
+    }
+    return;
+  }
+  if (o->kind == kMachineOperandImm) {
+    op->kind = kOperandImm;
+    op->imm = o->imm;
+    return;
+  }
+  if (o->kind == kMachineOperandLabel) {
+    op->kind = kOperandSymbol;
+    op->symbol = GetLabelSymbol(as, o->label);
+    return;
+  }
+  if (o->kind == kMachineOperandSymbol) {
+    op->kind = kOperandSymbol;
+    op->symbol = GetSymbol(as, o->symbol, strlen(o->symbol));
+    return;
+  }
+  assert(o->kind == kMachineOperandMem);
+  op->kind = kOperandMem;
+  op->size = o->size;
+  op->base = FindMachineRegister(as, o->name ? o->name : reg_names_64[o->reg]);
+  op->index = REG_NONE;
+  op->scale = 1;
+  if (o->index_reg) {
+    op->index = FindMachineRegister(as, reg_names_64[o->index_reg]);
+    op->scale = o->scale;
+  }
+  op->disp = o->disp;
+  if (o->symbol) {
+    op->symbol = GetSymbol(as, o->symbol, strlen(o->symbol));
+    op->is_gotpcrel = true;
+  } else if (o->label) {
+    op->symbol = GetLabelSymbol(as, o->label);
+  }
+}
+
+static void AssembleMachineInsts(struct Assembler *as,
+                                 struct MachineInst *insts, int n) {
+  for (int i = 0; i < n; i++) {
+    struct MachineInst *inst = &insts[i];
+    struct AsmOperand ops[MAX_MACHINE_OPERANDS];
+    int num_of_ops = inst->kind == kMachineInst ? inst->num_of_operands : 1;
+    for (int k = 0; k < num_of_ops; k++) {
+      ConvertMachineOperand(as, &inst->operands[k], &ops[k]);
+    }
+    as->line = i + 1;
+    if (inst->kind == kMachineLabel) {
+      DefineSymbol(as, ops[0].symbol);
+      continue;
+    }
+    if (inst->kind == kMachineDirective) {
+      if (strcmp(inst->opcode, ".global") != 0) {
+        AsmError(as, "Unsupported directive", inst->opcode);
+      }
+      ops[0].symbol->is_global = true;
+      continue;
+    }
+    AssembleInstruction(as, inst->opcode, num_of_ops, ops);
+    if (as->stats) CountInstruction(as->stats, inst->opcode, num_of_ops, ops);
+  }
+}
+
+void CountMachineInsts(struct MachineInst *insts, int n,
+                       struct FunctionStats *stats) {
+  // Adds the instructions and the bytes of their code to stats. Symbols are
+  // not resolved, so the instructions can refer to the others.
+  struct Assembler *as = malloc(sizeof(struct Assembler));
+  assert(as);
+  InitAssembler(as);
+  as->stats = stats;
+  AssembleMachineInsts(as, insts, n);
+  stats->num_of_bytes += as->sections[kSectionText].contents.size;
+  FreeAssembler(as);
+  free(as);
+}
+
+// JIT
+//  --run loads the sections into memory and calls main in this process.
+//  Undefined symbols are resolved by dlsym, and the GOT for @GOTPCREL is
+//  placed after the data. Text is on its own pages to be made executable.
+
+#define JIT_PAGE_SIZE 4096
+
+static unsigned long AlignTo(unsigned long v, unsigned long align) {
+  return (v + align - 1) / align * align;
+}
+
+static char *GetJITSymbolAddress(struct AsmSymbol *s) {
+  if (s->section) return s->section->jit_addr + s->offset;
+  char *addr = dlsym(RTLD_DEFAULT, s->name);
+  if (!addr) Error("Undefined symbol: %s", s->name);
+  return addr;
+}
+
+static int CompareSymbolOffsets(const void *a, const void *b) {
+  long diff = (*(struct AsmSymbol **)a)->offset -
+              (*(struct AsmSymbol **)b)->offset;
+  return (diff > 0) - (diff < 0);
+}
+
+static void WritePerfMap(struct Assembler *as) {
+  // perf symbolizes JIT code with /tmp/perf-<pid>.map, which has
+  // "<start> <size> <name>" in hex for each function.
+  struct AsmSection *text = &as->sections[kSectionText];
+  int num_of_functions = 0;
+  for (struct AsmSymbol *s = as->first_symbol; s; s = s->next_in_order) {
+    if (s->section == text && s->is_global) num_of_functions++;
+  }
+  struct AsmSymbol **functions =
+      malloc(sizeof(struct AsmSymbol *) * (num_of_functions + 1));
+  assert(functions);
+  int i = 0;
+  for (struct AsmSymbol *s = as->first_symbol; s; s = s->next_in_order) {
+    if (s->section == text && s->is_global) functions[i++] = s;
+  }
+  qsort(functions, num_of_functions, sizeof(struct AsmSymbol *),
+        CompareSymbolOffsets);
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+  FILE *fp = fopen(path, "w");
+  if (!fp) Error("Cannot open %s", path);
+  for (i = 0; i < num_of_functions; i++) {
+    long end = i + 1 < num_of_functions ? functions[i + 1]->offset
+                                         : (long)text->contents.size;
+    fprintf(fp, "%lx %lx %s\n",
+            (unsigned long)(text->jit_addr + functions[i]->offset),
+            end - functions[i]->offset, functions[i]->name);
+  }
+  fclose(fp);
+  free(functions);
+}
+
+int RunAssembly(const char *assembly, size_t size, int argc, char **argv) {
+  // Returns the value returned from main
+  struct Assembler *as = malloc(sizeof(struct Assembler));
+  assert(as);
+  InitAssembler(as);
+  AssembleText(as, assembly, size);
+  unsigned long offsets[kNumOfSections];
+  unsigned long total_size = 0;
+  for (int i = 0; i < kNumOfSections; i++) {
+    struct AsmSection *sec = &as->sections[i];
+    total_size = AlignTo(total_size, i == kSectionData ? JIT_PAGE_SIZE
+                                                       : (unsigned)sec->align);
+    offsets[i] = total_size;
+    total_size +=
+        sec->type == SHT_NOBITS ? (unsigned long)sec->bss_size
+                                : sec->contents.size;
+  }
+  int num_of_got_entries = 0;
+  for (struct AsmFixup *f = as->fixups; f; f = f->next) {
+    if (f->reloc_type != R_X86_64_REX_GOTPCRELX || f->symbol->got_index) {
+      continue;
+    }
+    f->symbol->got_index = ++num_of_got_entries;
+  }
+  unsigned long got_offset = AlignTo(total_size, 8);
+  total_size = got_offset + sizeof(void *) * num_of_got_entries;
+
+  char *base = mmap(NULL, total_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) Error("Failed to allocate memory to run the code");
+  for (int i = 0; i < kNumOfSections; i++) {
+    struct AsmSection *sec = &as->sections[i];
+    sec->jit_addr = base + offsets[i];
+    if (sec->type != SHT_NOBITS) {
+      memcpy(sec->jit_addr, sec->contents.data, sec->contents.size);
+    }
+  }
+  char **got = (char **)(base + got_offset);
+  for (struct AsmSymbol *s = as->first_symbol; s; s = s->next_in_order) {
+    if (s->got_index) got[s->got_index - 1] = GetJITSymbolAddress(s);
+  }
+  for (struct AsmFixup *f = as->fixups; f; f = f->next) {
+    char *field = f->section->jit_addr + f->offset;
+    char *target = f->reloc_type == R_X86_64_REX_GOTPCRELX
+                       ? (char *)&got[f->symbol->got_index - 1]
+                       : GetJITSymbolAddress(f->symbol);
+    long v = target + f->addend - field;
+    if (!IsInt32(v)) Error("Symbol is too far to refer: %s", f->symbol->name);
+    int v32 = v;
+    memcpy(field, &v32, 4);
+  }
+  struct AsmSection *text = &as->sections[kSectionText];
+  if (mprotect(base, AlignTo(text->contents.size, JIT_PAGE_SIZE),
+               PROT_READ | PROT_EXEC) != 0) {
+    Error("Failed to make the code executable");
+  }
+  if (compiler->should_write_perf_map) WritePerfMap(as);
+
+  struct AsmSymbol *main_symbol = GetSymbol(as, "main", 4);
+  if (main_symbol->section != text) Error("main is not defined");
+  // ISO C has no cast from an object pointer to a function pointer
+  void *main_addr = text->jit_addr + main_symbol->offset;
+  int (*main_func)(int, char **);
+  memcpy(&main_func, &main_addr, sizeof(main_func));
+  int result = main_func(argc, argv);
+  fflush(stdout);
+  munmap(base, total_size);
+  FreeAssembler(as);
+  free(as);
+  return result;
+}
+
+static void ExpectEncoding(const char *assembly, const char *expected,
+                           int size) {
+  struct Assembler *as = malloc(sizeof(struct Assembler));
+  assert(as);
+  InitAssembler(as);
+  AssembleText(as, assembly, strlen(assembly));
+  ResolveFixups(as);
+  struct AsmBuffer *text = &as->sections[kSectionText].contents;
+  if ((int)text->size != size || memcmp(text->data, expected, size) != 0) {
+    fprintf(stderr, "\nEncoding of %s is wrong:", assembly);
+    for (size_t i = 0; i < text->size; i++) {
+      fprintf(stderr, " %02x", (unsigned char)text->data[i]);
+    }
+    fputc('\n', stderr);
+    assert(false);
+  }
+  FreeAssembler(as);
+  free(as);
+}
+
+void TestAssembler(void) {
+  fprintf(stderr, "Testing Assembler...");
+  ExpectEncoding("ret\n", "\xc3", 1);
+  ExpectEncoding("push rbp\npop r12\n", "\x55\x41\x5c", 3);
+  ExpectEncoding("mov rbp, rsp", "\x48\x89\xe5", 3);
+  ExpectEncoding("mov [rbp - 4], edi // arg[0]", "\x89\x7d\xfc", 3);
+  ExpectEncoding("mov r10, [r12]", "\x4d\x8b\x14\x24", 4);
+  ExpectEncoding("mov [r13], r8b", "\x45\x88\x45\x00", 4);
+  ExpectEncoding("mov [rdi], sil", "\x40\x88\x37", 3);
+  ExpectEncoding("mov rdi, 5", "\x48\xc7\xc7\x05\x00\x00\x00", 7);
+  ExpectEncoding("mov rax, 4294967296",
+                 "\x48\xb8\x00\x00\x00\x00\x01\x00\x00\x00", 10);
+  ExpectEncoding("movsxd rsi, dword ptr[rsi]", "\x48\x63\x36", 3);
+  ExpectEncoding("movsx r8, byte ptr [r8]", "\x4d\x0f\xbe\x00", 4);
+  ExpectEncoding("movzx rdi, dil", "\x48\x0f\xb6\xff", 4);
+  ExpectEncoding("lea rdi, [rbp - 200]", "\x48\x8d\xbd\x38\xff\xff\xff", 7);
+  ExpectEncoding("lea rdi, [rdi + 8 * rsi]", "\x48\x8d\x3c\xf7", 4);
+  ExpectEncoding("add rsp, 16 # free", "\x48\x83\xc4\x10", 4);
+  ExpectEncoding("sub rsp, 1000", "\x48\x81\xec\xe8\x03\x00\x00", 7);
+  ExpectEncoding("add dword ptr [rdi], esi", "\x01\x37", 2);
+  ExpectEncoding("cmp r10, 0", "\x49\x83\xfa\x00", 4);
+  ExpectEncoding("xor rdx, rdx", "\x48\x31\xd2", 3);
+  ExpectEncoding("setnz r11b", "\x41\x0f\x95\xc3", 4);
+  ExpectEncoding("imul rsi", "\x48\xf7\xee", 3);
+  ExpectEncoding("imul rsi, rsi, 8", "\x48\x6b\xf6\x08", 4);
+  ExpectEncoding("idiv r9", "\x49\xf7\xf9", 3);
+  ExpectEncoding("sar rdi, cl", "\x48\xd3\xff", 3);
+  ExpectEncoding("inc qword ptr [rdi]", "\x48\xff\x07", 3);
+  ExpectEncoding("dec byte ptr [rdi]", "\xfe\x0f", 2);
+  ExpectEncoding("call rax", "\xff\xd0", 2);
+  // Jumps within a section are resolved
+  ExpectEncoding("L1:\njmp L1\njz L2\nL2:",
+                 "\xe9\xfb\xff\xff\xff\x0f\x84\x00\x00\x00\x00", 11);
+  fprintf(stderr, "PASS\n");
+  exit(EXIT_SUCCESS);
+}
@@ -12,8 +12,9 @@ bool IsASTDeclOfExtern(struct Node *n) {
 }
 
 struct Node *AllocNode(enum NodeType type) {
-  struct Node *node = calloc(1, sizeof(struct Node));
+  struct Node *node = AllocMemory(sizeof(struct Node));
   node->type = type;
+  compiler->num_of_nodes++;
   return node;
 }
 
@@ -80,30 +81,42 @@ struct Node *CreateASTLocalVar(int byte_offset, struct Node *var_type) {
 }
 
 struct Node *CreateTypeBase(struct Node *t) {
-  struct Node *n = AllocNode(kTypeBase);
-  n->op = t;
-  return n;
+  struct Node key = {.type = kTypeBase, .op = t};
+  return InternType(&key);
 }
 
 struct Node *CreateTypeLValue(struct Node *type) {
-  struct Node *n = AllocNode(kTypeLValue);
-  n->right = type;
-  return n;
+  if (!IsCanonicalType(type)) {
+    struct Node *n = AllocNode(kTypeLValue);
+    n->right = type;
+    return n;
+  }
+  struct Node key = {.type = kTypeLValue, .right = type};
+  return InternType(&key);
 }
 
 struct Node *CreateTypePointer(struct Node *type) {
-  struct Node *n = AllocNode(kTypePointer);
-  n->right = type;
-  return n;
+  if (!IsCanonicalType(type)) {
+    struct Node *n = AllocNode(kTypePointer);
+    n->right = type;
+    return n;
+  }
+  struct Node key = {.type = kTypePointer, .right = type};
+  return InternType(&key);
 }
 
 struct Node *CreateTypeFunction(struct Node *return_type,
                                 struct Node *arg_type_list) {
   assert(IsASTList(arg_type_list));
-  struct Node *n = AllocNode(kTypeFunction);
-  n->left = return_type;
-  n->right = arg_type_list;
-  return n;
+  if (!IsCanonicalType(return_type) || !IsCanonicalTypeList(arg_type_list)) {
+    struct Node *n = AllocNode(kTypeFunction);
+    n->left = return_type;
+    n->right = arg_type_list;
+    return n;
+  }
+  struct Node key = {
+      .type = kTypeFunction, .left = return_type, .right = arg_type_list};
+  return InternType(&key);
 }
 
 struct Node *GetReturnTypeOfFunction(struct Node *func_type) {
@@ -119,9 +132,15 @@ struct Node *GetArgTypeList(struct Node *func_type) {
 struct Node *CreateTypeStruct(struct Node *tag_token,
                               struct Node *struct_spec) {
   assert(IsToken(tag_token));
+  // struct types are identified by their declaration, not by structure.
+  // They live as long as the unit since canonical types derived from them
+  // are keyed by their addresses.
+  struct Arena *saved_arena = SwitchArena(compiler->unit_arena);
   struct Node *n = AllocNode(kTypeStruct);
+  SwitchArena(saved_arena);
   n->tag = tag_token;
   n->type_struct_spec = struct_spec;
+  n->canonical_type = n;
   return n;
 }
 
@@ -141,10 +160,16 @@ struct Node *CreateASTIdent(struct Node *ident) {
 }
 
 struct Node *CreateTypeArray(struct Node *type_of, struct Node *index_decl) {
-  struct Node *n = AllocNode(kTypeArray);
-  n->type_array_type_of = type_of;
-  n->type_array_index_decl = index_decl;
-  return n;
+  struct Node key = {.type = kTypeArray,
+                     .type_array_type_of = type_of,
+                     .type_array_index_decl = index_decl};
+  if (index_decl) key.type_array_length = EvalExprAsInt(index_decl);
+  if (!IsCanonicalType(type_of)) {
+    struct Node *n = AllocNode(kTypeArray);
+    memcpy(n, &key, sizeof(*n));
+    return n;
+  }
+  return InternType(&key);
 }
 
 struct Node *CreateMacroReplacement(struct Node *args_tokens,
@@ -155,6 +180,125 @@ struct Node *CreateMacroReplacement(struct Node *args_tokens,
   return n;
 }
 
+// Visiting and rewriting the AST
+//  VisitAST walks the AST nodes under *np, and gives the hooks of v the
+//  slot which holds each node (struct Node **), so that a hook can replace
+//  the node in place. pre is called before the children of a node, and
+//  returns false to skip them. post is called after the children. Either may
+//  be NULL. Tokens and types in the slots are leaves and are not visited.
+
+static bool IsASTNode(struct Node *n) {
+  return n && kASTExpr <= n->type && n->type < kTypeBase;
+}
+
+static void VisitChildren(struct Node *n, struct ASTVisitor *v,
+                          bool should_skip_left) {
+  if (n->type == kASTList) {
+    for (int i = 0; i < GetSizeOfList(n); i++) {
+      VisitAST(GetNodeReferenceAt(n, i), v);
+    }
+    return;
+  }
+  if (n->type == kASTExpr) {
+    if (!should_skip_left) VisitAST(&n->left, v);
+    VisitAST(&n->right, v);
+    VisitAST(&n->cond, v);
+    return;
+  }
+  if (n->type == kASTExprFuncCall) {
+    VisitAST(&n->func_expr, v);
+    VisitAST(&n->arg_expr_list, v);
+    return;
+  }
+  if (n->type == kASTExprStmt) {
+    VisitAST(&n->left, v);
+    return;
+  }
+  if (n->type == kASTJumpStmt) {
+    VisitAST(&n->right, v);
+    return;
+  }
+  if (n->type == kASTSelectionStmt) {
+    VisitAST(&n->cond, v);
+    VisitAST(&n->if_true_stmt, v);
+    VisitAST(&n->if_else_stmt, v);
+    return;
+  }
+  if (n->type == kASTForStmt) {
+    VisitAST(&n->init, v);
+    VisitAST(&n->cond, v);
+    VisitAST(&n->updt, v);
+    VisitAST(&n->body, v);
+    return;
+  }
+  if (n->type == kASTWhileStmt) {
+    VisitAST(&n->cond, v);
+    VisitAST(&n->body, v);
+    return;
+  }
+  if (n->type == kASTFuncDef) {
+    VisitAST(&n->func_body, v);
+    return;
+  }
+  if (n->type == kASTDecl) {
+    VisitAST(&n->right, v);
+    return;
+  }
+  if (n->type == kASTDecltor) {
+    VisitAST(&n->right, v);
+    VisitAST(&n->decltor_init_expr, v);
+    return;
+  }
+  if (n->type == kASTDirectDecltor) {
+    VisitAST(&n->value, v);
+    VisitAST(&n->left, v);
+    VisitAST(&n->right, v);
+    return;
+  }
+  if (n->type == kASTKeyValue) {
+    VisitAST(&n->value, v);
+    return;
+  }
+  // kASTIdent, kASTLocalVar and kASTStructSpec have no expressions
+}
+
+static void VisitExpr(struct Node **np, struct ASTVisitor *v) {
+  // The chain of left operands is kept in spine, as in PrintASTNodeSub()
+  struct Node *spine = AllocList();
+  bool should_visit_deepest = true;
+  for (struct Node **holder = np; IsASTNode(*holder);) {
+    should_visit_deepest = !v->pre || v->pre(holder, v);
+    struct Node *n = *holder;
+    if (!IsASTNode(n)) break;
+    PushToList(spine, n);
+    if (!should_visit_deepest || n->type != kASTExpr) break;
+    holder = &n->left;
+  }
+  // spine[i]->left is spine[i + 1], so the deepest one is visited first
+  for (int i = GetSizeOfList(spine) - 1; i >= 0; i--) {
+    struct Node *n = GetNodeAt(spine, i);
+    struct Node **holder = i ? &GetNodeAt(spine, i - 1)->left : np;
+    bool is_deepest = i == GetSizeOfList(spine) - 1;
+    if (!is_deepest || should_visit_deepest) {
+      VisitChildren(n, v, !is_deepest);
+    }
+    if (v->post) v->post(holder, v);
+  }
+}
+
+void VisitAST(struct Node **np, struct ASTVisitor *v) {
+  if (!np || !IsASTNode(*np)) return;
+  if ((*np)->type == kASTExpr) {
+    VisitExpr(np, v);
+    return;
+  }
+  if (!v->pre || v->pre(np, v)) {
+    if (!IsASTNode(*np)) return;
+    VisitChildren(*np, v, false);
+  }
+  if (v->post && IsASTNode(*np)) v->post(np, v);
+}
+
 static void PrintPadding(int depth) {
   for (int i = 0; i < depth; i++) {
     fputc(' ', stderr);
@@ -170,6 +314,17 @@ static void PrintOptionalAttr(const char *name, struct Node *attr, int depth) {
   PrintASTNodeSub(attr, depth);
 }
 
+static void PrintASTExprHead(struct Node *n, int depth) {
+  fprintf(stderr, "(op=");
+  if (n->op) PrintTokenBrief(n->op);
+  if (n->expr_type) {
+    fprintf(stderr, ":");
+    PrintASTNodeSub(n->expr_type, depth + 1);
+  }
+  if (n->reg) fprintf(stderr, ", reg: %d", n->reg);
+  PrintOptionalAttr("cond", n->cond, depth);
+}
+
 static void PrintASTNodeSub(struct Node *n, int depth) {
   if (!n) {
     fprintf(stderr, "(null)");
@@ -255,7 +410,11 @@ static void PrintASTNodeSub(struct Node *n, int depth) {
     fprintf(stderr, "array_of<");
     PrintASTNodeSub(n->type_array_type_of, depth);
     fprintf(stderr, ">[");
-    PrintASTNodeSub(n->type_array_index_decl, depth);
+    if (n->type_array_index_decl) {
+      PrintASTNodeSub(n->type_array_index_decl, depth);
+    } else if (n->type_array_length) {
+      fprintf(stderr, "%d", n->type_array_length);
+    }
     fprintf(stderr, "]");
     return;
   }
@@ -354,17 +513,25 @@ static void PrintASTNodeSub(struct Node *n, int depth) {
     return;
   }
   if (n->type == kASTExpr) {
-    fprintf(stderr, "(op=");
-    if (n->op) PrintTokenBrief(n->op);
-    if (n->expr_type) {
-      fprintf(stderr, ":");
-      PrintASTNodeSub(n->expr_type, depth + 1);
+    // The chain of left operands is walked by a loop so that a left-deep
+    // expression such as a + b + c + ... does not exhaust the stack
+    struct Node *spine = AllocList();
+    for (; n && n->type == kASTExpr && n->left; n = n->left) {
+      PushToList(spine, n);
+      PrintASTExprHead(n, depth);
+      fprintf(stderr, ", left=");
+    }
+    if (n && n->type == kASTExpr) {
+      PrintASTExprHead(n, depth);
+      PrintOptionalAttr("right", n->right, depth);
+      fprintf(stderr, ")");
+    } else {
+      PrintASTNodeSub(n, depth);
+    }
+    for (int i = GetSizeOfList(spine) - 1; i >= 0; i--) {
+      PrintOptionalAttr("right", GetNodeAt(spine, i)->right, depth);
+      fprintf(stderr, ")");
     }
-    if (n->reg) fprintf(stderr, ", reg: %d", n->reg);
-    PrintOptionalAttr("cond", n->cond, depth);
-    PrintOptionalAttr("left", n->left, depth);
-    PrintOptionalAttr("right", n->right, depth);
-    fprintf(stderr, ")");
     return;
   }
   fprintf(stderr, "ASTPrintNotImplemented(type=%d: %s)", n->type,
@@ -373,6 +540,7 @@ static void PrintASTNodeSub(struct Node *n, int depth) {
 }
 
 void PrintASTNode(struct Node *n) {
+  if (!compiler->is_verbose) return;
   PrintASTNodeSub(n, 0);
   fputc('\n', stderr);
 }
@@ -0,0 +1,219 @@
+#include "compilium.h"
+
+// Microbenchmarks of the compiler primitives (--run-bench=NAME)
+//  Each benchmark runs an operation n times. n is calibrated so that a run
+//  takes at least BENCH_MIN_SECONDS, and the best of BENCH_NUM_OF_RUNS runs
+//  is printed as ns/op on stdout. Objects made by the setup live on the
+//  heap, and the memory allocated by the operations is released by
+//  resetting bench_arena.
+
+#define BENCH_MIN_SECONDS 0.2
+#define BENCH_NUM_OF_RUNS 3
+#define BENCH_MAX_ITERATIONS (1L << 30)
+#define BENCH_LIST_SIZE 64
+
+struct Benchmark {
+  const char *name;
+  void (*setup)(void);
+  void (*run)(long n);
+};
+
+static struct Arena *bench_arena;
+static volatile long bench_sink;  // keeps the results of the operations
+
+static const char *bench_src =
+    "int f(int a, int b) {\n"
+    "  int s = 0;\n"
+    "  for (int i = 0; i < a; i++) {\n"
+    "    if (i % 3 == 0)\n"
+    "      s += i * b;\n"
+    "    else\n"
+    "      s -= b;\n"
+    "  }\n"
+    "  while (s > 100) s = s / 2;\n"
+    "  return s;\n"
+    "}\n";
+
+static const char *bench_macro_src =
+    "#define SQUARE(x) ((x) * (x))\n"
+    "#define SUM3(a, b, c) ((a) + (b) + (c))\n"
+    "int v = SUM3(SQUARE(1), SQUARE(2), SQUARE(3));\n";
+
+static double GetSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void SetupNothing(void) {}
+
+static void BenchTokenize(long n) {
+  for (long i = 0; i < n; i++) {
+    bench_sink += (long)Tokenize(bench_src);
+    ResetArena(bench_arena);
+  }
+}
+
+static void BenchPushToList(long n) {
+  struct Node *item = AllocNode(kNodeNone);
+  struct Node *list = AllocList();
+  for (long i = 0; i < n; i++) {
+    if (GetSizeOfList(list) == 1024) {
+      ResetArena(bench_arena);
+      list = AllocList();
+    }
+    PushToList(list, item);
+  }
+  bench_sink += GetSizeOfList(list);
+}
+
+static struct Node *bench_key_value_list;
+static const char *bench_last_key;
+
+static void SetupGetNodeByKey(void) {
+  bench_key_value_list = AllocList();
+  for (int i = 0; i < BENCH_LIST_SIZE; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "key%d", i);
+    bench_last_key = AllocString(key, strlen(key));
+    PushKeyValueToList(bench_key_value_list, bench_last_key,
+                       AllocNode(kNodeNone));
+  }
+}
+
+static void BenchGetNodeByKey(long n) {
+  // The last key is the worst case of the linear search
+  for (long i = 0; i < n; i++) {
+    bench_sink += (long)GetNodeByKey(bench_key_value_list, bench_last_key);
+  }
+}
+
+static struct SymbolEntry *bench_symbols;
+static struct Node *bench_first_symbol;
+
+static void SetupFindLocalVar(void) {
+  bench_symbols = NULL;
+  for (int i = 0; i < BENCH_LIST_SIZE; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "var%d", i);
+    AddLocalVar(&bench_symbols, AllocString(key, strlen(key)), GetIntType());
+  }
+  bench_first_symbol = CreateToken("var0");
+}
+
+static void BenchFindLocalVar(long n) {
+  // The first variable is at the bottom of the scope
+  for (long i = 0; i < n; i++) {
+    bench_sink += (long)FindLocalVar(bench_symbols, bench_first_symbol);
+  }
+}
+
+static struct Node *bench_token;
+
+static void SetupIsEqualTokenWithCStr(void) {
+  bench_token = CreateToken("identifier");
+}
+
+static void BenchIsEqualTokenWithCStr(long n) {
+  for (long i = 0; i < n; i++) {
+    bench_sink += IsEqualTokenWithCStr(bench_token, "identifier");
+  }
+}
+
+static struct Node *bench_macro_tokens;
+
+static void SetupPreprocess(void) {
+  bench_macro_tokens = Tokenize(bench_macro_src);
+}
+
+static void BenchPreprocess(long n) {
+  // Includes the copy of the tokens, which are rewritten by the expansion
+  for (long i = 0; i < n; i++) {
+    struct Node *tokens = DuplicateTokenSequence(bench_macro_tokens);
+    Preprocess(&tokens, AllocList());
+    bench_sink += (long)tokens;
+    ResetArena(bench_arena);
+  }
+}
+
+static struct Node *bench_func_def;
+
+static void SetupGenerateExternalDecl(void) {
+  struct Node *tokens = Tokenize(bench_src);
+  InitParser(&tokens);
+  bench_func_def = ParseExternalDecl(NULL);
+  struct SymbolEntry *ctx = NULL;
+  AnalyzeExternalDecl(bench_func_def, &ctx);
+}
+
+static void BenchGenerateExternalDecl(long n) {
+  FILE *saved_output = compiler->output;
+  compiler->output = fopen("/dev/null", "w");
+  if (!compiler->output) {
+    Error("Cannot open /dev/null");
+  }
+  for (long i = 0; i < n; i++) {
+    GenerateExternalDecl(bench_func_def);
+  }
+  fclose(compiler->output);
+  compiler->output = saved_output;
+}
+
+static struct Benchmark benchmarks[] = {
+    {"Tokenize", SetupNothing, BenchTokenize},
+    {"PushToList", SetupNothing, BenchPushToList},
+    {"GetNodeByKey", SetupGetNodeByKey, BenchGetNodeByKey},
+    {"FindLocalVar", SetupFindLocalVar, BenchFindLocalVar},
+    {"IsEqualTokenWithCStr", SetupIsEqualTokenWithCStr,
+     BenchIsEqualTokenWithCStr},
+    {"Preprocess", SetupPreprocess, BenchPreprocess},
+    {"GenerateExternalDecl", SetupGenerateExternalDecl,
+     BenchGenerateExternalDecl},
+};
+
+static double TimeBenchmark(struct Benchmark *b, long n) {
+  struct Arena *saved_arena = SwitchArena(bench_arena);
+  ResetArena(bench_arena);
+  double begin = GetSeconds();
+  b->run(n);
+  double seconds = GetSeconds() - begin;
+  SwitchArena(saved_arena);
+  return seconds;
+}
+
+static void RunBenchmark(struct Benchmark *b) {
+  b->setup();
+  long n = 1;
+  double seconds;
+  while ((seconds = TimeBenchmark(b, n)) < BENCH_MIN_SECONDS &&
+         n < BENCH_MAX_ITERATIONS) {
+    // Aims a little over the minimum, growing at most 100x per step
+    long next = seconds > 0 ? n * BENCH_MIN_SECONDS * 1.2 / seconds : n * 100;
+    if (next > n * 100) next = n * 100;
+    n = next > n ? next : n + 1;
+  }
+  for (int i = 1; i < BENCH_NUM_OF_RUNS; i++) {
+    double t = TimeBenchmark(b, n);
+    if (t < seconds) seconds = t;
+  }
+  printf("%-24s %12ld %12.1f ns/op\n", b->name, n, seconds * 1e9 / n);
+}
+
+_Noreturn void RunBenchmarks(const char *name) {
+  // name: a benchmark in benchmarks, or "all"
+  bench_arena = AllocArena();
+  int num_of_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+  bool found = false;
+  for (int i = 0; i < num_of_benchmarks; i++) {
+    if (strcmp(name, "all") != 0 && strcmp(name, benchmarks[i].name) != 0) {
+      continue;
+    }
+    RunBenchmark(&benchmarks[i]);
+    fflush(stdout);
+    found = true;
+  }
+  if (!found) {
+    Error("Unknown benchmark: %s", name);
+  }
+  exit(EXIT_SUCCESS);
+}
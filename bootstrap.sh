@@ -0,0 +1,99 @@
+#!/bin/bash -e
+# Bootstraps compilium with itself.
+#  stage 1: ./compilium, built by the host compiler
+#  stage 2: the sources compiled by stage 1
+#  stage 3: the sources compiled by stage 2
+# Sources which compilium cannot compile yet are built by the host compiler
+# in stage 2 and 3, so that the stages can be linked while compilium grows
+# toward self-hosting. The assembly of stage 2 and 3 should be the same
+# (fixed point), and stage 2 should compile the workload into the same
+# output as stage 1. The time of stage 2 over stage 1 on the workload shows
+# the quality of the code generated by compilium.
+# The summary is printed as JSON. Run by `make bootstrap`, which builds
+# stage 1.
+SRCS=${SRCS:-"analyzer.c arena.c assembler.c ast.c bench.c cache.c compilium.c
+  generator.c mir.c optimizer.c parser.c preprocessor.c struct.c symbol.c token.c
+  tokenizer.c type.c main.c"}
+WORKLOAD=${WORKLOAD:-"examples/calc.c examples/ctests.c examples/fib.c
+  examples/gameoflife.c examples/hello.c examples/pi.c"}
+REPEAT=${REPEAT:-3}
+CC=${CC:-cc}
+HOST_CFLAGS="-std=c11 -w"
+TARGET_OS=`uname`
+WORK_DIR=bootstrap
+TIMEFORMAT=%3R
+
+function build_stage {
+  # Compiles the sources with the compiler of the previous stage
+  compiler=$1
+  stage=$2
+  mkdir -p $WORK_DIR/$stage
+  rm -f $WORK_DIR/$stage/*
+  for src in $SRCS; do
+    name=$(basename $src .c)
+    if $compiler --target-os $TARGET_OS -I include/ < $src \
+      > $WORK_DIR/$stage/$name.S 2> $WORK_DIR/$stage/$name.log; then
+      $CC -c -o $WORK_DIR/$stage/$name.o $WORK_DIR/$stage/$name.S
+    else
+      rm $WORK_DIR/$stage/$name.S
+      echo "$stage: $src is built by $CC: $(grep -a '^Error' \
+        $WORK_DIR/$stage/$name.log | head -n 1)" >&2
+      $CC $HOST_CFLAGS -c -o $WORK_DIR/$stage/$name.o $src
+    fi
+  done
+  $CC -o $WORK_DIR/$stage/compilium $WORK_DIR/$stage/*.o -pthread
+}
+
+function time_workload {
+  # Prints the best time of compiling the workload with the compiler
+  compiler=$1
+  output_dir=$2
+  mkdir -p $output_dir
+  best=
+  for ((i = 0; i < REPEAT; i++)); do
+    t=$( { time for src in $WORKLOAD; do
+      $compiler --target-os $TARGET_OS -I include/ < $src \
+        > $output_dir/$(basename $src .c).S 2> /dev/null
+    done; } 2>&1 )
+    best=$(awk -v a="$best" -v b=$t 'BEGIN { print ((a == "" || b < a) ? b : a) }')
+  done
+  echo $best
+}
+
+build_stage ./compilium stage2
+build_stage $WORK_DIR/stage2/compilium stage3
+
+num_of_sources=0
+num_of_self_compiled=0
+num_of_identical=0
+for src in $SRCS; do
+  name=$(basename $src .c)
+  num_of_sources=$((num_of_sources + 1))
+  [ -f $WORK_DIR/stage2/$name.S ] || continue
+  num_of_self_compiled=$((num_of_self_compiled + 1))
+  if cmp -s $WORK_DIR/stage2/$name.S $WORK_DIR/stage3/$name.S; then
+    num_of_identical=$((num_of_identical + 1))
+  else
+    echo "stage 2 and 3 differ in $src" >&2
+  fi
+done
+is_fixed_point=$([ $num_of_identical = $num_of_self_compiled ] \
+  && echo true || echo false)
+
+stage1_seconds=$(time_workload ./compilium $WORK_DIR/workload1)
+stage2_seconds=$(time_workload $WORK_DIR/stage2/compilium $WORK_DIR/workload2)
+is_same_output=$(diff -r -q $WORK_DIR/workload1 $WORK_DIR/workload2 \
+  > /dev/null && echo true || echo false)
+
+echo "{"
+echo "  \"num_of_sources\": $num_of_sources,"
+echo "  \"num_of_self_compiled\": $num_of_self_compiled,"
+echo "  \"is_fixed_point\": $is_fixed_point,"
+echo "  \"is_same_output\": $is_same_output,"
+echo "  \"stage1_seconds\": $stage1_seconds,"
+echo "  \"stage2_seconds\": $stage2_seconds,"
+awk -v s1=$stage1_seconds -v s2=$stage2_seconds 'BEGIN {
+  printf "  \"stage2_over_stage1\": %.2f\n", (s1 > 0) ? s2 / s1 : 0;
+}'
+echo "}"
+[ $is_fixed_point = true ] && [ $is_same_output = true ]
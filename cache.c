@@ -0,0 +1,416 @@
+#include "compilium.h"
+
+// Function cache
+//  The assembly of each function is stored in a directory, keyed by a hash of
+//  the tokens of the function, the declarations of the names used in them
+//  and the options which change the code. Functions are emitted with local
+//  labels (see MergeFunctionOutput), so a cached text can be spliced into any
+//  position of the output.
+//  The directory is bounded by removing the least recently used entries,
+//  which are tracked in the index file of the directory. Each translation
+//  unit merges the entries it used into the index under a lock, so the
+//  directory can be shared by -j jobs and concurrent compilers.
+
+// Bump this when the generated code changes
+#define FUNCTION_CACHE_VERSION 2
+#define FUNCTION_CACHE_NAME_TABLE_SIZE 1024
+#define FUNCTION_CACHE_ENTRY_TABLE_SIZE 1024
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325UL
+#define FNV_PRIME 0x100000001b3UL
+
+struct CachedName {
+  struct CachedName *next;
+  struct Node *token;
+  unsigned long hash;  // of the last declaration which has the name
+};
+
+struct FunctionCacheEntry {
+  struct FunctionCacheEntry *next;
+  unsigned long key;
+  long size;
+  long last_used;
+};
+
+struct FunctionCache {
+  const char *dir;
+  long size_limit;
+  unsigned long options_hash;
+  long clock;  // incremented on every use of an entry
+  long loaded_clock;  // clock of the index when it was loaded
+  struct CachedName *names[FUNCTION_CACHE_NAME_TABLE_SIZE];
+  struct FunctionCacheEntry *entries[FUNCTION_CACHE_ENTRY_TABLE_SIZE];
+  int num_of_entries;
+  int num_of_hits;
+  int num_of_misses;
+};
+
+static unsigned long HashBytes(unsigned long h, const void *p, int size) {
+  // FNV-1a
+  for (int i = 0; i < size; i++) {
+    h ^= ((const unsigned char *)p)[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+static struct CachedName **FindCachedName(struct FunctionCache *fc,
+                                          struct Node *t) {
+  unsigned long h = HashBytes(FNV_OFFSET_BASIS, t->begin, t->length) %
+                    FUNCTION_CACHE_NAME_TABLE_SIZE;
+  struct CachedName **p = &fc->names[h];
+  for (; *p; p = &(*p)->next) {
+    if (IsEqualToken((*p)->token, t)) break;
+  }
+  return p;
+}
+
+static unsigned long HashTokens(struct FunctionCache *fc, struct Node *begin,
+                                struct Node *end) {
+  // Identifiers are hashed with the declaration which has the same name, so
+  // the hash changes when the meaning of a name used in the tokens changes.
+  unsigned long h = fc->options_hash;
+  for (struct Node *t = begin; t && t != end; t = t->next_token) {
+    h = HashBytes(h, t->begin, t->length);
+    h = HashBytes(h, "", 1);
+    if (t->token_type != kTokenIdent) continue;
+    struct CachedName *name = *FindCachedName(fc, t);
+    if (name) h = HashBytes(h, &name->hash, sizeof(name->hash));
+  }
+  return h;
+}
+
+void AddDeclToFunctionCache(struct FunctionCache *fc, struct Node *begin,
+                            struct Node *end) {
+  // Every identifier in the declaration is associated with it. This also
+  // catches names which are not declared by it (e.g. the type of a variable),
+  // which makes keys depend on more than needed but never on less.
+  unsigned long h = HashTokens(fc, begin, end);
+  for (struct Node *t = begin; t && t != end; t = t->next_token) {
+    if (t->token_type != kTokenIdent) continue;
+    struct CachedName **p = FindCachedName(fc, t);
+    if (!*p) {
+      *p = AllocMemoryInArena(NULL, sizeof(struct CachedName));
+      (*p)->token = t;
+    }
+    (*p)->hash = h;
+  }
+}
+
+unsigned long GetFunctionCacheKey(struct FunctionCache *fc, struct Node *begin,
+                                  struct Node *end) {
+  return HashTokens(fc, begin, end);
+}
+
+static struct FunctionCacheEntry **FindCacheEntry(struct FunctionCache *fc,
+                                                  unsigned long key) {
+  struct FunctionCacheEntry **p =
+      &fc->entries[key % FUNCTION_CACHE_ENTRY_TABLE_SIZE];
+  for (; *p; p = &(*p)->next) {
+    if ((*p)->key == key) break;
+  }
+  return p;
+}
+
+static struct FunctionCacheEntry *GetCacheEntry(struct FunctionCache *fc,
+                                                unsigned long key) {
+  struct FunctionCacheEntry **p = FindCacheEntry(fc, key);
+  if (!*p) {
+    *p = AllocMemoryInArena(NULL, sizeof(struct FunctionCacheEntry));
+    (*p)->key = key;
+    fc->num_of_entries++;
+  }
+  return *p;
+}
+
+static const char *CreateCachePath(const char *dir, const char *name,
+                                   unsigned long key) {
+  // Returns dir/name, or dir/<key>.<suffix> if key is not 0
+  int size = strlen(dir) + strlen(name) + 32;
+  char *path = AllocMemoryInArena(NULL, size);
+  if (key) {
+    snprintf(path, size, "%s/%016lx.%s", dir, key, name);
+  } else {
+    snprintf(path, size, "%s/%s", dir, name);
+  }
+  return path;
+}
+
+static FILE *OpenTemporaryFile(const char *path, const char **tmp_path) {
+  // Files are written to a temporary path and renamed to path, so that
+  // other compilers sharing the directory never see a partial file.
+  int size = strlen(path) + 32;
+  char *p = AllocMemoryInArena(NULL, size);
+  snprintf(p, size, "%s.%d.%p.tmp", path, getpid(), (void *)compiler);
+  *tmp_path = p;
+  return fopen(p, "wb");
+}
+
+static void LoadCacheIndex(struct FunctionCache *fc) {
+  // index: "<clock>\n" followed by "<key> <size> <last used>\n" per entry
+  fc->clock = 0;
+  FILE *fp = fopen(CreateCachePath(fc->dir, "index", 0), "rb");
+  if (!fp) return;
+  char *s = (char *)ReadFile(fp);
+  fclose(fp);
+  char *p = s;
+  long clock = strtol(p, &p, 10);
+  while (*p) {
+    char *begin = p;
+    unsigned long key = strtoul(p, &p, 16);
+    long size = strtol(p, &p, 10);
+    long last_used = strtol(p, &p, 10);
+    if (p == begin) break;
+    struct FunctionCacheEntry *e = GetCacheEntry(fc, key);
+    e->size = size;
+    e->last_used = last_used;
+    while (*p == '\n') p++;
+  }
+  fc->clock = clock;
+  free(s);
+}
+
+struct FunctionCache *OpenFunctionCache(const char *dir, long size_limit) {
+  struct FunctionCache *fc =
+      AllocMemoryInArena(NULL, sizeof(struct FunctionCache));
+  fc->dir = dir;
+  fc->size_limit = size_limit;
+  const char *prefix = compiler->symbol_prefix;
+  int version = FUNCTION_CACHE_VERSION;
+  unsigned long h = HashBytes(FNV_OFFSET_BASIS, &version, sizeof(version));
+  h = HashBytes(h, prefix, strlen(prefix) + 1);
+  h = HashBytes(h, compiler->passes, strlen(compiler->passes) + 1);
+  h = HashBytes(h, &compiler->should_print_legacy_asm_text,
+                sizeof(compiler->should_print_legacy_asm_text));
+  fc->options_hash = HashBytes(h, &compiler->max_pass_iterations,
+                               sizeof(compiler->max_pass_iterations));
+  LoadCacheIndex(fc);
+  fc->loaded_clock = fc->clock;
+  return fc;
+}
+
+bool LookupFunctionCache(struct FunctionCache *fc, unsigned long key,
+                         struct EmittedFunction *f) {
+  // Cache file: "<labels> <strings> <text size>\n", followed by
+  // "<label> <length> <string literal>\n" per string and the text.
+  // The string literals are allocated permanently since the generator keeps
+  // them until the end of the translation unit.
+  FILE *fp = fopen(CreateCachePath(fc->dir, "s", key), "rb");
+  if (!fp) {
+    fc->num_of_misses++;
+    return false;
+  }
+  char *s = (char *)ReadFile(fp);
+  fclose(fp);
+  char *p = s;
+  char *end = s + strlen(s);
+  f->num_of_labels = strtol(p, &p, 10);
+  int num_of_strings = strtol(p, &p, 10);
+  f->size = strtol(p, &p, 10);
+  p++;
+  f->str_list = AllocList();
+  for (int i = 0; i < num_of_strings && p < end; i++) {
+    struct Node *str = AllocNode(kASTExpr);
+    str->label_number = strtol(p, &p, 10);
+    int length = strtol(p, &p, 10);
+    p++;
+    if (length < 0 || end - p < length + 1) break;
+    struct Arena *saved_arena = SwitchArena(NULL);
+    const char *literal = AllocString(p, length);
+    str->op = AllocToken(literal, 0, literal, length, kTokenStringLiteral);
+    SwitchArena(saved_arena);
+    p += length + 1;
+    PushToList(f->str_list, str);
+  }
+  if (GetSizeOfList(f->str_list) != num_of_strings ||
+      (size_t)(end - p) != f->size) {
+    // Broken or written by another version
+    free(s);
+    fc->num_of_misses++;
+    return false;
+  }
+  f->text = malloc(f->size);
+  memcpy(f->text, p, f->size);
+  free(s);
+  struct FunctionCacheEntry *e = GetCacheEntry(fc, key);
+  if (!e->size) e->size = f->size;
+  e->last_used = ++fc->clock;
+  fc->num_of_hits++;
+  return true;
+}
+
+void StoreFunctionCache(struct FunctionCache *fc, unsigned long key,
+                        struct EmittedFunction *f) {
+  const char *path = CreateCachePath(fc->dir, "s", key);
+  const char *tmp_path;
+  FILE *fp = OpenTemporaryFile(path, &tmp_path);
+  if (!fp) {
+    fprintf(stderr, "Warning: Cannot write the function cache %s\n", path);
+    return;
+  }
+  fprintf(fp, "%d %d %lu\n", f->num_of_labels, GetSizeOfList(f->str_list),
+          f->size);
+  long size = f->size;
+  for (int i = 0; i < GetSizeOfList(f->str_list); i++) {
+    struct Node *str = GetNodeAt(f->str_list, i);
+    fprintf(fp, "%d %d ", str->label_number, str->op->length);
+    PrintTokenStrToFile(str->op, fp);
+    fputc('\n', fp);
+    size += str->op->length;
+  }
+  fwrite(f->text, 1, f->size, fp);
+  fclose(fp);
+  rename(tmp_path, path);
+  struct FunctionCacheEntry *e = GetCacheEntry(fc, key);
+  e->size = size;
+  e->last_used = ++fc->clock;
+}
+
+static int CompareCacheEntryByLastUse(const void *a, const void *b) {
+  const struct FunctionCacheEntry *ea = *(struct FunctionCacheEntry **)a;
+  const struct FunctionCacheEntry *eb = *(struct FunctionCacheEntry **)b;
+  return (ea->last_used > eb->last_used) - (ea->last_used < eb->last_used);
+}
+
+static int LockCacheIndex(struct FunctionCache *fc) {
+  // Returns the descriptor which holds the lock, or -1 if it is not locked
+  int fd = open(CreateCachePath(fc->dir, "index.lock", 0), O_RDWR | O_CREAT,
+                0644);
+  if (fd >= 0 && flock(fd, LOCK_EX) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void MergeCacheIndex(struct FunctionCache *fc) {
+  // Reloads the index, which other compilers may have updated since it was
+  // loaded, and adds the entries used by this unit as the latest ones.
+  struct FunctionCacheEntry *used = NULL;
+  for (int i = 0; i < FUNCTION_CACHE_ENTRY_TABLE_SIZE; i++) {
+    for (struct FunctionCacheEntry *e = fc->entries[i], *next; e; e = next) {
+      next = e->next;
+      if (e->last_used <= fc->loaded_clock) continue;
+      e->next = used;
+      used = e;
+    }
+  }
+  long num_of_uses = fc->clock - fc->loaded_clock;
+  memset(fc->entries, 0, sizeof(fc->entries));
+  fc->num_of_entries = 0;
+  LoadCacheIndex(fc);
+  for (struct FunctionCacheEntry *e = used; e; e = e->next) {
+    struct FunctionCacheEntry *merged = GetCacheEntry(fc, e->key);
+    merged->size = e->size;
+    merged->last_used = fc->clock + (e->last_used - fc->loaded_clock);
+  }
+  fc->clock += num_of_uses;
+}
+
+void CloseFunctionCache(struct FunctionCache *fc) {
+  // Evicts the least recently used entries and writes back the index
+  int lock_fd = LockCacheIndex(fc);
+  MergeCacheIndex(fc);
+  struct FunctionCacheEntry **entries =
+      malloc(sizeof(struct FunctionCacheEntry *) * (fc->num_of_entries + 1));
+  int n = 0;
+  long total_size = 0;
+  for (int i = 0; i < FUNCTION_CACHE_ENTRY_TABLE_SIZE; i++) {
+    for (struct FunctionCacheEntry *e = fc->entries[i]; e; e = e->next) {
+      entries[n++] = e;
+      total_size += e->size;
+    }
+  }
+  qsort(entries, n, sizeof(struct FunctionCacheEntry *),
+        CompareCacheEntryByLastUse);
+  int num_of_evicted = 0;
+  while (num_of_evicted < n && total_size > fc->size_limit) {
+    struct FunctionCacheEntry *e = entries[num_of_evicted++];
+    remove(CreateCachePath(fc->dir, "s", e->key));
+    total_size -= e->size;
+  }
+  const char *path = CreateCachePath(fc->dir, "index", 0);
+  const char *tmp_path;
+  FILE *fp = OpenTemporaryFile(path, &tmp_path);
+  if (fp) {
+    fprintf(fp, "%ld\n", fc->clock);
+    for (int i = num_of_evicted; i < n; i++) {
+      fprintf(fp, "%016lx %ld %ld\n", entries[i]->key, entries[i]->size,
+              entries[i]->last_used);
+    }
+    fclose(fp);
+    rename(tmp_path, path);
+  }
+  if (lock_fd >= 0) close(lock_fd);  // releases the lock
+  free(entries);
+  int num_of_lookups = fc->num_of_hits + fc->num_of_misses;
+  fprintf(stderr,
+          "Function cache: %d hits, %d misses (%d%% hit rate), "
+          "%d entries (%ld bytes), %d evicted\n",
+          fc->num_of_hits, fc->num_of_misses,
+          num_of_lookups ? fc->num_of_hits * 100 / num_of_lookups : 0,
+          n - num_of_evicted, total_size, num_of_evicted);
+}
+
+// Translation unit cache
+//  The output for a preprocessed token sequence is stored in
+//  $COMPILIUM_CACHE_DIR, keyed by a hash of the tokens, the options and the
+//  build of the compiler, so that identical units are not compiled again.
+
+// The Makefile passes a checksum of the sources as COMPILIUM_BUILD_ID. A
+// compiler built without it, e.g. by bootstrap.sh, does not use the cache.
+#ifdef COMPILIUM_BUILD_ID
+static const char *build_id = COMPILIUM_BUILD_ID;
+#else
+static const char *build_id = NULL;
+#endif
+
+unsigned long GetUnitCacheKey(struct Node *tokens) {
+  unsigned long h = FNV_OFFSET_BASIS;
+  if (build_id) h = HashBytes(h, build_id, strlen(build_id));
+  const char *prefix = compiler->symbol_prefix;
+  h = HashBytes(h, prefix, strlen(prefix) + 1);
+  h = HashBytes(h, compiler->passes, strlen(compiler->passes) + 1);
+  h = HashBytes(h, &compiler->max_pass_iterations,
+                sizeof(compiler->max_pass_iterations));
+  h = HashBytes(h, &compiler->should_print_legacy_asm_text,
+                sizeof(compiler->should_print_legacy_asm_text));
+  for (struct Node *t = tokens; t; t = t->next_token) {
+    if (t->token_type == kTokenDelimiter ||
+        t->token_type == kTokenZeroWidthNoBreakSpace) {
+      continue;
+    }
+    h = HashBytes(h, t->begin, t->length);
+    h = HashBytes(h, "", 1);
+  }
+  return h;
+}
+
+bool ReadUnitCache(const char *dir, unsigned long key, FILE *output) {
+  if (!build_id) return false;
+  FILE *fp = fopen(CreateCachePath(dir, "unit.S", key), "rb");
+  if (!fp) {
+    fprintf(stderr, "Unit cache: miss %016lx\n", key);
+    return false;
+  }
+  char *s = (char *)ReadFile(fp);
+  fclose(fp);
+  fputs(s, output);
+  free(s);
+  fprintf(stderr, "Unit cache: hit %016lx\n", key);
+  return true;
+}
+
+void WriteUnitCache(const char *dir, unsigned long key, const char *text,
+                    size_t size) {
+  if (!build_id) return;
+  const char *path = CreateCachePath(dir, "unit.S", key);
+  const char *tmp_path;
+  FILE *fp = OpenTemporaryFile(path, &tmp_path);
+  if (!fp) {
+    fprintf(stderr, "Warning: Cannot write the unit cache %s\n", path);
+    return;
+  }
+  fwrite(text, 1, size, fp);
+  fclose(fp);
+  rename(tmp_path, path);
+}
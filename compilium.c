@@ -1,19 +1,105 @@
 #include "compilium.h"
+#include "libcompilium.h"
 
-const char *symbol_prefix;
-const char *include_path;
-bool is_preprocess_only = false;
-bool should_optimize = true;
+_Thread_local struct CompilerContext *compiler;
+
+// Inputs of the driver. Each of them is compiled with its own context.
+static struct Node *input_paths;
+static struct Node *predefined_macros;
+static int num_of_jobs = 1;
+static int next_input_index;
+static const char *server_socket_path;
+
+#define DEFAULT_FUNCTION_CACHE_SIZE_LIMIT (64 * 1024 * 1024)
+#define DEFAULT_OPTIMIZATION_LEVEL "-O2"
+
+static FILE *GetErrorOutput(void) {
+  return compiler && compiler->error_output ? compiler->error_output : stderr;
+}
+
+// Output files are written to temporary files, which are renamed when they
+// are complete. Those of all the jobs are listed here, guarded by output_lock.
+struct TemporaryOutput {
+  pid_t pid;  // the assembler which writes the file if not 0
+  const char *path;
+  struct TemporaryOutput *next;
+};
+static struct TemporaryOutput *temporary_outputs;
+static pthread_mutex_t output_lock;
+
+static const char *null_device = "/dev/null";
+
+static const char *CreateTemporaryPath(const char *path) {
+  // As cc does, /dev/null is written directly
+  if (strcmp(path, null_device) == 0) return null_device;
+  int len = strlen(path) + 32;
+  char *tmp_path = AllocMemory(len);
+  snprintf(tmp_path, len, "%s.tmp%d", path, getpid());
+  return tmp_path;
+}
+
+static void AddTemporaryOutput(const char *tmp_path, pid_t pid) {
+  // output_lock should be held by the caller
+  struct TemporaryOutput *t = calloc(1, sizeof(struct TemporaryOutput));
+  t->pid = pid;
+  t->path = tmp_path;
+  t->next = temporary_outputs;
+  temporary_outputs = t;
+}
+
+static bool FinishTemporaryOutput(const char *tmp_path, const char *path,
+                                  bool is_complete) {
+  // Renames tmp_path to path if it is complete, or removes it otherwise.
+  // Returns true if it is renamed.
+  pthread_mutex_lock(&output_lock);
+  struct TemporaryOutput **p = &temporary_outputs;
+  while (*p && (*p)->path != tmp_path) p = &(*p)->next;
+  if (*p) {
+    struct TemporaryOutput *t = *p;
+    *p = t->next;
+    free(t);
+  }
+  if (tmp_path == null_device) {
+    pthread_mutex_unlock(&output_lock);
+    return is_complete;
+  }
+  bool is_renamed = is_complete && rename(tmp_path, path) == 0;
+  if (!is_renamed) remove(tmp_path);
+  pthread_mutex_unlock(&output_lock);
+  return is_renamed;
+}
+
+static void AbortTemporaryOutputs(void) {
+  // Incomplete outputs should not replace the files of the previous build.
+  // The lock is kept until exit() so that no other job adds another one.
+  pthread_mutex_lock(&output_lock);
+  for (struct TemporaryOutput *t = temporary_outputs; t; t = t->next) {
+    if (t->pid) {
+      kill(-t->pid, SIGKILL);
+      waitpid(t->pid, NULL, 0);
+    }
+    if (t->path != null_device) remove(t->path);
+  }
+  temporary_outputs = NULL;
+}
+
+static _Noreturn void ExitWithError(void) {
+  // In the compile server, an error fails only the request being compiled
+  if (compiler && compiler->error_jmp) longjmp(*compiler->error_jmp, 1);
+  AbortTemporaryOutputs();
+  exit(EXIT_FAILURE);
+}
 
 _Noreturn void Error(const char *fmt, ...) {
   fflush(stdout);
-  fprintf(stderr, "Error: ");
+  FILE *fp = GetErrorOutput();
+  fprintf(fp, "Error: ");
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
+  vfprintf(fp, fmt, ap);
   va_end(ap);
-  fputc('\n', stderr);
-  exit(EXIT_FAILURE);
+  fputc('\n', fp);
+  ExitWithError();
 }
 
 _Noreturn void __assert(const char *expr_str, const char *file, int line) {
@@ -22,39 +108,148 @@ _Noreturn void __assert(const char *expr_str, const char *file, int line) {
 
 void TestList(void);
 void TestType(void);
+void TestArena(void);
+void TestAssembler(void);
+void TestMachineIR(void);
+_Noreturn void RunBenchmarks(const char *name);
 static struct Node *ParseCompilerArgs(int argc, char **argv) {
   // returns replacement_list: ASTList which contains macro replacement
   struct Node *replacement_list = AllocList();
-  symbol_prefix = "_";
+  compiler->symbol_prefix = "_";
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--target-os") == 0) {
       i++;
+      if (i >= argc) {
+        Error("Target OS (--target-os <os>) is not specified");
+      }
       if (strcmp(argv[i], "Darwin") == 0) {
-        symbol_prefix = "_";
+        compiler->symbol_prefix = "_";
+        compiler->is_target_elf = false;
         // Define __APPLE__ macro
         PushKeyValueToList(replacement_list, "__APPLE__",
                            CreateMacroReplacement(NULL, NULL));
       } else if (strcmp(argv[i], "Linux") == 0) {
-        symbol_prefix = "";
+        compiler->symbol_prefix = "";
+        compiler->is_target_elf = true;
       } else {
         Error("Unknown os type %s", argv[i]);
       }
     } else if (strcmp(argv[i], "-I") == 0) {
       i++;
-      include_path = argv[i];
-      assert(include_path);
-      if (include_path[strlen(include_path) - 1] != '/') {
+      if (i >= argc) {
+        Error("Include path (-I <path>) is not specified");
+      }
+      compiler->include_path = argv[i];
+      if (!*compiler->include_path ||
+          compiler->include_path[strlen(compiler->include_path) - 1] != '/') {
         Error("Include path (-I <path>) should be ended with '/'");
       }
-      fprintf(stderr, "Include path: %s\n", include_path);
+      if (compiler->is_verbose) {
+        fprintf(stderr, "Include path: %s\n", compiler->include_path);
+      }
     } else if (strcmp(argv[i], "--run-unittest=List") == 0) {
       TestList();
     } else if (strcmp(argv[i], "--run-unittest=Type") == 0) {
       TestType();
+    } else if (strcmp(argv[i], "--run-unittest=Arena") == 0) {
+      TestArena();
+    } else if (strcmp(argv[i], "--run-unittest=Assembler") == 0) {
+      TestAssembler();
+    } else if (strcmp(argv[i], "--run-unittest=MachineIR") == 0) {
+      TestMachineIR();
+    } else if (strncmp(argv[i], "--run-bench=", 12) == 0) {
+      RunBenchmarks(argv[i] + 12);
     } else if (strcmp(argv[i], "-E") == 0) {
-      is_preprocess_only = true;
-    } else if (strcmp(argv[i], "-O0") == 0) {
-      should_optimize = false;
+      compiler->is_preprocess_only = true;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      compiler->should_assemble = true;
+    } else if (strcmp(argv[i], "-fno-integrated-as") == 0) {
+      compiler->should_use_external_assembler = true;
+    } else if (strcmp(argv[i], "-o") == 0) {
+      i++;
+      if (i >= argc) {
+        Error("Output path (-o <path>) is not specified");
+      }
+      compiler->output_path = argv[i];
+    } else if (strcmp(argv[i], "-M") == 0) {
+      compiler->is_dependency_only = true;
+    } else if (strcmp(argv[i], "-MD") == 0) {
+      compiler->should_write_dependencies = true;
+    } else if (strcmp(argv[i], "-MF") == 0 || strcmp(argv[i], "-MT") == 0) {
+      const char *opt = argv[i++];
+      if (i >= argc) {
+        Error("%s requires an argument", opt);
+      }
+      if (opt[2] == 'F') {
+        compiler->dependency_output_path = argv[i];
+      } else {
+        compiler->dependency_target = argv[i];
+      }
+    } else if (strcmp(argv[i], "--run") == 0) {
+      compiler->should_run = true;
+    } else if (strcmp(argv[i], "--perf-map") == 0) {
+      compiler->should_write_perf_map = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      compiler->should_print_stats = true;
+    } else if (strcmp(argv[i], "--unit-stats") == 0) {
+      compiler->should_print_unit_stats = true;
+    } else if (strncmp(argv[i], "-Rpass=", 7) == 0) {
+      compiler->remark_passes = argv[i] + 7;
+    } else if (strncmp(argv[i], "-Rpass-missed=", 14) == 0) {
+      compiler->missed_remark_passes = argv[i] + 14;
+    } else if (strncmp(argv[i], "-foptimization-record-file=", 27) == 0) {
+      compiler->optimization_record_path = argv[i] + 27;
+    } else if (strcmp(argv[i], "--") == 0) {
+      // The rest is passed to main of the program run by --run
+      compiler->run_argc = argc - i;
+      compiler->run_argv = &argv[i];
+      compiler->run_argv[0] = "a.out";
+      break;
+    } else if (strncmp(argv[i], "-O", 2) == 0) {
+      if (!SetOptimizationLevel(argv[i])) {
+        Error("Unknown optimization level: %s", argv[i]);
+      }
+    } else if (strncmp(argv[i], "--passes=", 9) == 0) {
+      SetPasses(argv[i] + 9);
+    } else if (strncmp(argv[i], "--max-pass-iterations=", 22) == 0) {
+      if ((compiler->max_pass_iterations = strtol(argv[i] + 22, NULL, 10)) <
+          1) {
+        Error("Number of iterations of the passes should be positive");
+      }
+    } else if (strcmp(argv[i], "--time-passes") == 0) {
+      compiler->should_time_passes = true;
+    } else if (strcmp(argv[i], "--verify-passes") == 0) {
+      compiler->should_verify_passes = true;
+    } else if (strcmp(argv[i], "--legacy-asm-text") == 0) {
+      compiler->should_print_legacy_asm_text = true;
+    } else if (strcmp(argv[i], "-j") == 0) {
+      i++;
+      if (i >= argc || (num_of_jobs = strtol(argv[i], NULL, 10)) < 1) {
+        Error("Number of jobs (-j <N>) should be a positive integer");
+      }
+    } else if (strcmp(argv[i], "--function-cache") == 0) {
+      i++;
+      if (i >= argc) {
+        Error("Directory of the function cache is not specified");
+      }
+      compiler->function_cache_dir = argv[i];
+    } else if (strcmp(argv[i], "--function-cache-size") == 0) {
+      i++;
+      if (i >= argc ||
+          (compiler->function_cache_size_limit = strtol(argv[i], NULL, 10)) <
+              1) {
+        Error("Size of the function cache should be a positive integer");
+      }
+    } else if (strcmp(argv[i], "--server") == 0) {
+      i++;
+      if (i >= argc) {
+        Error("Socket path of the server is not specified");
+      }
+      server_socket_path = argv[i];
+    } else if (argv[i][0] != '-') {
+      struct Node *input_path = AllocNode(kNodeNone);
+      input_path->key = argv[i];
+      PushToList(input_paths, input_path);
     } else {
       Error("Unknown argument: %s", argv[i]);
     }
@@ -64,52 +259,64 @@ static struct Node *ParseCompilerArgs(int argc, char **argv) {
 
 void PrintTokenLine(struct Node *t) {
   assert(t);
+  FILE *fp = GetErrorOutput();
   const char *line_begin = t->begin;
   while (t->src_str < line_begin) {
     if (line_begin[-1] == '\n') break;
     line_begin--;
   }
 
-  fprintf(stderr, "Line %d:\n", t->line);
+  fprintf(fp, "Line %d:\n", t->line);
 
   for (const char *p = line_begin; *p && *p != '\n'; p++) {
-    fputc(*p <= ' ' ? ' ' : *p, stderr);
+    fputc(*p <= ' ' ? ' ' : *p, fp);
   }
-  fputc('\n', stderr);
+  fputc('\n', fp);
   const char *p;
   for (p = line_begin; p < t->begin; p++) {
-    fputc(' ', stderr);
+    fputc(' ', fp);
   }
   for (int i = 0; i < t->length; i++) {
-    fputc('^', stderr);
+    fputc('^', fp);
     p++;
   }
   for (; *p && *p != '\n'; p++) {
-    fputc(' ', stderr);
+    fputc(' ', fp);
   }
-  fputc('\n', stderr);
+  fputc('\n', fp);
 }
 
 _Noreturn void ErrorWithToken(struct Node *t, const char *fmt, ...) {
   PrintTokenLine(t);
 
-  fprintf(stderr, "Error: ");
+  FILE *fp = GetErrorOutput();
+  fprintf(fp, "Error: ");
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
+  vfprintf(fp, fmt, ap);
   va_end(ap);
-  fputc('\n', stderr);
-  exit(EXIT_FAILURE);
+  fputc('\n', fp);
+  ExitWithError();
 }
 
 struct Node *AllocList() {
-  return AllocNode(kASTList);
+  struct Node *list = AllocNode(kASTList);
+  list->list_arena = GetCurrentArena();
+  return list;
 }
 
 void ExpandListSizeIfNeeded(struct Node *list) {
   if (list->size < list->capacity) return;
   list->capacity = (list->capacity + 1) * 2;
-  list->nodes = realloc(list->nodes, sizeof(struct Node *) * list->capacity);
+  if (list->list_arena) {
+    // Keep the elements in the same arena as the list itself
+    struct Node **nodes = AllocMemoryInArena(
+        list->list_arena, sizeof(struct Node *) * list->capacity);
+    memcpy(nodes, list->nodes, sizeof(struct Node *) * list->size);
+    list->nodes = nodes;
+  } else {
+    list->nodes = realloc(list->nodes, sizeof(struct Node *) * list->capacity);
+  }
   assert(list->nodes);
   assert(list->size < list->capacity);
 }
@@ -276,33 +483,1037 @@ const char *ReadFile(FILE *fp) {
   return input;
 }
 
-int main(int argc, char *argv[]) {
-  InitNodeTypeNames();
-  struct Node *replacement_list = ParseCompilerArgs(argc, argv);
-  const char *input = ReadFile(stdin);
+double GetMonotonicSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-  struct Node *tokens = Tokenize(input);
+// Parallel backend
+//  With -j N and a single input, functions are parsed and optimized in source
+//  order on the driver thread, then analyzed and emitted by N worker threads.
+//  Each function is emitted into its own buffer with local labels, and the
+//  buffers are merged in source order so that the output is the same as the
+//  serial build. Functions found in the function cache skip the workers.
+
+#define FUNCTIONS_PER_BACKEND_THREAD 4
+
+struct FunctionJob {
+  struct Node *decl;
+  struct SymbolEntry *ctx;  // symbols visible from the function
+  struct Arena *arena;
+  struct CompilerContext context;
+  struct EmittedFunction emitted;
+  unsigned long cache_key;
+  bool is_cached;
+};
+
+struct FunctionBatch {
+  struct FunctionJob *jobs;
+  int num_of_jobs;
+  int next_job_index;
+};
+
+static void RunFunctionJob(struct FunctionJob *job) {
+  compiler = &job->context;
+  compiler->output = open_memstream(&job->emitted.text, &job->emitted.size);
+  compiler->str_list = AllocList();
+  AnalyzeFuncDefBody(job->decl, job->ctx);
+  PrintASTNode(job->decl);
+  GenerateExternalDecl(job->decl);
+  fclose(compiler->output);
+  job->emitted.str_list = compiler->str_list;
+  job->emitted.num_of_labels = compiler->label_number;
+}
+
+static void *FunctionWorker(void *arg) {
+  // Idle threads take the next function in the batch
+  struct FunctionBatch *batch = arg;
+  for (;;) {
+    int i = __atomic_fetch_add(&batch->next_job_index, 1, __ATOMIC_SEQ_CST);
+    if (i >= batch->num_of_jobs) break;
+    struct FunctionJob *job = &batch->jobs[i];
+    if (job->decl->type != kASTFuncDef || job->is_cached) continue;
+    RunFunctionJob(job);
+  }
+  return NULL;
+}
+
+static void RunFunctionBatch(struct FunctionBatch *batch) {
+  int num_of_threads = compiler->num_of_backend_threads;
+  batch->next_job_index = 0;
+  if (num_of_threads <= 1) {
+    struct CompilerContext *saved_compiler = compiler;
+    FunctionWorker(batch);
+    compiler = saved_compiler;
+    return;
+  }
+  pthread_t workers[num_of_threads];
+  for (int i = 0; i < num_of_threads; i++) {
+    if (pthread_create(&workers[i], NULL, FunctionWorker, batch)) {
+      Error("Failed to create a thread");
+    }
+  }
+  for (int i = 0; i < num_of_threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+}
+
+static void PrepareFunctionJob(struct FunctionJob *job, struct Node *begin,
+                               struct SymbolEntry **ctx) {
+  // begin: the first token of the function
+  struct Arena *saved_arena = SwitchArena(job->arena);
+  job->is_cached = false;
+  struct FunctionCache *fc = compiler->function_cache;
+  if (fc) {
+    job->cache_key = GetFunctionCacheKey(fc, begin, PeekToken());
+    AddDeclToFunctionCache(fc, begin, job->decl->func_body->op);
+    job->is_cached = LookupFunctionCache(fc, job->cache_key, &job->emitted);
+  }
+  PrintASTNode(job->decl);
+  if (!job->is_cached) {
+    Optimize(&job->decl);
+  }
+  SwitchArena(saved_arena);
+  // Declare the function here so that the functions after it can refer to it
+  DeclareFuncDef(job->decl, ctx);
+  job->ctx = *ctx;
+  job->context = *compiler;
+  job->context.current_arena = job->arena;
+  job->context.label_number = 0;
+  job->context.use_local_labels = true;
+  job->context.num_of_nodes = 0;  // added to the unit when merging
+}
 
-  fputs("Preprocess begin\n", stderr);
+static void PrintStats(const char *label, struct FunctionStats *st) {
+  // --stats: one line of key=value pairs for each function and the unit
+  long num_of_push_pop_pairs = st->num_of_pushes < st->num_of_pops
+                                   ? st->num_of_pushes
+                                   : st->num_of_pops;
+  fprintf(stderr,
+          "Stats: %s file=%s insts=%ld bytes=%ld loads=%ld stores=%ld "
+          "push_pop_pairs=%ld calls=%ld idivs=%ld spills=%ld frame_size=%ld\n",
+          label, compiler->input_path ? compiler->input_path : "-",
+          st->num_of_insts, st->num_of_bytes, st->num_of_loads,
+          st->num_of_stores, num_of_push_pop_pairs, st->num_of_calls,
+          st->num_of_idivs, st->num_of_spills, st->frame_size);
+}
+
+static void AddFunctionStats(struct Node *func_def, struct FunctionStats *st) {
+  if (!compiler->should_print_stats) return;
+  char label[256];
+  snprintf(label, sizeof(label), "function=%s",
+           CreateTokenStr(func_def->func_name_token));
+  PrintStats(label, st);
+  struct FunctionStats *sum = &compiler->unit_stats;
+  sum->num_of_insts += st->num_of_insts;
+  sum->num_of_bytes += st->num_of_bytes;
+  sum->num_of_loads += st->num_of_loads;
+  sum->num_of_stores += st->num_of_stores;
+  sum->num_of_pushes += st->num_of_pushes;
+  sum->num_of_pops += st->num_of_pops;
+  sum->num_of_calls += st->num_of_calls;
+  sum->num_of_idivs += st->num_of_idivs;
+  sum->num_of_spills += st->num_of_spills;
+  sum->frame_size += st->frame_size;
+  compiler->num_of_functions++;
+}
+
+static void CompileExternalDeclsInBatches(struct Node **tokens) {
+  int num_of_threads = compiler->num_of_backend_threads;
+  int capacity =
+      (num_of_threads > 1 ? num_of_threads : 1) * FUNCTIONS_PER_BACKEND_THREAD;
+  struct FunctionJob *jobs = calloc(capacity, sizeof(struct FunctionJob));
+  for (int i = 0; i < capacity; i++) {
+    jobs[i].arena = AllocArena();
+  }
+  pthread_mutex_t type_table_lock;
+  pthread_mutex_init(&type_table_lock, NULL);
+  compiler->type_table_lock = &type_table_lock;
+  struct SymbolEntry *ctx = NULL;
+  InitParser(tokens);
+  InitGenerator();
+  struct FunctionBatch batch = {.jobs = jobs};
+  bool is_eof = false;
+  while (!is_eof) {
+    batch.num_of_jobs = 0;
+    while (batch.num_of_jobs < capacity) {
+      struct FunctionJob *job = &jobs[batch.num_of_jobs];
+      struct Node *begin = PeekToken();
+      job->decl = ParseExternalDecl(job->arena);
+      if (!job->decl) {
+        is_eof = true;
+        break;
+      }
+      batch.num_of_jobs++;
+      if (job->decl->type == kASTFuncDef) {
+        PrepareFunctionJob(job, begin, &ctx);
+        continue;
+      }
+      if (compiler->function_cache) {
+        AddDeclToFunctionCache(compiler->function_cache, begin, PeekToken());
+      }
+      // Other declarations are cheap and visible from the functions after
+      // them, so they are analyzed here and emitted when merging.
+      PrintASTNode(job->decl);
+      Optimize(&job->decl);
+      AnalyzeExternalDecl(job->decl, &ctx);
+      PrintASTNode(job->decl);
+    }
+    RunFunctionBatch(&batch);
+    for (int i = 0; i < batch.num_of_jobs; i++) {
+      struct FunctionJob *job = &jobs[i];
+      if (job->decl->type != kASTFuncDef) {
+        GenerateExternalDecl(job->decl);
+        continue;
+      }
+      MergeFunctionOutput(&job->emitted);
+      compiler->num_of_nodes += job->context.num_of_nodes;
+      if (!job->is_cached) {
+        AddFunctionStats(job->decl, &job->context.function_stats);
+      }
+      if (compiler->function_cache && !job->is_cached) {
+        StoreFunctionCache(compiler->function_cache, job->cache_key,
+                           &job->emitted);
+      }
+      free(job->emitted.text);
+      job->decl->func_body = NULL;
+      job->decl->arg_var_list = NULL;
+      ResetArena(job->arena);
+    }
+  }
+  FinishGenerator(ctx);
+  compiler->type_table_lock = NULL;
+}
+
+static void PrintUnitStatistics(void) {
+  if (compiler->should_print_unit_stats) {
+    // Read by examples/bench_compile.sh
+    fprintf(stderr, "Unit statistics: %ld tokens, %ld nodes\n",
+            compiler->num_of_tokens, compiler->num_of_nodes);
+  }
+  if (compiler->should_print_stats) {
+    char label[64];
+    snprintf(label, sizeof(label), "unit functions=%ld",
+             compiler->num_of_functions);
+    PrintStats(label, &compiler->unit_stats);
+  }
+  if (compiler->should_time_passes) {
+    PrintPassTimings();
+  }
+}
+
+static void CompileTokens(struct Node **tokens) {
+  // Types are interned per translation unit
+  compiler->type_hash_table = NULL;
+  compiler->num_of_functions = 0;
+  memset(&compiler->unit_stats, 0, sizeof(struct FunctionStats));
+  memset(compiler->pass_timings, 0, sizeof(compiler->pass_timings));
+  compiler->int_type = NULL;
+  compiler->char_type = NULL;
+  if (compiler->function_cache_dir) {
+    compiler->function_cache = OpenFunctionCache(
+        compiler->function_cache_dir, compiler->function_cache_size_limit);
+  }
+  if (compiler->num_of_backend_threads > 1 || compiler->function_cache) {
+    CompileExternalDeclsInBatches(tokens);
+    if (compiler->function_cache) {
+      CloseFunctionCache(compiler->function_cache);
+      compiler->function_cache = NULL;
+    }
+    return;
+  }
+
+  // Top-level declarations are compiled one by one. The body of each
+  // function, its local symbols and temporary types are allocated in
+  // func_arena, which is reset after the function is emitted.
+  if (!compiler->func_arena) compiler->func_arena = AllocArena();
+  struct Arena *func_arena = compiler->func_arena;
+  struct SymbolEntry *ctx = NULL;
+  InitParser(tokens);
+  InitGenerator();
+  struct Node *decl;
+  while ((decl = ParseExternalDecl(func_arena))) {
+    bool is_func_def = decl->type == kASTFuncDef;
+    struct Arena *saved_arena =
+        SwitchArena(is_func_def ? func_arena : compiler->unit_arena);
+    PrintASTNode(decl);
+    Optimize(&decl);
+    AnalyzeExternalDecl(decl, &ctx);
+    PrintASTNode(decl);
+    GenerateExternalDecl(decl);
+    SwitchArena(saved_arena);
+    if (is_func_def) {
+      AddFunctionStats(decl, &compiler->function_stats);
+      decl->func_body = NULL;
+      decl->arg_var_list = NULL;
+      ResetArena(func_arena);
+    }
+  }
+  FinishGenerator(ctx);
+  if (compiler->should_print_stats) {
+    fprintf(stderr, "Peak arena usage of a function: %lu bytes\n",
+            GetPeakUsageOfArena(func_arena));
+  }
+}
+
+static void WriteDependencies(void) {
+  // Writes a make rule which tells that the output depends on the included
+  // files. An empty rule is added for each of them, so that make does not
+  // fail when one of them is removed.
+  const char *target = compiler->dependency_target;
+  if (!target) {
+    Error("Target of the dependencies (-MT <target>) is not specified");
+  }
+  const char *path = compiler->dependency_output_path;
+  if (!path && !compiler->is_dependency_only) {
+    Error("Dependency file (-MF <file>) is not specified");
+  }
+  FILE *fp = path ? fopen(path, "wb") : compiler->output;
+  if (!fp) {
+    Error("Cannot open %s", path);
+  }
+  struct Node *deps = compiler->dependencies;
+  fprintf(fp, "%s:", target);
+  if (compiler->input_path) fprintf(fp, " %s", compiler->input_path);
+  for (int i = 0; i < GetSizeOfList(deps); i++) {
+    fprintf(fp, " \\\n  %s", GetNodeAt(deps, i)->key);
+  }
+  fputc('\n', fp);
+  for (int i = 0; i < GetSizeOfList(deps); i++) {
+    fprintf(fp, "\n%s:\n", GetNodeAt(deps, i)->key);
+  }
+  if (path) fclose(fp);
+}
+
+// Front end pipeline
+//  With -j N, the input is tokenized and preprocessed on another thread
+//  while the tokens preprocessed so far are parsed and compiled.
+
+struct PreprocessJob {
+  struct CompilerContext context;
+  const char *input;
+  struct Node *replacement_list;
+};
+
+static void *PreprocessWorker(void *arg) {
+  struct PreprocessJob *job = arg;
+  compiler = &job->context;
+  struct Node *tokens = Tokenize(job->input);
+  if (compiler->is_verbose) fputs("Preprocess begin\n", stderr);
+  Preprocess(&tokens, job->replacement_list);
+  return NULL;
+}
+
+static bool ShouldPipelineFrontEnd(void) {
+  // Errors on the preprocessor thread cannot be caught by the server, and
+  // the other modes need the whole preprocessed tokens.
+  return compiler->num_of_backend_threads > 1 && !compiler->error_jmp &&
+         !compiler->is_preprocess_only && !compiler->is_dependency_only &&
+         !compiler->unit_cache_dir;
+}
+
+static void CompileTranslationUnitInPipeline(const char *input,
+                                             struct Node *replacement_list) {
+  struct PreprocessJob *job = calloc(1, sizeof(struct PreprocessJob));
+  job->context = *compiler;
+  job->context.current_arena = NULL;
+  job->context.token_output_pipe = AllocTokenPipe();
+  job->context.num_of_tokens = 0;  // added to the unit after the join
+  job->context.num_of_nodes = 0;
+  job->input = input;
+  job->replacement_list = replacement_list;
+  pthread_t preprocessor;
+  if (pthread_create(&preprocessor, NULL, PreprocessWorker, job)) {
+    Error("Failed to create a thread");
+  }
+  struct Node *tokens;
+  InitTokenStreamFromPipe(&tokens, job->context.token_output_pipe);
+  CompileTokens(&tokens);
+  pthread_join(preprocessor, NULL);
+  compiler->num_of_tokens += job->context.num_of_tokens;
+  compiler->num_of_nodes += job->context.num_of_nodes;
+  free(job);
+}
+
+static void CompileTranslationUnit(const char *input,
+                                   struct Node *replacement_list) {
+  bool needs_dependencies =
+      compiler->is_dependency_only || compiler->should_write_dependencies;
+  compiler->dependencies = needs_dependencies ? AllocList() : NULL;
+  if (ShouldPipelineFrontEnd()) {
+    CompileTranslationUnitInPipeline(input, replacement_list);
+    PrintUnitStatistics();
+    if (needs_dependencies) WriteDependencies();
+    return;
+  }
+  struct Node *tokens = Tokenize(input);
+  if (compiler->is_verbose) fputs("Preprocess begin\n", stderr);
   Preprocess(&tokens, replacement_list);
-  if (is_preprocess_only) {
+  if (needs_dependencies) WriteDependencies();
+  if (compiler->is_dependency_only) return;
+  if (compiler->is_preprocess_only) {
     OutputTokenSequenceAsCSource(tokens);
-    return 0;
+    return;
+  }
+  if (!compiler->unit_cache_dir) {
+    CompileTokens(&tokens);
+    PrintUnitStatistics();
+    return;
+  }
+  // Units which are the same after preprocessing share the output
+  unsigned long key = GetUnitCacheKey(tokens);
+  if (ReadUnitCache(compiler->unit_cache_dir, key, compiler->output)) return;
+  FILE *output = compiler->output;
+  char *text;
+  size_t size;
+  compiler->output = open_memstream(&text, &size);
+  CompileTokens(&tokens);
+  PrintUnitStatistics();
+  fclose(compiler->output);
+  compiler->output = output;
+  fwrite(text, 1, size, output);
+  WriteUnitCache(compiler->unit_cache_dir, key, text, size);
+  free(text);
+}
+
+static const char *CreateOutputPath(const char *input_path, char suffix) {
+  // foo.c -> foo.<suffix>
+  int len = strlen(input_path);
+  if (len >= 2 && strcmp(input_path + len - 2, ".c") == 0) len -= 2;
+  char *path = AllocMemory(len + 3);
+  memcpy(path, input_path, len);
+  path[len] = '.';
+  path[len + 1] = suffix;
+  return path;
+}
+
+// Assembler
+//  With -c, ELF objects are written by the built-in assembler (assembler.c).
+//  Otherwise, the output is streamed into the external assembler through a
+//  pipe, so that the functions are assembled while the rest is generated.
+//  The output has C style comments, so it is assembled by cc as well as .S
+//  files. The object is written to a temporary file, which is renamed when
+//  the assembler succeeds.
+
+static void SpawnAssembler(const char *object_path) {
+  const char *tmp_path = CreateTemporaryPath(object_path);
+  // Pipes are created while no other thread forks, so that other children
+  // do not inherit the write end and keep the assembler waiting for EOF.
+  pthread_mutex_lock(&output_lock);
+  int fds[2];
+  if (pipe(fds) != 0) {
+    pthread_mutex_unlock(&output_lock);
+    Error("Failed to create a pipe to the assembler");
   }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // cc and its children are killed as a process group on an error
+    setpgid(0, 0);
+    dup2(fds[0], 0);
+    char *args[] = {"cc", "-x", "assembler-with-cpp", "-c",
+                    "-o", (char *)tmp_path, "-", NULL};
+    execvp(args[0], args);
+    fprintf(stderr, "Error: Failed to run the assembler\n");
+    _exit(EXIT_FAILURE);
+  }
+  close(fds[0]);
+  if (pid < 0) {
+    pthread_mutex_unlock(&output_lock);
+    close(fds[1]);
+    Error("Failed to run the assembler");
+  }
+  // The group is also set here in case the child has not done it yet
+  setpgid(pid, pid);
+  AddTemporaryOutput(tmp_path, pid);
+  pthread_mutex_unlock(&output_lock);
+  compiler->assembler_pid = pid;
+  compiler->object_path = object_path;
+  compiler->temporary_output_path = tmp_path;
+  // A failure of the assembler is reported by its exit status, not SIGPIPE
+  signal(SIGPIPE, SIG_IGN);
+  compiler->output = fdopen(fds[1], "wb");
+  if (!compiler->output) {
+    Error("Failed to open a pipe to the assembler");
+  }
+}
 
-  fputs("Parse begin\n", stderr);
-  struct Node *ast = Parse(&tokens);
-  PrintASTNode(ast);
-  fputc('\n', stderr);
-  if(should_optimize) {
-    Optimize(&ast);
+static void WaitForAssembler(void) {
+  fclose(compiler->output);
+  int status;
+  pid_t pid = compiler->assembler_pid;
+  compiler->assembler_pid = 0;
+  bool is_assembled = waitpid(pid, &status, 0) == pid && status == 0;
+  bool is_renamed = FinishTemporaryOutput(compiler->temporary_output_path,
+                                          compiler->object_path, is_assembled);
+  if (!is_assembled) {
+    Error("Failed to assemble %s", compiler->object_path);
   }
+  if (!is_renamed) {
+    Error("Cannot write %s", compiler->object_path);
+  }
+}
 
-  fputs("Analyze begin\n", stderr);
-  struct SymbolEntry *ctx = Analyze(ast);
-  PrintASTNode(ast);
-  fputc('\n', stderr);
+static bool ShouldAssemble(void) {
+  // -E and -M stop before generating the assembly
+  return compiler->should_assemble && !compiler->is_preprocess_only &&
+         !compiler->is_dependency_only;
+}
 
-  Generate(ast, ctx);
+static void OpenOutput(const char *path) {
+  // path: NULL for stdout
+  if (ShouldAssemble()) {
+    if (!path) {
+      Error("Output path (-o <path>) is required to assemble stdin");
+    }
+    compiler->object_path = path;
+    if (compiler->is_target_elf && !compiler->should_use_external_assembler) {
+      compiler->output =
+          open_memstream(&compiler->assembly, &compiler->assembly_size);
+      return;
+    }
+    SpawnAssembler(path);
+    return;
+  }
+  if (!path) {
+    compiler->output = stdout;
+    return;
+  }
+  const char *tmp_path = CreateTemporaryPath(path);
+  pthread_mutex_lock(&output_lock);
+  AddTemporaryOutput(tmp_path, 0);
+  pthread_mutex_unlock(&output_lock);
+  compiler->text_output_path = path;
+  compiler->temporary_output_path = tmp_path;
+  compiler->output = fopen(tmp_path, "wb");
+  if (!compiler->output) {
+    Error("Cannot open %s", path);
+  }
+}
+
+static void CloseOutput(void) {
+  if (compiler->assembler_pid) {
+    WaitForAssembler();
+    return;
+  }
+  if (compiler->object_path) {
+    // The built-in assembler
+    fclose(compiler->output);
+    const char *tmp_path = CreateTemporaryPath(compiler->object_path);
+    pthread_mutex_lock(&output_lock);
+    AddTemporaryOutput(tmp_path, 0);
+    pthread_mutex_unlock(&output_lock);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+      Error("Cannot open %s", compiler->object_path);
+    }
+    WriteObjectFile(compiler->assembly, compiler->assembly_size, fp);
+    bool is_written = fclose(fp) == 0;
+    free(compiler->assembly);
+    compiler->assembly = NULL;
+    if (!FinishTemporaryOutput(tmp_path, compiler->object_path, is_written)) {
+      Error("Cannot write %s", compiler->object_path);
+    }
+    return;
+  }
+  if (compiler->output == stdout) return;
+  fclose(compiler->output);
+  if (!FinishTemporaryOutput(compiler->temporary_output_path,
+                             compiler->text_output_path, true)) {
+    Error("Cannot write %s", compiler->text_output_path);
+  }
+}
+
+static void CompileFile(const char *input_path) {
+  // Options are inherited from the context of the driver
+  struct CompilerContext *driver = compiler;
+  struct CompilerContext *c = AllocMemory(sizeof(struct CompilerContext));
+  *c = *driver;
+  compiler = c;
+  FILE *fp = fopen(input_path, "rb");
+  if (!fp) {
+    Error("Cannot open %s", input_path);
+  }
+  const char *input = ReadFile(fp);
+  fclose(fp);
+  compiler->input_path = input_path;
+  const char *output_path = compiler->output_path;
+  if (!output_path) {
+    char suffix = compiler->is_preprocess_only ? 'i'
+                  : ShouldAssemble()           ? 'o'
+                                               : 'S';
+    output_path = CreateOutputPath(input_path, suffix);
+  }
+  if (!compiler->dependency_target) {
+    compiler->dependency_target = output_path;
+  }
+  if (!compiler->dependency_output_path && !compiler->is_dependency_only) {
+    compiler->dependency_output_path = CreateOutputPath(input_path, 'd');
+  }
+  // With -M, only the dependencies are written to stdout
+  OpenOutput(compiler->is_dependency_only ? NULL : output_path);
+  // Macro definitions are added to the list while preprocessing
+  struct Node *replacement_list = AllocList();
+  for (int i = 0; i < GetSizeOfList(predefined_macros); i++) {
+    PushToList(replacement_list, GetNodeAt(predefined_macros, i));
+  }
+  CompileTranslationUnit(input, replacement_list);
+  CloseOutput();
+  compiler = driver;
+}
+
+static int RunProgram(void) {
+  // --run: compiles the input and calls its main in this process
+  if (GetSizeOfList(input_paths) > 1) {
+    Error("--run takes only one input");
+  }
+  if (!compiler->is_target_elf) {
+    Error("--run requires --target-os Linux");
+  }
+  if (compiler->should_assemble || compiler->output_path ||
+      compiler->is_preprocess_only || compiler->is_dependency_only) {
+    Error("--run cannot be used with -c, -o, -E and -M");
+  }
+  const char *input;
+  if (GetSizeOfList(input_paths)) {
+    compiler->input_path = GetNodeAt(input_paths, 0)->key;
+    FILE *fp = fopen(compiler->input_path, "rb");
+    if (!fp) {
+      Error("Cannot open %s", compiler->input_path);
+    }
+    input = ReadFile(fp);
+    fclose(fp);
+  } else {
+    input = ReadFile(stdin);
+  }
+  compiler->output =
+      open_memstream(&compiler->assembly, &compiler->assembly_size);
+  CompileTranslationUnit(input, predefined_macros);
+  fclose(compiler->output);
+  compiler->output = stdout;
+  static char *default_argv[] = {"a.out", NULL};
+  if (!compiler->run_argv) {
+    compiler->run_argc = 1;
+    compiler->run_argv = default_argv;
+  }
+  return RunAssembly(compiler->assembly, compiler->assembly_size,
+                     compiler->run_argc, compiler->run_argv);
+}
+
+static void *CompileWorker(void *arg) {
+  // Takes input files one by one until all of them are compiled
+  compiler = arg;
+  for (;;) {
+    int i = __atomic_fetch_add(&next_input_index, 1, __ATOMIC_SEQ_CST);
+    if (i >= GetSizeOfList(input_paths)) break;
+    CompileFile(GetNodeAt(input_paths, i)->key);
+  }
+  return NULL;
+}
+
+// Compile server
+//  `compilium --server PATH` listens on a Unix domain socket and compiles the
+//  requests one by one in a warm process, which keeps the tokens of headers.
+//  `compilium --client PATH <options>` sends its options and stdin to the
+//  server and prints the result, so it can be used in place of compilium.
+//  Each message is "<length>\n" followed by the bytes.
+//  request: the number of options, the options, the working directory of
+//  the client (where relative paths are resolved) and the source
+//  response: "0" and the output, or "1" and the error messages
+
+#define MAX_REQUEST_ARGS 4096
+
+static char *server_cwd;  // restored after each request
+
+static bool ReadFromSocket(int fd, void *buf, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = read(fd, (char *)buf + done, size - done);
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool WriteToSocket(int fd, const void *buf, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = write(fd, (const char *)buf + done, size - done);
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+static char *ReceiveMessage(int fd, size_t *size) {
+  // Returns a NUL-terminated copy of the message, or NULL on failure
+  char header[32];
+  int len = 0;
+  for (;;) {
+    if (len >= (int)sizeof(header) - 1) return NULL;
+    if (!ReadFromSocket(fd, &header[len], 1)) return NULL;
+    if (header[len] == '\n') break;
+    len++;
+  }
+  header[len] = 0;
+  *size = strtol(header, NULL, 10);
+  char *buf = malloc(*size + 1);
+  if (!ReadFromSocket(fd, buf, *size)) {
+    free(buf);
+    return NULL;
+  }
+  buf[*size] = 0;
+  return buf;
+}
+
+static bool SendMessage(int fd, const char *buf, size_t size) {
+  char header[32];
+  int len = snprintf(header, sizeof(header), "%lu\n", size);
+  return WriteToSocket(fd, header, len) && WriteToSocket(fd, buf, size);
+}
+
+static struct sockaddr_un *CreateSocketAddress(const char *path) {
+  struct sockaddr_un *addr = calloc(1, sizeof(struct sockaddr_un));
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    Error("Socket path is too long: %s", path);
+  }
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+  return addr;
+}
+
+static void CompileRequest(int argc, char **argv, const char *input) {
+  // Errors jump out of here, see ServeRequest
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--run-unittest=", 15) == 0) {
+      Error("Unit tests cannot be run by the server");
+    }
+    if (strncmp(argv[i], "--run-bench=", 12) == 0) {
+      Error("Benchmarks cannot be run by the server");
+    }
+  }
+  struct Node *replacement_list = ParseCompilerArgs(argc, argv);
+  if (GetSizeOfList(input_paths) || server_socket_path) {
+    Error("Only a source from stdin can be compiled by the server");
+  }
+  if (compiler->should_assemble || compiler->output_path) {
+    Error("The output of the server is sent to the client (-c and -o)");
+  }
+  if (compiler->should_run) {
+    Error("Programs cannot be run by the server");
+  }
+  if (compiler->should_print_stats || compiler->should_print_unit_stats) {
+    Error("Statistics (--stats) are not sent by the server");
+  }
+  if (compiler->optimization_record_path) {
+    Error("Optimization records cannot be written by the server");
+  }
+  if (compiler->should_time_passes) {
+    Error("Pass timings (--time-passes) are not sent by the server");
+  }
+  for (int i = 0; i < GetSizeOfList(predefined_macros); i++) {
+    PushToList(replacement_list, GetNodeAt(predefined_macros, i));
+  }
+  CompileTranslationUnit(input, replacement_list);
+}
+
+static void RespondToRequest(int fd, struct CompilerContext *server, int argc,
+                             char **argv, const char *cwd,
+                             const char *input) {
+  struct CompilerContext *c = calloc(1, sizeof(struct CompilerContext));
+  *c = *server;
+  char *output;
+  size_t output_size;
+  char *error_output;
+  size_t error_output_size;
+  c->output = open_memstream(&output, &output_size);
+  c->error_output = open_memstream(&error_output, &error_output_size);
+  jmp_buf error_jmp;
+  c->error_jmp = &error_jmp;
+  compiler = c;
+  int status = 0;
+  if (setjmp(error_jmp) == 0) {
+    if (chdir(cwd)) {
+      Error("Failed to change the directory to %s", cwd);
+    }
+    CompileRequest(argc, argv, input);
+  } else {
+    status = 1;
+  }
+  compiler = server;
+  if (chdir(server_cwd)) {
+    Error("Failed to change the directory to %s", server_cwd);
+  }
+  fclose(c->output);
+  fclose(c->error_output);
+  free(c);
+  // Options of a request should not affect the next one
+  num_of_jobs = 1;
+  server_socket_path = NULL;
+  input_paths = AllocList();
+  fprintf(stderr, "Request: %s\n", status ? "failed" : "compiled");
+  if (SendMessage(fd, status ? "1" : "0", 1)) {
+    if (status) {
+      SendMessage(fd, error_output, error_output_size);
+    } else {
+      SendMessage(fd, output, output_size);
+    }
+  }
+  free(output);
+  free(error_output);
+}
+
+static void ServeRequest(int fd, struct CompilerContext *server) {
+  size_t size;
+  char *num_of_args_str = ReceiveMessage(fd, &size);
+  if (!num_of_args_str) return;
+  // argv[0] is not used as an option
+  int argc = strtol(num_of_args_str, NULL, 10) + 1;
+  free(num_of_args_str);
+  if (argc < 1 || argc > MAX_REQUEST_ARGS) return;
+  char **argv = calloc(argc, sizeof(char *));
+  bool is_received = true;
+  for (int i = 1; i < argc && is_received; i++) {
+    is_received = (argv[i] = ReceiveMessage(fd, &size)) != NULL;
+  }
+  char *cwd = is_received ? ReceiveMessage(fd, &size) : NULL;
+  char *input = cwd ? ReceiveMessage(fd, &size) : NULL;
+  if (input) {
+    RespondToRequest(fd, server, argc, argv, cwd, input);
+  }
+  for (int i = 1; i < argc; i++) {
+    free(argv[i]);
+  }
+  free(argv);
+  free(cwd);
+  free(input);
+}
+
+static void RunCompileServer(const char *path) {
+  // The options of the server are used as defaults of the requests
+  struct CompilerContext *server = compiler;
+  server->header_cache = AllocList();
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    Error("Failed to create a socket");
+  }
+  struct sockaddr_un *addr = CreateSocketAddress(path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) ||
+      listen(fd, 16)) {
+    Error("Failed to listen on %s", path);
+  }
+  // Clients may go away before receiving the response
+  signal(SIGPIPE, SIG_IGN);
+  server_socket_path = NULL;
+  if (!(server_cwd = getcwd(NULL, 0))) {
+    Error("Failed to get the working directory");
+  }
+  fprintf(stderr, "Listening on %s\n", path);
+  for (;;) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0) continue;
+    ServeRequest(conn, server);
+    close(conn);
+  }
+}
+
+static int RunCompileClient(const char *path, int argc, char **argv) {
+  // Sends all the options except --client PATH
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un *addr = CreateSocketAddress(path);
+  if (fd < 0 || connect(fd, (struct sockaddr *)addr, sizeof(*addr))) {
+    Error("Failed to connect to the server at %s", path);
+  }
+  char num_of_args[16];
+  snprintf(num_of_args, sizeof(num_of_args), "%d", argc - 3);
+  SendMessage(fd, num_of_args, strlen(num_of_args));
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--client") == 0) {
+      i++;
+      continue;
+    }
+    SendMessage(fd, argv[i], strlen(argv[i]));
+  }
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd) {
+    Error("Failed to get the working directory");
+  }
+  SendMessage(fd, cwd, strlen(cwd));
+  free(cwd);
+  const char *input = ReadFile(stdin);
+  SendMessage(fd, input, strlen(input));
+  size_t size;
+  char *status = ReceiveMessage(fd, &size);
+  char *result = status ? ReceiveMessage(fd, &size) : NULL;
+  if (!result) {
+    Error("Connection to the server is closed");
+  }
+  fwrite(result, 1, size, strcmp(status, "0") == 0 ? stdout : stderr);
+  close(fd);
+  return strcmp(status, "0") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Library
+//  CompileString() compiles a source in memory for a long-lived host (see
+//  libcompilium.h). Errors are returned like the requests of the server.
+//  Everything of a compilation is allocated in the arenas of the calling
+//  thread, which are reset by the next call instead of being freed.
+
+static _Thread_local struct Arena *library_unit_arena;
+static _Thread_local struct Arena *library_func_arena;
+static pthread_once_t node_type_names_once = PTHREAD_ONCE_INIT;
+
+static void CompileStringInContext(const char *src, size_t len,
+                                   const CompileOptions *options,
+                                   FILE *output) {
+  // Errors jump out of here, see CompileString
+  char *argv[8];
+  int argc = 0;
+  argv[argc++] = "compilium";
+  if (options->target_os) {
+    argv[argc++] = "--target-os";
+    argv[argc++] = (char *)options->target_os;
+  }
+  if (options->include_path) {
+    argv[argc++] = "-I";
+    argv[argc++] = (char *)options->include_path;
+  }
+  if (options->is_optimization_disabled) argv[argc++] = "-O0";
+  SetOptimizationLevel(DEFAULT_OPTIMIZATION_LEVEL);
+  struct Node *replacement_list = ParseCompilerArgs(argc, argv);
+  const char *input = AllocString(src, len);
+  if (!options->should_assemble) {
+    compiler->output = output;
+    CompileTranslationUnit(input, replacement_list);
+    return;
+  }
+  if (!compiler->is_target_elf) {
+    Error("Objects can be written only for --target-os Linux");
+  }
+  compiler->output =
+      open_memstream(&compiler->assembly, &compiler->assembly_size);
+  CompileTranslationUnit(input, replacement_list);
+  fclose(compiler->output);
+  compiler->output = output;
+  WriteObjectFile(compiler->assembly, compiler->assembly_size, output);
+  free(compiler->assembly);
+  compiler->assembly = NULL;
+}
+
+int CompileString(const char *src, size_t len, const CompileOptions *options,
+                  OutputBuffer *output) {
+  pthread_once(&node_type_names_once, InitNodeTypeNames);
+  if (!library_unit_arena) {
+    library_unit_arena = AllocArena();
+    library_func_arena = AllocArena();
+  }
+  ResetArena(library_unit_arena);
+  ResetArena(library_func_arena);
+  struct CompilerContext context = {.current_arena = library_unit_arena,
+                                    .unit_arena = library_unit_arena,
+                                    .func_arena = library_func_arena};
+  FILE *fp = open_memstream(&output->data, &output->size);
+  char *error_output;
+  size_t error_output_size;
+  context.error_output = open_memstream(&error_output, &error_output_size);
+  jmp_buf error_jmp;
+  context.error_jmp = &error_jmp;
+  struct CompilerContext *saved_compiler = compiler;
+  compiler = &context;
+  int status = 0;
+  if (setjmp(error_jmp) == 0) {
+    CompileStringInContext(src, len, options, fp);
+  } else {
+    status = 1;
+    // The error may be raised while the output is being assembled
+    if (context.output && context.output != fp) fclose(context.output);
+    free(context.assembly);
+  }
+  compiler = saved_compiler;
+  fclose(fp);
+  fclose(context.error_output);
+  if (status) {
+    free(output->data);
+    output->data = error_output;
+    output->size = error_output_size;
+  } else {
+    free(error_output);
+  }
+  return status;
+}
+
+void ReleaseCompileMemory(void) {
+  if (!library_unit_arena) return;
+  FreeArena(library_unit_arena);
+  FreeArena(library_func_arena);
+  library_unit_arena = NULL;
+  library_func_arena = NULL;
+}
+
+int CompiliumMain(int argc, char *argv[]) {
+  for (int i = 1; i + 1 < argc; i++) {
+    if (strcmp(argv[i], "--client") == 0) {
+      return RunCompileClient(argv[i + 1], argc, argv);
+    }
+  }
+  InitNodeTypeNames();
+  compiler = calloc(1, sizeof(struct CompilerContext));
+  compiler->is_verbose = true;
+  SetOptimizationLevel(DEFAULT_OPTIMIZATION_LEVEL);
+  compiler->function_cache_size_limit = DEFAULT_FUNCTION_CACHE_SIZE_LIMIT;
+  compiler->output = stdout;
+  compiler->unit_cache_dir = getenv("COMPILIUM_CACHE_DIR");
+  input_paths = AllocList();
+  predefined_macros = ParseCompilerArgs(argc, argv);
+  if (server_socket_path) {
+    RunCompileServer(server_socket_path);
+  }
+  if (compiler->optimization_record_path) {
+    compiler->optimization_record =
+        fopen(compiler->optimization_record_path, "w");
+    if (!compiler->optimization_record) {
+      Error("Cannot open %s", compiler->optimization_record_path);
+    }
+  }
+  if (GetSizeOfList(input_paths) > 1 &&
+      (compiler->dependency_output_path || compiler->dependency_target ||
+       compiler->output_path)) {
+    Error("-o, -MF and -MT cannot be used with multiple inputs");
+  }
+  pthread_mutex_init(&output_lock, NULL);
+
+  if (GetSizeOfList(input_paths) <= 1) {
+    // Parallelize the compilation of functions instead of files
+    compiler->num_of_backend_threads = num_of_jobs;
+  }
+  if (compiler->should_run) {
+    return RunProgram();
+  }
+  if (!GetSizeOfList(input_paths)) {
+    if (!compiler->dependency_target) {
+      compiler->dependency_target = compiler->output_path;
+    }
+    OpenOutput(compiler->is_dependency_only ? NULL : compiler->output_path);
+    CompileTranslationUnit(ReadFile(stdin), predefined_macros);
+    CloseOutput();
+    return 0;
+  }
+  if (num_of_jobs > GetSizeOfList(input_paths)) {
+    num_of_jobs = GetSizeOfList(input_paths);
+  }
+  if (num_of_jobs <= 1) {
+    CompileWorker(compiler);
+    return 0;
+  }
+  pthread_t *workers = AllocMemory(sizeof(pthread_t) * num_of_jobs);
+  for (int i = 0; i < num_of_jobs; i++) {
+    if (pthread_create(&workers[i], NULL, CompileWorker, compiler)) {
+      Error("Failed to create a thread");
+    }
+  }
+  for (int i = 0; i < num_of_jobs; i++) {
+    pthread_join(workers[i], NULL);
+  }
   return 0;
 }
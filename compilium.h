@@ -1,8 +1,21 @@
+#include "include/dlfcn.h"
+#include "include/fcntl.h"
 #include "include/stdarg.h"
 #include "include/stdbool.h"
 #include "include/stdio.h"
 #include "include/stdlib.h"
+#include "include/pthread.h"
+#include "include/sched.h"
+#include "include/setjmp.h"
+#include "include/signal.h"
 #include "include/string.h"
+#include "include/sys/file.h"
+#include "include/sys/mman.h"
+#include "include/sys/socket.h"
+#include "include/sys/un.h"
+#include "include/sys/wait.h"
+#include "include/time.h"
+#include "include/unistd.h"
 
 char *strndup(const char *s, size_t n);
 char *strdup(const char *s);
@@ -114,6 +127,7 @@ struct Node {
   int capacity;
   int size;
   struct Node **nodes;
+  struct Arena *list_arena;
   // for key value
   const char *key;
   struct Node *value;
@@ -125,15 +139,21 @@ struct Node {
   struct Node *func_expr;
   struct Node *arg_expr_list;
   struct Node *arg_var_list;
-  int stack_size_needed;
   // kASTFuncDef
   struct Node *func_body;
+  int stack_size_needed;  // max bytes of local vars, aligned to 16
   struct Node *func_type;
   struct Node *func_name_token;
   struct Node *tag;
   struct Node *type_struct_spec;
   struct Node *type_array_type_of;
   struct Node *type_array_index_decl;
+  int type_array_length;
+  // for types
+  struct Node *canonical_type;
+  struct Node *next_hashed_type;
+  int type_size;
+  int type_align;
   // kNodeToken
   enum TokenType token_type;
   struct Node *next_token;
@@ -157,9 +177,7 @@ int GetSizeOfList(struct Node *list);
 struct Node *GetNodeAt(struct Node *list, int index);
 struct Node **GetNodeReferenceAt(struct Node *list, int index);
 struct Node *GetNodeByTokenKey(struct Node *list, struct Node *key);
-
-extern const char *symbol_prefix;
-extern const char *include_path;
+struct Node *GetNodeByKey(struct Node *list, const char *key);
 
 #define NUM_OF_SCRATCH_REGS 10
 extern const char *reg_names_64[NUM_OF_SCRATCH_REGS + 1];
@@ -171,8 +189,197 @@ extern const char *param_reg_names_64[NUM_OF_PARAM_REGISTERS];
 extern const char *param_reg_names_32[NUM_OF_PARAM_REGISTERS];
 extern const char *param_reg_names_8[NUM_OF_PARAM_REGISTERS];
 
+#define TYPE_HASH_TABLE_SIZE 1024
+
+// Assembly of a function emitted with local labels (see MergeFunctionOutput)
+struct EmittedFunction {
+  char *text;
+  size_t size;
+  struct Node *str_list;  // string literals with local labels
+  int num_of_labels;
+};
+
+// Code of a function for --stats, counted by the built-in assembler
+struct FunctionStats {
+  long num_of_insts;
+  long num_of_bytes;
+  long num_of_loads;
+  long num_of_stores;
+  long num_of_pushes;
+  long num_of_pops;
+  long num_of_calls;
+  long num_of_idivs;
+  long num_of_spills;  // scratch registers saved around calls
+  long frame_size;     // bytes of local variables
+};
+
+// Machine IR, see mir.c
+enum MachineOperandKind {
+  kMachineOperandNone,
+  kMachineOperandReg,       // scratch register assigned by the analyzer
+  kMachineOperandFixedReg,  // rax, rbp, rdi (as a parameter), cl, ...
+  kMachineOperandImm,
+  kMachineOperandLabel,   // L<label>
+  kMachineOperandSymbol,  // with the symbol prefix
+  kMachineOperandMem,
+};
+
+struct MachineOperand {
+  enum MachineOperandKind kind;
+  int size;          // bytes of a register, or "<size> ptr" of memory if not 0
+  int reg;           // scratch register, or the base of memory
+  const char *name;  // fixed register, or the fixed base of memory
+  int scale;         // memory: [base + scale * index_reg]
+  int index_reg;
+  int disp;  // memory: [base + disp]
+  long imm;
+  int label;           // L<label>, or [rip + L<label>]
+  const char *symbol;  // symbol, or [rip + symbol@GOTPCREL]
+  bool is_legacy_tight_ptr;  // "dword ptr[rdi]" with --legacy-asm-text
+};
+
+enum MachineInstKind {
+  kMachineInst,
+  kMachineLabel,      // operands[0] is a label or a symbol
+  kMachineDirective,  // .global
+};
+
+#define MAX_MACHINE_OPERANDS 3
+struct MachineInst {
+  enum MachineInstKind kind;
+  const char *opcode;
+  int num_of_operands;
+  struct MachineOperand operands[MAX_MACHINE_OPERANDS];
+  const char *comment;
+  bool is_legacy_slash_comment;  // "// comment" with --legacy-asm-text
+};
+
+// --time-passes, summed up over the unit
+#define NUM_OF_OPTIMIZATION_PASSES 3
+struct PassTiming {
+  double seconds;
+  long num_of_runs;
+  long num_of_changes;  // runs which changed the declaration
+};
+
+// State of the compilation of one translation unit. Each thread compiles
+// with its own context, which is pointed by compiler.
+struct CompilerContext {
+  // options
+  const char *symbol_prefix;
+  const char *include_path;
+  bool is_preprocess_only;
+  bool is_target_elf;
+  bool should_assemble;                // -c
+  bool should_use_external_assembler;  // -fno-integrated-as
+  const char *output_path;             // -o
+  bool is_dependency_only;             // -M
+  bool should_write_dependencies;      // -MD
+  const char *dependency_output_path;  // -MF
+  const char *dependency_target;       // -MT
+  bool should_run;                     // --run
+  bool should_write_perf_map;          // --perf-map
+  bool should_print_stats;             // --stats
+  bool should_print_unit_stats;        // --unit-stats
+  const char *remark_passes;           // -Rpass=
+  const char *missed_remark_passes;    // -Rpass-missed=
+  const char *optimization_record_path;  // -foptimization-record-file=
+  int run_argc;                        // arguments after --
+  char **run_argv;
+  const char *passes;       // -O, --passes=: pipeline of the optimizer
+  int max_pass_iterations;  // -O, --max-pass-iterations=
+  bool should_time_passes;    // --time-passes
+  bool should_verify_passes;  // --verify-passes
+  bool should_print_legacy_asm_text;  // --legacy-asm-text
+  int num_of_backend_threads;
+  const char *function_cache_dir;
+  long function_cache_size_limit;
+  const char *unit_cache_dir;
+  FILE *output;
+  const char *input_path;  // NULL if the input is stdin
+  // compilium.c
+  jmp_buf *error_jmp;  // Error() jumps here instead of exit() if not NULL
+  FILE *error_output;  // error messages are written here if not NULL
+  bool is_verbose;  // the AST and the progress are dumped to stderr (CLI)
+  pid_t assembler_pid;  // the assembler reads the output if not 0
+  const char *object_path;
+  char *assembly;  // output for the built-in assembler
+  size_t assembly_size;
+  const char *text_output_path;  // the .S or .i file, NULL for stdout
+  const char *temporary_output_path;  // renamed to the output on success
+  FILE *optimization_record;  // remarks are written here as YAML if not NULL
+  // statistics of the unit, counted on this context
+  long num_of_tokens;  // tokenized, including the headers
+  long num_of_nodes;   // allocated
+  long num_of_functions;  // with --stats, not counting the cached ones
+  struct FunctionStats unit_stats;  // sum of the functions
+  struct PassTiming pass_timings[NUM_OF_OPTIMIZATION_PASSES];
+  // arena.c
+  struct Arena *current_arena;
+  struct Arena *unit_arena;  // lives as long as the unit, NULL for the heap
+  struct Arena *func_arena;  // reset after each function definition
+  // cache.c
+  struct FunctionCache *function_cache;
+  // preprocessor.c
+  struct Node *header_cache;  // kept across the requests of the server
+  struct Node *dependencies;  // paths of the included files
+  // token.c
+  struct Node **next_token_holder;
+  struct TokenPipe *token_output_pipe;  // preprocessor thread sends tokens
+  struct TokenPipe *token_input_pipe;   // parser receives tokens
+  struct Node **token_pipe_tail;        // tokens are received after this
+  // optimizer.c
+  struct Node *optimizing_function;  // ASTFuncDef, for remarks
+  bool are_missed_remarks_muted;     // until the last iteration
+  // parser.c
+  struct Node *ord_idents;  // ordinary identifiers
+  // analyzer.c
+  struct Node *in_function;  // ASTFuncDef
+  int reg_used_table[NUM_OF_SCRATCH_REGS + 1];
+  struct Node *reg_node_table[NUM_OF_SCRATCH_REGS + 1];
+  // generator.c
+  struct Node *str_list;
+  int label_to_break;
+  int label_to_continue;
+  int label_number;
+  bool use_local_labels;  // emit L-n, which are renumbered on merge
+  struct FunctionStats function_stats;  // of the last function definition
+  // mir.c
+  struct MachineInst *machine_insts;  // of the external declaration
+  int num_of_machine_insts;
+  int machine_insts_capacity;
+  // type.c
+  struct Node **type_hash_table;  // shared by all contexts of a unit
+  pthread_mutex_t *type_table_lock;
+  struct Node *int_type;
+  struct Node *char_type;
+};
+
+extern _Thread_local struct CompilerContext *compiler;
+
 // @analyzer.c
 struct SymbolEntry *Analyze(struct Node *node);
+void AnalyzeExternalDecl(struct Node *node, struct SymbolEntry **ctx);
+void DeclareFuncDef(struct Node *node, struct SymbolEntry **ctx);
+void AnalyzeFuncDefBody(struct Node *node, struct SymbolEntry *ctx);
+
+// @arena.c
+struct Arena;
+struct Arena *AllocArena(void);
+void *AllocMemoryInArena(struct Arena *a, size_t size);
+void *AllocMemory(size_t size);
+char *AllocString(const char *begin, int length);
+void ResetArena(struct Arena *a);
+void FreeArena(struct Arena *a);
+size_t GetPeakUsageOfArena(struct Arena *a);
+struct Arena *GetCurrentArena(void);
+struct Arena *SwitchArena(struct Arena *a);
+
+// @assembler.c
+void WriteObjectFile(const char *assembly, size_t size, FILE *fp);
+int RunAssembly(const char *assembly, size_t size, int argc, char **argv);
+void CountMachineInsts(struct MachineInst *insts, int n,
+                      struct FunctionStats *stats);
 
 // @ast.c
 bool IsToken(struct Node *n);
@@ -207,22 +414,77 @@ struct Node *CreateASTIdent(struct Node *ident);
 struct Node *CreateTypeArray(struct Node *type_of, struct Node *index_decl);
 struct Node *CreateMacroReplacement(struct Node *args_tokens,
                                     struct Node *to_tokens);
+struct ASTVisitor {
+  bool (*pre)(struct Node **np, struct ASTVisitor *v);  // false skips children
+  void (*post)(struct Node **np, struct ASTVisitor *v);
+  void *data;
+  bool changed;  // set by the hooks which rewrite the AST
+};
+void VisitAST(struct Node **np, struct ASTVisitor *v);
 void PrintASTNode(struct Node *n);
 void InitNodeTypeNames();
 const char *GetASTNodeTypeName(struct Node *n);
 
+// @cache.c
+struct FunctionCache;
+struct FunctionCache *OpenFunctionCache(const char *dir, long size_limit);
+void AddDeclToFunctionCache(struct FunctionCache *fc, struct Node *begin,
+                            struct Node *end);
+unsigned long GetFunctionCacheKey(struct FunctionCache *fc, struct Node *begin,
+                                  struct Node *end);
+bool LookupFunctionCache(struct FunctionCache *fc, unsigned long key,
+                         struct EmittedFunction *f);
+void StoreFunctionCache(struct FunctionCache *fc, unsigned long key,
+                        struct EmittedFunction *f);
+void CloseFunctionCache(struct FunctionCache *fc);
+unsigned long GetUnitCacheKey(struct Node *tokens);
+bool ReadUnitCache(const char *dir, unsigned long key, FILE *output);
+void WriteUnitCache(const char *dir, unsigned long key, const char *text,
+                    size_t size);
+
 // @compilium.c
 const char *ReadFile(FILE *fp);
+double GetMonotonicSeconds(void);
+int CompiliumMain(int argc, char *argv[]);
 
 // @generate.c
 void Generate(struct Node *ast, struct SymbolEntry *);
+void InitGenerator(void);
+void GenerateExternalDecl(struct Node *node);
+void FinishGenerator(struct SymbolEntry *toplevel_names);
+void MergeFunctionOutput(struct EmittedFunction *f);
+
+// @mir.c
+struct MachineOperand RegOperand(int reg, int size);
+struct MachineOperand FixedRegOperand(const char *name);
+struct MachineOperand ImmOperand(long imm);
+struct MachineOperand LabelOperand(int label);
+struct MachineOperand SymbolOperand(const char *symbol);
+struct MachineOperand MemOperand(int size, int base_reg);
+struct MachineOperand FixedMemOperand(int size, const char *base, int disp);
+struct MachineOperand IndexedMemOperand(int base_reg, int scale,
+                                        int index_reg);
+struct MachineOperand GOTEntryOperand(const char *symbol);
+struct MachineOperand LabelAddressOperand(int label);
+struct MachineInst *AppendMachineInst(enum MachineInstKind kind,
+                                      const char *opcode);
+void ClearMachineInsts(void);
+const char *GetMachineRegName(int reg, int size);
+void PrintMachineInsts(FILE *fp, struct MachineInst *insts, int n,
+                       bool is_legacy);
 
 // @optimizer.c
+bool SetOptimizationLevel(const char *option);
+void SetPasses(const char *passes);
 void Optimize(struct Node **ast);
+void PrintPassTimings(void);
 
 // @parser.c
 extern struct Node *toplevel_names;
 void InitParser(struct Node **);
+struct Node *ParseExternalDecl(struct Arena *body_arena);
+struct Node *ParseFromTokens(struct Node **head_token,
+                             struct Node *(*parser)(void));
 struct Node *Parse(struct Node **passed_tokens);
 
 // @preprocessor.c
@@ -250,6 +512,7 @@ struct SymbolEntry {
   struct SymbolEntry *prev;
   const char *key;
   struct Node *value;
+  int frame_ofs;  // bytes of local vars in use when this entry is visible
 };
 int GetLastLocalVarOffset(struct SymbolEntry *);
 struct Node *AddLocalVar(struct SymbolEntry **ctx, const char *key,
@@ -286,6 +549,7 @@ void PrintTokenBrief(struct Node *t);
 void PrintTokenStrToFile(struct Node *t, FILE *fp);
 
 void InitTokenStream(struct Node **head_token);
+struct Node **GetTokenStream(void);
 struct Node *PeekToken(void);
 struct Node *ReadToken(enum TokenType type);
 struct Node *ConsumeToken(enum TokenType type);
@@ -300,12 +564,25 @@ void InsertTokens(struct Node *);
 void InsertTokensWithIdentReplace(struct Node *seq, struct Node *rep_list);
 struct Node **RemoveDelimiterTokens(struct Node **);
 
+struct TokenPipe;
+struct TokenPipe *AllocTokenPipe(void);
+void SendTokenToPipe(struct TokenPipe *pipe, struct Node *t);
+void CloseTokenPipe(struct TokenPipe *pipe);
+void InitTokenStreamFromPipe(struct Node **head_token, struct TokenPipe *pipe);
+
 // @tokenizer.c
 struct Node *CreateNextToken(const char *p, const char *src, int *line);
 struct Node *CreateToken(const char *input);
 struct Node *Tokenize(const char *input);
 
 // @type.c
+struct Node *InternType(struct Node *key);
+int IsCanonicalType(struct Node *t);
+int IsCanonicalTypeList(struct Node *list);
+struct Node *GetCanonicalType(struct Node *t);
+struct Node *GetIntType(void);
+struct Node *GetCharType(void);
+int EvalExprAsInt(struct Node *n);
 int IsPointerType(struct Node *n);
 int GetScaleOfPointerType(struct Node *n);
 int IsSameTypeExceptAttr(struct Node *a, struct Node *b);
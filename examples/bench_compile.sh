@@ -0,0 +1,73 @@
+#!/bin/bash -e
+# Measures the throughput of compilium on the workloads of gen_workload.sh
+# and prints it as JSON. The time of each size is the best of REPEAT runs.
+# A kind is flagged as superlinear when the time grows faster than
+# N^SUPERLINEAR_EXPONENT between the smallest and the largest size.
+KINDS=${KINDS:-"functions globals locals expr macros includes members"}
+SIZES=${SIZES:-"1000 2000 4000 8000"}
+REPEAT=${REPEAT:-3}
+SUPERLINEAR_EXPONENT=${SUPERLINEAR_EXPONENT:-1.3}
+COMPILIUM=$(cd .. && pwd)/compilium
+GEN_WORKLOAD=$(pwd)/gen_workload.sh
+WORK_DIR=$(mktemp -d)
+trap "rm -rf $WORK_DIR" EXIT
+make -C .. compilium >/dev/null 2>&1
+TIMEFORMAT=%3R
+cd $WORK_DIR
+
+echo "{"
+echo "  \"sizes\": [${SIZES// /, }],"
+echo "  \"kinds\": {"
+num_of_superlinear_kinds=0
+first_kind=1
+for kind in $KINDS; do
+  [ $first_kind ] || echo ","
+  first_kind=
+  echo "    \"$kind\": {"
+  echo "      \"runs\": ["
+  results=
+  for n in $SIZES; do
+    rm -f *.c *.h
+    $GEN_WORKLOAD $kind $n
+    best=
+    for ((i = 0; i < REPEAT; i++)); do
+      ( time $COMPILIUM --unit-stats --target-os Linux -I ./ < main.c \
+        > main.S 2> compile.log ) 2> time.log \
+        || { echo "compilation of $kind $n failed" >&2; exit 1; }
+      t=$(cat time.log)
+      best=$(awk -v a="$best" -v b=$t 'BEGIN { print ((a == "" || b < a) ? b : a) }')
+    done
+    stats=$(grep 'Unit statistics' compile.log)
+    tokens=$(echo $stats | awk '{ print $3 }')
+    nodes=$(echo $stats | awk '{ print $5 }')
+    echo "$kind n=$n: ${best}s" >&2
+    results="$results $n:$best"
+    awk -v n=$n -v t=$best -v tokens=$tokens -v nodes=$nodes \
+      -v last=$([ "$n" = "${SIZES##* }" ] && echo 1) 'BEGIN {
+      if (t < 0.001) t = 0.001;
+      printf "        {\"n\": %d, \"seconds\": %.3f, \"tokens\": %d, ", n, t, tokens;
+      printf "\"nodes\": %d, \"tokens_per_second\": %d, ", nodes, tokens / t;
+      printf "\"nodes_per_second\": %d}%s\n", nodes / t, last ? "" : ",";
+    }'
+  done
+  echo "      ],"
+  # Slope of log(time) over log(N) between the smallest and the largest size
+  exponent=$(echo $results | awk '{
+    split($1, a, ":"); split($NF, b, ":");
+    ta = a[2] < 0.001 ? 0.001 : a[2]; tb = b[2] < 0.001 ? 0.001 : b[2];
+    printf "%.2f", log(tb / ta) / log(b[1] / a[1]);
+  }')
+  superlinear=$(awk -v e=$exponent -v limit=$SUPERLINEAR_EXPONENT \
+    'BEGIN { print ((e > limit) ? "true" : "false") }')
+  if [ $superlinear = true ]; then
+    num_of_superlinear_kinds=$((num_of_superlinear_kinds + 1))
+    echo "$kind scales superlinearly (exponent $exponent)" >&2
+  fi
+  echo "      \"exponent\": $exponent,"
+  echo "      \"superlinear\": $superlinear"
+  printf "    }"
+done
+echo
+echo "  },"
+echo "  \"num_of_superlinear_kinds\": $num_of_superlinear_kinds"
+echo "}"
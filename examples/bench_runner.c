@@ -0,0 +1,112 @@
+// Runs a program once and prints its wall time and hardware counters as
+//  <seconds> <instructions> <cycles> <branch_misses>
+// The stdout of the program is written to OUTPUT. Counters which are not
+// available (perf_event_open is Linux only and may be disabled by
+// perf_event_paranoid) are printed as null. Built by the host compiler, see
+// bench_runtime.sh.
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#define NUM_OF_COUNTERS 3
+
+static int OpenCounter(int index, pid_t pid) {
+#ifdef __linux__
+  static const uint64_t configs[NUM_OF_COUNTERS] = {
+      PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES,
+      PERF_COUNT_HW_BRANCH_MISSES};
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = configs[index];
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+#else
+  (void)index;
+  (void)pid;
+  return -1;
+#endif
+}
+
+static double GetSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s OUTPUT PROGRAM [ARGS...]\n", argv[0]);
+    return 1;
+  }
+  int output_fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (output_fd < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  // The child waits for the counters to be attached before exec,
+  // so that only the program itself is counted
+  int go_pipe[2];
+  if (pipe(go_pipe)) {
+    perror("pipe");
+    return 1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (pid == 0) {
+    char c;
+    close(go_pipe[1]);
+    if (read(go_pipe[0], &c, 1) != 1) _exit(127);
+    dup2(output_fd, 1);
+    execv(argv[2], &argv[2]);
+    perror(argv[2]);
+    _exit(127);
+  }
+  close(go_pipe[0]);
+  int counter_fds[NUM_OF_COUNTERS];
+  for (int i = 0; i < NUM_OF_COUNTERS; i++) {
+    counter_fds[i] = OpenCounter(i, pid);
+  }
+  double begin = GetSeconds();
+  if (write(go_pipe[1], "", 1) != 1) {
+    perror("write");
+    return 1;
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  double seconds = GetSeconds() - begin;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+    fprintf(stderr, "%s did not exit normally\n", argv[2]);
+    return 1;
+  }
+  printf("%.6f", seconds);
+  for (int i = 0; i < NUM_OF_COUNTERS; i++) {
+    uint64_t count;
+    if (counter_fds[i] >= 0 &&
+        read(counter_fds[i], &count, sizeof(count)) == sizeof(count)) {
+      printf(" %llu", (unsigned long long)count);
+    } else {
+      printf(" null");
+    }
+  }
+  putchar('\n');
+  return 0;
+}
@@ -0,0 +1,120 @@
+#!/bin/bash -e
+# Measures the code generated by compilium on the benchmark programs.
+# Each program is built as the variants below, and each binary is run REPEAT
+# times by bench_runner.c. The median of wall time, instructions, cycles and
+# branch misses is printed as JSON, and written as a markdown scoreboard to
+# MARKDOWN. The stdout of every variant should be the same as host_o0, so a
+# mismatch is reported as a failure. Programs without the source are skipped.
+#  o0:      compilium -O0
+#  default: compilium
+#  old:     compilium.old
+#  host_o0: host compiler
+#  host_o3: host compiler with -O3
+PROGRAMS=${PROGRAMS:-"fib pi collatz constsum kadai kadai2 kadai3
+  optimizer_benchmark_masumoto tajima_optimizer_benchmark moroto
+  gameoflife_bounded"}
+VARIANTS=${VARIANTS:-"o0 default old host_o0 host_o3"}
+REPEAT=${REPEAT:-3}
+MARKDOWN=${MARKDOWN:-bench_runtime.md}
+WORK_DIR=$(mktemp -d)
+trap "rm -rf $WORK_DIR" EXIT
+
+function binary_of {
+  case $2 in
+    o0) echo $1.o0.bin ;;
+    default) echo $1.bin ;;
+    old) echo $1.old.bin ;;
+    host_o0) echo $1.host.bin ;;
+    host_o3) echo $1.host_o3.bin ;;
+    *) echo "unknown variant $2" >&2; exit 1 ;;
+  esac
+}
+
+function median {
+  # Prints the median of the values on stdin, or null if any is null
+  sort -g | awk '
+    $1 == "null" { has_null = 1 }
+    { v[NR] = $1 }
+    END {
+      if (has_null || NR == 0) { print "null"; exit }
+      m = (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2;
+      print m;
+    }'
+}
+
+make bench_runner.host.bin >/dev/null
+
+num_of_failures=0
+first_program=1
+echo "{"
+echo "  \"repeat\": $REPEAT,"
+echo "  \"programs\": {"
+{
+  echo "| program | variant | seconds | instructions | cycles |" \
+    "branch misses | vs host_o0 | output |"
+  echo "|---|---|---:|---:|---:|---:|---:|---|"
+} > $MARKDOWN
+for program in $PROGRAMS; do
+  if ! make $program.c > /dev/null 2>&1; then
+    echo "$program: skipped, $program.c is not available" >&2
+    continue
+  fi
+  [ $first_program ] || echo ","
+  first_program=
+  echo "    \"$program\": {"
+  reference=
+  reference_seconds=
+  first_variant=1
+  # host_o0 runs first as the reference of the output and the time
+  for variant in $(echo $VARIANTS | tr ' ' '\n' | grep -x host_o0) \
+    $(echo $VARIANTS | tr ' ' '\n' | grep -vx host_o0); do
+    [ $first_variant ] || echo ","
+    first_variant=
+    binary=$(binary_of $program $variant)
+    printf "      \"$variant\": "
+    if ! make $binary > $WORK_DIR/build.log 2>&1; then
+      echo "$program $variant: build failed: $(grep -a 'Error' \
+        $WORK_DIR/build.log | head -n 1)" >&2
+      printf "{\"status\": \"build_failed\"}"
+      echo "| $program | $variant | | | | | | build failed |" >> $MARKDOWN
+      continue
+    fi
+    rm -f $WORK_DIR/results
+    for ((i = 0; i < REPEAT; i++)); do
+      ./bench_runner.host.bin $WORK_DIR/$variant.stdout ./$binary \
+        >> $WORK_DIR/results
+    done
+    seconds=$(awk '{ print $1 }' $WORK_DIR/results | median)
+    instructions=$(awk '{ print $2 }' $WORK_DIR/results | median)
+    cycles=$(awk '{ print $3 }' $WORK_DIR/results | median)
+    branch_misses=$(awk '{ print $4 }' $WORK_DIR/results | median)
+    [ $variant = host_o0 ] && reference_seconds=$seconds
+    [ "$reference" ] || reference=$WORK_DIR/$variant.stdout
+    if cmp -s $reference $WORK_DIR/$variant.stdout; then
+      status=ok
+    else
+      status=output_mismatch
+      num_of_failures=$((num_of_failures + 1))
+      echo "$program $variant: stdout differs from $(basename \
+        $reference .stdout)" >&2
+    fi
+    echo "$program $variant: ${seconds}s" >&2
+    printf "{\"status\": \"$status\", \"seconds\": $seconds, "
+    printf "\"instructions\": $instructions, \"cycles\": $cycles, "
+    printf "\"branch_misses\": $branch_misses}"
+    awk -v p=$program -v v=$variant -v s=$seconds -v i=$instructions \
+      -v c=$cycles -v b=$branch_misses -v r="$reference_seconds" \
+      -v st=$status 'BEGIN {
+      printf "| %s | %s | %.3f | %s | %s | %s | %s | %s |\n", p, v, s,
+        (i == "null") ? "-" : i, (c == "null") ? "-" : c,
+        (b == "null") ? "-" : b, (r > 0) ? sprintf("%.2fx", s / r) : "", st;
+    }' >> $MARKDOWN
+  done
+  echo
+  printf "    }"
+done
+echo
+echo "  },"
+echo "  \"num_of_failures\": $num_of_failures"
+echo "}"
+[ $num_of_failures = 0 ]
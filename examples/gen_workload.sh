@@ -0,0 +1,66 @@
+#!/bin/bash -e
+# Usage: gen_workload.sh KIND N
+# Writes main.c (and the headers it includes) into the current directory.
+# Each KIND scales one dimension of the input with N:
+#   functions: N functions, each of which calls the previous one
+#   globals:   N global variables, each of which is assigned in main
+#   locals:    N local variables, each of which refers to the previous one
+#   expr:      an expression nested N deep
+#   macros:    a header with N macros, each of which is used in main
+#   includes:  N headers, each of which includes the next one
+#   members:   a struct with N members, each of which is assigned in main
+KIND=$1
+N=$2
+case $KIND in
+  functions)
+    awk -v n=$N 'BEGIN {
+      print "int f0(int x) { return x; }";
+      for (i = 1; i < n; i++) printf "int f%d(int x) { return f%d(x) + 1; }\n", i, i - 1;
+      printf "int main() { return f%d(0) - %d; }\n", n - 1, n - 1;
+    }' > main.c ;;
+  globals)
+    awk -v n=$N 'BEGIN {
+      for (i = 0; i < n; i++) printf "int g%d;\n", i;
+      print "int main() {";
+      for (i = 0; i < n; i++) printf "  g%d = %d;\n", i, i % 100;
+      print "  return g0;\n}";
+    }' > main.c ;;
+  locals)
+    awk -v n=$N 'BEGIN {
+      print "int main() {\n  int v0 = 0;";
+      for (i = 1; i < n; i++) printf "  int v%d = v%d + 1;\n", i, i - 1;
+      printf "  return v%d - %d;\n}\n", n - 1, n - 1;
+    }' > main.c ;;
+  expr)
+    awk -v n=$N 'BEGIN {
+      printf "int main() {\n  int x;\n  x = 1;\n  return (x";
+      for (i = 1; i < n; i++) printf (i % 16) ? " + x" : "\n      + x";
+      printf ") - %d;\n}\n", n;
+    }' > main.c ;;
+  macros)
+    awk -v n=$N 'BEGIN {
+      for (i = 0; i < n; i++) printf "#define M%d %d\n", i, i % 100;
+    }' > macros.h
+    awk -v n=$N 'BEGIN {
+      print "#include \"macros.h\"\nint main() {\n  int x = 0;";
+      for (i = 0; i < n; i++) printf "  x = M%d;\n", i;
+      print "  return x;\n}";
+    }' > main.c ;;
+  includes)
+    for ((i = 0; i < N; i++)); do
+      echo "int h$i(void);" > inc_$i.h
+      if ((i + 1 < N)); then echo "#include \"inc_$((i + 1)).h\"" >> inc_$i.h; fi
+    done
+    printf '#include "inc_0.h"\nint main() { return 0; }\n' > main.c ;;
+  members)
+    awk -v n=$N 'BEGIN {
+      print "struct S {";
+      for (i = 0; i < n; i++) printf "  int m%d;\n", i;
+      print "};\nint main() {\n  struct S s;";
+      for (i = 0; i < n; i++) printf "  s.m%d = %d;\n", i, i % 100;
+      print "  return s.m0;\n}";
+    }' > main.c ;;
+  *)
+    echo "Unknown kind: $KIND" >&2
+    exit 1 ;;
+esac
@@ -0,0 +1,35 @@
+#!/bin/bash -e
+# Compiles left-associative expressions with N operands under a small stack.
+# Each pass of the compiler walks such trees with an explicit stack, so both
+# compile time per operand and stack usage should stay flat as N grows.
+# The chains of the short-circuit operators and the comma operator are
+# measured as well as the arithmetic ones.
+STACK_KB=${STACK_KB:-1024}
+SIZES=${SIZES:-"1000 10000 100000"}
+OPS=${OPS:-"+ && || ,"}
+make -C .. compilium >/dev/null 2>&1
+for op in $OPS; do
+  case $op in
+    +) name=add; value='n' ;;
+    '&&') name=and; value=1 ;;
+    '||') name=or; value=1 ;;
+    ,) name=comma; value=1 ;;
+  esac
+  for n in $SIZES; do
+    base=deep_expr_${name}_$n
+    awk -v n=$n -v op="$op" -v value=$value 'BEGIN {
+      printf "int main() {\n  int x;\n  x = 1;\n  return (x";
+      for (i = 1; i < n; i++) printf (i % 16) ? " %s x" : "\n      %s x", op;
+      printf ") - %d;\n}\n", value == "n" ? n : value;
+    }' > $base.c
+    echo "compiling $base.c with ${STACK_KB}KB stack..."
+    ( ulimit -s $STACK_KB; time ../compilium --target-os `uname` \
+      < $base.c > $base.S 2>/dev/null ) 2> $base.time \
+      || { echo "compilation of $base.c failed"; exit 1; }
+    grep real $base.time
+    $CC -o $base.bin $base.S
+    ./$base.bin || { echo "$base.bin returned $?"; exit 1; }
+  done
+done
+rm -f deep_expr_*.c deep_expr_*.S deep_expr_*.bin deep_expr_*.time
+echo "OK"
@@ -1,41 +1,89 @@
 #include "compilium.h"
 
+static void GenerateForNode(struct Node *node);
 static void GenerateForNodeRValue(struct Node *node);
 
-static struct Node *str_list;
-static int label_to_break;
-static int label_to_continue;
+static void Emit(const char *fmt, ...) {
+  // Text outside the functions. Instructions are emitted with EmitInst.
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(compiler->output, fmt, ap);
+  va_end(ap);
+}
+
+static struct MachineInst *EmitInst(const char *opcode, int num_of_operands,
+                                    ...) {
+  // The operands are struct MachineOperand
+  assert(num_of_operands <= MAX_MACHINE_OPERANDS);
+  struct MachineInst *inst = AppendMachineInst(kMachineInst, opcode);
+  va_list ap;
+  va_start(ap, num_of_operands);
+  for (int i = 0; i < num_of_operands; i++) {
+    inst->operands[i] = va_arg(ap, struct MachineOperand);
+  }
+  va_end(ap);
+  inst->num_of_operands = num_of_operands;
+  return inst;
+}
+
+static void EmitLabel(int label) {
+  AppendMachineInst(kMachineLabel, NULL)->operands[0] = LabelOperand(label);
+}
+
+static const char *CreateSymbol(struct Node *name_token) {
+  const char *prefix = compiler->symbol_prefix;
+  int size = strlen(prefix) + name_token->length + 1;
+  char *symbol = AllocMemory(size);
+  snprintf(symbol, size, "%s%.*s", prefix, name_token->length,
+           name_token->begin);
+  return symbol;
+}
+
+static void EmitGlobal(const char *symbol) {
+  struct MachineInst *inst = AppendMachineInst(kMachineDirective, ".global");
+  inst->operands[0] = SymbolOperand(symbol);
+  inst->num_of_operands = 1;
+}
+
+static void FlushMachineInsts(void) {
+  // Prints the instructions emitted so far
+  PrintMachineInsts(compiler->output, compiler->machine_insts,
+                    compiler->num_of_machine_insts,
+                    compiler->should_print_legacy_asm_text);
+  ClearMachineInsts();
+}
+
+static struct MachineOperand Reg64(int reg) { return RegOperand(reg, 8); }
+static struct MachineOperand Reg32(int reg) { return RegOperand(reg, 4); }
+static struct MachineOperand Reg8(int reg) { return RegOperand(reg, 1); }
 
 static int GetLabelNumber() {
-  static int label_number;
-  return ++label_number;
+  int n = ++compiler->label_number;
+  return compiler->use_local_labels ? -n : n;
 }
 
 static void EmitConvertToBool(int dst, int src) {
   // This code also sets zero flag as boolean value
-  printf("cmp %s, 0\n", reg_names_64[src]);
-  printf("setnz %s\n", reg_names_8[src]);
-  printf("movzx %s, %s\n", reg_names_64[dst], reg_names_8[src]);
+  EmitInst("cmp", 2, Reg64(src), ImmOperand(0));
+  EmitInst("setnz", 1, Reg8(src));
+  EmitInst("movzx", 2, Reg64(dst), Reg8(src));
 }
 
-static void EmitCompareIntegers(int dst, int left, int right, const char *cc) {
-  printf("cmp %s, %s\n", reg_names_64[left], reg_names_64[right]);
-  printf("set%s %s\n", cc, reg_names_8[dst]);
-  printf("movzx %s, %s\n", reg_names_64[dst], reg_names_8[dst]);
+static void EmitCompareIntegers(int dst, int left, int right,
+                                const char *setcc) {
+  EmitInst("cmp", 2, Reg64(left), Reg64(right));
+  EmitInst(setcc, 1, Reg8(dst));
+  EmitInst("movzx", 2, Reg64(dst), Reg8(dst));
 }
 
 static void EmitMoveToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 8) {
-    printf("mov [%s], %s\n", reg_names_64[dst], reg_names_64[src]);
+  if (size == 8 || size == 1) {
+    EmitInst("mov", 2, MemOperand(0, dst), RegOperand(src, size));
     return;
   }
   if (size == 4) {
-    printf("mov [%s], %s # 4 byte store\n", reg_names_64[dst],
-           reg_names_32[src]);
-    return;
-  }
-  if (size == 1) {
-    printf("mov [%s], %s\n", reg_names_64[dst], reg_names_8[src]);
+    EmitInst("mov", 2, MemOperand(0, dst), Reg32(src))->comment =
+        "4 byte store";
     return;
   }
   ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
@@ -43,147 +91,241 @@ static void EmitMoveToMemory(struct Node *op, int dst, int src, int size) {
 
 static void EmitMoveFromMemory(struct Node *op, int dst, int src, int size) {
   if (size == 8) {
-    printf("mov %s, [%s]\n", reg_names_64[dst], reg_names_64[src]);
+    EmitInst("mov", 2, Reg64(dst), MemOperand(0, src));
     return;
   }
   if (size == 4) {
-    printf("movsxd %s, dword ptr [%s]\n", reg_names_64[dst], reg_names_64[src]);
+    EmitInst("movsxd", 2, Reg64(dst), MemOperand(4, src));
     return;
   }
   if (size == 1) {
-    printf("movsxb %s, byte ptr [%s]\n", reg_names_64[dst], reg_names_64[src]);
+    EmitInst("movsxb", 2, Reg64(dst), MemOperand(1, src));
     return;
   }
   ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
 }
 
-static void EmitAddToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 8) {
-    printf("add qword ptr [%s], %s\n", reg_names_64[dst], reg_names_64[src]);
-    return;
-  }
-  if (size == 4) {
-    printf("add dword ptr [%s], %s\n", reg_names_64[dst], reg_names_32[src]);
-    return;
-  }
-  if (size == 1) {
-    printf("add byte ptr [%s], %s\n", reg_names_64[dst], reg_names_8[src]);
+static void EmitOpToMemory(struct Node *op, const char *opcode, int dst,
+                           int src, int size) {
+  // opcode <size> ptr [dst], src
+  if (size == 8 || size == 4 || size == 1) {
+    EmitInst(opcode, 2, MemOperand(size, dst), RegOperand(src, size));
     return;
   }
   ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
 }
 
-static void EmitSubFromMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 8) {
-    printf("sub qword ptr [%s], %s\n", reg_names_64[dst], reg_names_64[src]);
-    return;
-  }
-  if (size == 4) {
-    printf("sub dword ptr [%s], %s\n", reg_names_64[dst], reg_names_32[src]);
-    return;
-  }
-  if (size == 1) {
-    printf("sub byte ptr [%s], %s\n", reg_names_64[dst], reg_names_8[src]);
+static void EmitOpMemory(struct Node *op, const char *opcode, int dst,
+                         int size) {
+  // opcode <size> ptr [dst]
+  if (size == 8 || size == 4 || size == 1) {
+    EmitInst(opcode, 1, MemOperand(size, dst));
     return;
   }
   ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
 }
 
-static void EmitDecMemory(struct Node *op, int dst, int size) {
-  if (size == 8) {
-    printf("dec qword ptr [%s]\n", reg_names_64[dst]);
-    return;
-  }
+static void EmitMulToMemory(struct Node *op, int dst, int src, int size) {
   if (size == 4) {
-    printf("dec dword ptr [%s]\n", reg_names_64[dst]);
-    return;
-  }
-  if (size == 1) {
-    printf("dec byte ptr [%s]\n", reg_names_64[dst]);
+    // rdx:rax <- rax * r/m
+    EmitInst("xor", 2, FixedRegOperand("rdx"), FixedRegOperand("rdx"));
+    EmitInst("mov", 2, FixedRegOperand("rax"), Reg64(dst));
+    EmitInst("mov", 2, FixedRegOperand("eax"), FixedMemOperand(0, "rax", 0));
+    EmitInst("imul", 1, Reg64(src));
+    EmitInst("mov", 2, MemOperand(0, dst), FixedRegOperand("eax"));
     return;
   }
   ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
 }
 
-static void EmitIncMemory(struct Node *op, int dst, int size) {
-  if (size == 8) {
-    printf("inc qword ptr [%s]\n", reg_names_64[dst]);
-    return;
-  }
+static void EmitDivToMemory(struct Node *op, int dst, int src, int size,
+                            const char *result_reg) {
+  // result_reg: eax for the quotient, edx for the remainder
   if (size == 4) {
-    printf("inc dword ptr [%s]\n", reg_names_64[dst]);
-    return;
-  }
-  if (size == 1) {
-    printf("inc byte ptr [%s]\n", reg_names_64[dst]);
+    // rax <- rdx:rax / r/m, rdx <- rdx:rax % r/m
+    EmitInst("xor", 2, FixedRegOperand("rdx"), FixedRegOperand("rdx"));
+    EmitInst("mov", 2, FixedRegOperand("eax"), MemOperand(0, dst));
+    EmitInst("idiv", 1, Reg64(src));
+    EmitInst("mov", 2, MemOperand(0, dst), FixedRegOperand(result_reg));
     return;
   }
   ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
 }
 
-static void EmitMulToMemory(struct Node *op, int dst, int src, int size) {
+static void EmitShiftMemory(struct Node *op, const char *opcode, int dst,
+                            int src, int size) {
   if (size == 4) {
-    // rdx:rax <- rax * r/m
-    printf("xor rdx, rdx\n");
-    printf("mov rax, %s\n", reg_names_64[dst]);
-    printf("mov eax, [rax]\n");
-    printf("imul %s\n", reg_names_64[src]);
-    printf("mov [%s], eax\n", reg_names_64[dst]);
+    EmitInst("mov", 2, FixedRegOperand("ecx"), Reg32(src));
+    EmitInst(opcode, 2, MemOperand(4, dst), FixedRegOperand("cl"));
     return;
   }
   ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
 }
 
-static void EmitDivToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    // rax <- rdx:rax / r/m
-    printf("xor rdx, rdx\n");
-    printf("mov eax, [%s]\n", reg_names_64[dst]);
-    printf("idiv %s\n", reg_names_64[src]);
-    printf("mov [%s], eax\n", reg_names_64[dst]);
-    return;
+const char *GetParamRegName(struct Node *type, int idx) {
+  assert(0 <= idx && idx < NUM_OF_PARAM_REGISTERS);
+  int size = GetSizeOfType(type);
+  if (size == 8) return param_reg_names_64[idx];
+  if (size == 4) return param_reg_names_32[idx];
+  if (size == 1) return param_reg_names_8[idx];
+  ErrorWithToken(GetIdentifierTokenFromTypeAttr(type),
+                 "Assigning %d bytes is not implemented.", size);
+}
+
+static const char *bin_ops_on_chain[] = {
+    "+", "-", "*", "/", "%", "<<", ">>", "<", ">", "<=", ">=", "==", "!=",
+    "&", "^", "|", "&&", "||", ",", NULL};
+
+static int IsBinOpOnChain(struct Node *n) {
+  if (n->type != kASTExpr || !n->op || !n->left || !n->right || n->cond) {
+    return 0;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  for (int i = 0; bin_ops_on_chain[i]; i++) {
+    if (IsEqualTokenWithCStr(n->op, bin_ops_on_chain[i])) return 1;
+  }
+  return 0;
 }
 
-static void EmitModToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
+// Emits a binary operator whose operands are already evaluated
+// into node->reg and node->right->reg
+static void EmitBinOp(struct Node *node) {
+  if (IsEqualTokenWithCStr(node->op, "+")) {
+    struct Node *left_expr_type = GetRValueType(node->left->expr_type);
+    if (IsPointerType(left_expr_type)) {
+      // some_pointer + something
+      int scale = GetScaleOfPointerType(left_expr_type);
+      if (compiler->is_verbose) fprintf(stderr, "scale = %d\n", scale);
+      assert(scale == 1 || scale == 4);
+      EmitInst("lea", 2, Reg64(node->reg),
+               IndexedMemOperand(node->reg, scale, node->right->reg));
+
+      return;
+    }
+    EmitInst("add", 2, Reg64(node->reg), Reg64(node->right->reg));
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "-")) {
+    EmitInst("sub", 2, Reg64(node->reg), Reg64(node->right->reg));
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "*")) {
+    // rdx:rax <- rax * r/m
+    EmitInst("xor", 2, FixedRegOperand("rdx"), FixedRegOperand("rdx"));
+    EmitInst("mov", 2, FixedRegOperand("rax"), Reg64(node->reg));
+    EmitInst("imul", 1, Reg64(node->right->reg));
+    EmitInst("mov", 2, Reg64(node->reg), FixedRegOperand("rax"));
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "/")) {
+    // rax <- rdx:rax / r/m
+    EmitInst("xor", 2, FixedRegOperand("rdx"), FixedRegOperand("rdx"));
+    EmitInst("mov", 2, FixedRegOperand("rax"), Reg64(node->reg));
+    EmitInst("idiv", 1, Reg64(node->right->reg));
+    EmitInst("mov", 2, Reg64(node->reg), FixedRegOperand("rax"));
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "%")) {
     // rdx <- rdx:rax % r/m
-    printf("xor rdx, rdx\n");
-    printf("mov eax, [%s]\n", reg_names_64[dst]);
-    printf("idiv %s\n", reg_names_64[src]);
-    printf("mov [%s], edx\n", reg_names_64[dst]);
+    EmitInst("xor", 2, FixedRegOperand("rdx"), FixedRegOperand("rdx"));
+    EmitInst("mov", 2, FixedRegOperand("rax"), Reg64(node->reg));
+    EmitInst("idiv", 1, Reg64(node->right->reg));
+    EmitInst("mov", 2, Reg64(node->reg), FixedRegOperand("rdx"));
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "<<")) {
+    // r/m <<= CL
+    EmitInst("mov", 2, FixedRegOperand("rcx"), Reg64(node->right->reg));
+    EmitInst("sal", 2, Reg64(node->reg), FixedRegOperand("cl"));
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, ">>")) {
+    // r/m >>= CL
+    EmitInst("mov", 2, FixedRegOperand("rcx"), Reg64(node->right->reg));
+    EmitInst("sar", 2, Reg64(node->reg), FixedRegOperand("cl"));
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "<")) {
+    EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "setl");
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, ">")) {
+    EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "setg");
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "<=")) {
+    EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "setle");
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, ">=")) {
+    EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "setge");
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "==")) {
+    EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "sete");
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "!=")) {
+    EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "setne");
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "&")) {
+    EmitInst("and", 2, Reg64(node->reg), Reg64(node->right->reg));
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "^")) {
+    EmitInst("xor", 2, Reg64(node->reg), Reg64(node->right->reg));
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, "|")) {
+    EmitInst("or", 2, Reg64(node->reg), Reg64(node->right->reg));
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, ",")) {
+    // The value is the right one, which is in node->reg
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  ErrorWithToken(node->op, "GenerateForNode: Not implemented");
 }
 
-static void EmitLShiftMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    printf("mov ecx, %s\n", reg_names_32[src]);
-    printf("shl dword ptr [%s], cl\n", reg_names_64[dst]);
-    return;
-  }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+// Emits && or || whose left operand is already evaluated into
+// node->left->reg, together with the evaluation of the right operand
+static void GenerateForLogicalOp(struct Node *node) {
+  int skip_label = GetLabelNumber();
+  EmitConvertToBool(node->reg, node->left->reg);
+  EmitInst(IsEqualTokenWithCStr(node->op, "&&") ? "jz" : "jnz", 1,
+           LabelOperand(skip_label));
+  GenerateForNodeRValue(node->right);
+  EmitConvertToBool(node->reg, node->right->reg);
+  EmitLabel(skip_label);
 }
 
-static void EmitRShiftMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    printf("mov ecx, %s\n", reg_names_32[src]);
-    printf("shr dword ptr [%s], cl\n", reg_names_64[dst]);
-    return;
+// Emits a left-deep chain of binary operators such as a + b + c + ...
+// from left to right without recursion
+static void GenerateForBinOpChain(struct Node *node) {
+  struct Node *chain = AllocList();
+  for (struct Node *n = node; IsBinOpOnChain(n); n = n->left) {
+    PushToList(chain, n);
+  }
+  int size = GetSizeOfList(chain);
+  struct Node *first = GetNodeAt(chain, size - 1);
+  if (IsEqualTokenWithCStr(first->op, ",")) {
+    // The value of the left operand of , is not used
+    GenerateForNode(first->left);
+  } else {
+    GenerateForNodeRValue(first->left);
+  }
+  for (int i = size - 1; i >= 0; i--) {
+    struct Node *n = GetNodeAt(chain, i);
+    if (IsEqualTokenWithCStr(n->op, "&&") ||
+        IsEqualTokenWithCStr(n->op, "||")) {
+      GenerateForLogicalOp(n);
+      continue;
+    }
+    GenerateForNodeRValue(n->right);
+    EmitBinOp(n);
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
 }
 
-const char *GetParamRegName(struct Node *type, int idx) {
-  assert(0 <= idx && idx < NUM_OF_PARAM_REGISTERS);
-  int size = GetSizeOfType(type);
-  if (size == 8) return param_reg_names_64[idx];
-  if (size == 4) return param_reg_names_32[idx];
-  if (size == 1) return param_reg_names_8[idx];
-  ErrorWithToken(GetIdentifierTokenFromTypeAttr(type),
-                 "Assigning %d bytes is not implemented.", size);
+static bool IsLabelBoundaryChar(char c) {
+  return !(('0' <= c && c <= '9') || ('A' <= c && c <= 'Z') ||
+           ('a' <= c && c <= 'z') || c == '_');
+}
+
+static void BeginFunctionStats(void) {
+  memset(&compiler->function_stats, 0, sizeof(struct FunctionStats));
+}
+
+static void EndFunctionStats(struct Node *func_def) {
+  // The instructions are counted by the built-in assembler before printing
+  struct FunctionStats *stats = &compiler->function_stats;
+  stats->frame_size = func_def->stack_size_needed;
+  if (!compiler->should_print_stats) return;
+  CountMachineInsts(compiler->machine_insts, compiler->num_of_machine_insts,
+                    stats);
 }
 
 static void GenerateForNode(struct Node *node) {
@@ -194,49 +336,55 @@ static void GenerateForNode(struct Node *node) {
     return;
   }
   if (node->type == kASTExprFuncCall) {
-    printf("sub rsp, %d # alloc stack frame\n", node->stack_size_needed);
     int i;
     for (i = 1; i <= NUM_OF_SCRATCH_REGS; i++) {
-      printf("push %s # save scratch regs\n", reg_names_64[i]);
+      EmitInst("push", 1, Reg64(i))->comment = "save scratch regs";
     }
+    compiler->function_stats.num_of_spills += NUM_OF_SCRATCH_REGS;
     GenerateForNodeRValue(node->func_expr);
-    printf("push %s\n", reg_names_64[node->func_expr->reg]);
+    EmitInst("push", 1, Reg64(node->func_expr->reg));
     assert(GetSizeOfList(node->arg_expr_list) <= NUM_OF_PARAM_REGISTERS);
     for (i = 0; i < GetSizeOfList(node->arg_expr_list); i++) {
       struct Node *n = GetNodeAt(node->arg_expr_list, i);
       GenerateForNodeRValue(n);
-      printf("push %s\n", reg_names_64[n->reg]);
+      EmitInst("push", 1, Reg64(n->reg));
     }
     for (i--; i >= 0; i--) {
-      printf("pop %s\n", param_reg_names_64[i]);
+      EmitInst("pop", 1, FixedRegOperand(param_reg_names_64[i]));
     }
-    printf("pop rax\n");
-    printf("call rax\n");
+    EmitInst("pop", 1, FixedRegOperand("rax"));
+    EmitInst("call", 1, FixedRegOperand("rax"));
     for (i = NUM_OF_SCRATCH_REGS; i >= 1; i--) {
-      printf("pop %s # restore scratch regs\n", reg_names_64[i]);
+      EmitInst("pop", 1, Reg64(i))->comment = "restore scratch regs";
     }
     int ret_type_size = GetSizeOfType(node->expr_type);
     if (ret_type_size == 4) {
-      printf("movsxd %s, eax\n", reg_names_64[node->reg]);
+      EmitInst("movsxd", 2, Reg64(node->reg), FixedRegOperand("eax"));
     } else if (ret_type_size == 8) {
-      printf("mov %s, rax\n", reg_names_64[node->reg]);
+      EmitInst("mov", 2, Reg64(node->reg), FixedRegOperand("rax"));
     } else if (ret_type_size == 0) {
       // Return type is "void". Do nothing.
     } else {
       assert(false);
     }
-    printf("add rsp, %d # restore stack frame\n", node->stack_size_needed);
     return;
   } else if (node->type == kASTFuncDef) {
-    const char *func_name = CreateTokenStr(node->func_name_token);
-    printf(".global %s%s\n", symbol_prefix, func_name);
-    printf("%s%s:\n", symbol_prefix, func_name);
-    printf("push rbp\n");
-    printf("mov rbp, rsp\n");
-    printf("push r12\n");
-    printf("push r13\n");
-    printf("push r14\n");
-    printf("push r15\n");
+    const char *func_symbol = CreateSymbol(node->func_name_token);
+    BeginFunctionStats();
+    EmitGlobal(func_symbol);
+    AppendMachineInst(kMachineLabel, NULL)->operands[0] =
+        SymbolOperand(func_symbol);
+    EmitInst("push", 1, FixedRegOperand("rbp"));
+    EmitInst("mov", 2, FixedRegOperand("rbp"), FixedRegOperand("rsp"));
+    EmitInst("push", 1, FixedRegOperand("r12"));
+    EmitInst("push", 1, FixedRegOperand("r13"));
+    EmitInst("push", 1, FixedRegOperand("r14"));
+    EmitInst("push", 1, FixedRegOperand("r15"));
+    if (node->stack_size_needed) {
+      EmitInst("sub", 2, FixedRegOperand("rsp"),
+               ImmOperand(node->stack_size_needed))
+          ->comment = "alloc stack frame";
+    }
     struct Node *arg_var_list = node->arg_var_list;
     assert(arg_var_list);
     assert(GetSizeOfList(arg_var_list) <= NUM_OF_PARAM_REGISTERS);
@@ -244,37 +392,49 @@ static void GenerateForNode(struct Node *node) {
       struct Node *arg_var = GetNodeAt(arg_var_list, i);
       if (!arg_var) continue;
       const char *param_reg_name = GetParamRegName(arg_var->expr_type, i);
-      printf("mov [rbp - %d], %s // arg[%d]\n", arg_var->byte_offset,
-             param_reg_name, i);
+      struct MachineInst *inst =
+          EmitInst("mov", 2, FixedMemOperand(0, "rbp", -arg_var->byte_offset),
+                   FixedRegOperand(param_reg_name));
+      char comment[16];
+      snprintf(comment, sizeof(comment), "arg[%d]", i);
+      inst->comment = AllocString(comment, strlen(comment));
+      inst->is_legacy_slash_comment = true;
     }
     GenerateForNode(node->func_body);
-    printf("pop r15\n");
-    printf("pop r14\n");
-    printf("pop r13\n");
-    printf("pop r12\n");
-    printf("mov rsp, rbp\n");
-    printf("pop rbp\n");
-    printf("ret\n");
+    if (node->stack_size_needed) {
+      EmitInst("add", 2, FixedRegOperand("rsp"),
+               ImmOperand(node->stack_size_needed))
+          ->comment = "free stack frame";
+    }
+    EmitInst("pop", 1, FixedRegOperand("r15"));
+    EmitInst("pop", 1, FixedRegOperand("r14"));
+    EmitInst("pop", 1, FixedRegOperand("r13"));
+    EmitInst("pop", 1, FixedRegOperand("r12"));
+    EmitInst("mov", 2, FixedRegOperand("rsp"), FixedRegOperand("rbp"));
+    EmitInst("pop", 1, FixedRegOperand("rbp"));
+    EmitInst("ret", 0);
+    EndFunctionStats(node);
+    FlushMachineInsts();
     return;
   }
   assert(node && node->op);
   if (node->type == kASTExpr) {
     if (IsTokenWithType(node->op, kTokenIntegerConstant)) {
-      printf("mov %s, %ld\n", reg_names_64[node->reg],
-             strtol(node->op->begin, NULL, 0));
+      EmitInst("mov", 2, Reg64(node->reg),
+               ImmOperand(strtol(node->op->begin, NULL, 0)));
       return;
     } else if (IsTokenWithType(node->op, kTokenCharLiteral)) {
       if (node->op->length == (1 + 1 + 1)) {
-        printf("mov %s, %d\n", reg_names_64[node->reg], node->op->begin[1]);
+        EmitInst("mov", 2, Reg64(node->reg), ImmOperand(node->op->begin[1]));
         return;
       }
       if (node->op->length == (1 + 2 + 1) && node->op->begin[1] == '\\') {
         if (node->op->begin[2] == 'n') {
-          printf("mov %s, %d\n", reg_names_64[node->reg], '\n');
+          EmitInst("mov", 2, Reg64(node->reg), ImmOperand('\n'));
           return;
         }
         if (node->op->begin[2] == '\\') {
-          printf("mov %s, %d\n", reg_names_64[node->reg], '\\');
+          EmitInst("mov", 2, Reg64(node->reg), ImmOperand('\\'));
           return;
         }
       }
@@ -284,70 +444,71 @@ static void GenerateForNode(struct Node *node) {
       return;
     } else if (IsEqualTokenWithCStr(node->op, ".")) {
       GenerateForNodeRValue(node->left);
-      printf("add %s, %d # struct member ofs\n", reg_names_64[node->reg],
-             node->byte_offset);
+      EmitInst("add", 2, Reg64(node->reg), ImmOperand(node->byte_offset))
+          ->comment = "struct member ofs";
       return;
     } else if (IsEqualTokenWithCStr(node->op, "->")) {
       GenerateForNodeRValue(node->left);
-      printf("add %s, %d # struct member ofs\n", reg_names_64[node->reg],
-             node->byte_offset);
+      EmitInst("add", 2, Reg64(node->reg), ImmOperand(node->byte_offset))
+          ->comment = "struct member ofs";
       return;
     } else if (IsEqualTokenWithCStr(node->op, "[")) {
       GenerateForNodeRValue(node->left);
       GenerateForNodeRValue(node->right);
       int elem_size = GetSizeOfType(node->expr_type);
-      printf("imul %s, %s, %d\n", reg_names_64[node->right->reg],
-             reg_names_64[node->right->reg], elem_size);
-      printf("add %s, %s\n", reg_names_64[node->left->reg],
-             reg_names_64[node->right->reg]);
+      EmitInst("imul", 3, Reg64(node->right->reg), Reg64(node->right->reg),
+               ImmOperand(elem_size));
+      EmitInst("add", 2, Reg64(node->left->reg), Reg64(node->right->reg));
       return;
     } else if (IsTokenWithType(node->op, kTokenIdent)) {
       if (node->expr_type->type == kTypeFunction) {
-        const char *label_name = CreateTokenStr(node->op);
-        printf(".global %s%s\n", symbol_prefix, label_name);
-        printf("mov %s, [rip + %s%s@GOTPCREL]\n", reg_names_64[node->reg],
-               symbol_prefix, label_name);
+        const char *symbol = CreateSymbol(node->op);
+        EmitGlobal(symbol);
+        EmitInst("mov", 2, Reg64(node->reg), GOTEntryOperand(symbol));
         return;
       }
       if (!node->byte_offset) {
         // global var
-        const char *label_name = CreateTokenStr(node->op);
-        printf(".global %s%s\n", symbol_prefix, label_name);
-        printf("mov %s, [rip + %s%s@GOTPCREL]\n", reg_names_64[node->reg],
-               symbol_prefix, label_name);
+        const char *symbol = CreateSymbol(node->op);
+        EmitGlobal(symbol);
+        EmitInst("mov", 2, Reg64(node->reg), GOTEntryOperand(symbol));
         return;
       }
-      printf("lea %s, [rbp - %d]\n", reg_names_64[node->reg],
-             node->byte_offset);
+      EmitInst("lea", 2, Reg64(node->reg),
+               FixedMemOperand(0, "rbp", -node->byte_offset));
       return;
     } else if (IsTokenWithType(node->op, kTokenStringLiteral)) {
       int str_label = GetLabelNumber();
-      printf("lea %s, [rip + L%d]\n", reg_names_64[node->reg], str_label);
-      node->label_number = str_label;
-      PushToList(str_list, node);
+      EmitInst("lea", 2, Reg64(node->reg), LabelAddressOperand(str_label));
+      // The data section is emitted after the AST of this function is
+      // released, so keep only what is needed for it.
+      struct Arena *saved_arena = SwitchArena(compiler->str_list->list_arena);
+      struct Node *str = AllocNode(kASTExpr);
+      SwitchArena(saved_arena);
+      str->op = node->op;
+      str->label_number = str_label;
+      PushToList(compiler->str_list, str);
       return;
     } else if (node->cond) {
       GenerateForNodeRValue(node->cond);
       int false_label = GetLabelNumber();
       int end_label = GetLabelNumber();
       EmitConvertToBool(node->cond->reg, node->cond->reg);
-      printf("jz L%d\n", false_label);
+      EmitInst("jz", 1, LabelOperand(false_label));
       GenerateForNodeRValue(node->left);
-      printf("mov %s, %s\n", reg_names_64[node->reg],
-             reg_names_64[node->left->reg]);
-      printf("jmp L%d\n", end_label);
-      printf("L%d:\n", false_label);
+      EmitInst("mov", 2, Reg64(node->reg), Reg64(node->left->reg));
+      EmitInst("jmp", 1, LabelOperand(end_label));
+      EmitLabel(false_label);
       GenerateForNodeRValue(node->right);
-      printf("mov %s, %s\n", reg_names_64[node->reg],
-             reg_names_64[node->right->reg]);
-      printf("L%d:\n", end_label);
+      EmitInst("mov", 2, Reg64(node->reg), Reg64(node->right->reg));
+      EmitLabel(end_label);
       return;
     } else if (!node->left && node->right) {
       if (IsEqualTokenWithCStr(node->op, "--")) {
         // Prefix --
         int size = GetSizeOfType(node->expr_type);
         GenerateForNode(node->right);
-        EmitDecMemory(node->op, node->reg, GetSizeOfType(node->expr_type));
+        EmitOpMemory(node->op, "dec", node->reg, size);
         EmitMoveFromMemory(node->op, node->reg, node->reg, size);
         return;
       }
@@ -355,13 +516,13 @@ static void GenerateForNode(struct Node *node) {
         // Prefix ++
         int size = GetSizeOfType(node->expr_type);
         GenerateForNode(node->right);
-        EmitIncMemory(node->op, node->reg, GetSizeOfType(node->expr_type));
+        EmitOpMemory(node->op, "inc", node->reg, size);
         EmitMoveFromMemory(node->op, node->reg, node->reg, size);
         return;
       }
       if (IsTokenWithType(node->op, kTokenKwSizeof)) {
-        printf("mov %s, %d\n", reg_names_64[node->reg],
-               GetSizeOfType(node->right->expr_type));
+        EmitInst("mov", 2, Reg64(node->reg),
+                 ImmOperand(GetSizeOfType(node->right->expr_type)));
         return;
       }
       if (IsEqualTokenWithCStr(node->op, "&")) {
@@ -373,16 +534,16 @@ static void GenerateForNode(struct Node *node) {
         return;
       }
       if (IsEqualTokenWithCStr(node->op, "-")) {
-        printf("neg %s\n", reg_names_64[node->reg]);
+        EmitInst("neg", 1, Reg64(node->reg));
         return;
       }
       if (IsEqualTokenWithCStr(node->op, "~")) {
-        printf("not %s\n", reg_names_64[node->reg]);
+        EmitInst("not", 1, Reg64(node->reg));
         return;
       }
       if (IsEqualTokenWithCStr(node->op, "!")) {
         EmitConvertToBool(node->reg, node->reg);
-        printf("setz %s\n", reg_names_8[node->reg]);
+        EmitInst("setz", 1, Reg8(node->reg));
         return;
       }
       if (IsEqualTokenWithCStr(node->op, "*")) {
@@ -395,46 +556,24 @@ static void GenerateForNode(struct Node *node) {
         // Postfix ++
         int size = GetSizeOfType(node->expr_type);
         GenerateForNode(node->left);
-        EmitIncMemory(node->op, node->reg, size);
+        EmitOpMemory(node->op, "inc", node->reg, size);
         EmitMoveFromMemory(node->op, node->reg, node->reg, size);
-        printf("sub %s, 1\n", reg_names_64[node->reg]);
+        EmitInst("sub", 2, Reg64(node->reg), ImmOperand(1));
         return;
       }
       if (IsEqualTokenWithCStr(node->op, "--")) {
         // Postfix --
         int size = GetSizeOfType(node->expr_type);
         GenerateForNode(node->left);
-        EmitDecMemory(node->op, node->reg, GetSizeOfType(node->expr_type));
+        EmitOpMemory(node->op, "dec", node->reg, size);
         EmitMoveFromMemory(node->op, node->reg, node->reg, size);
-        printf("add %s, 1\n", reg_names_64[node->reg]);
+        EmitInst("add", 2, Reg64(node->reg), ImmOperand(1));
         return;
       }
       ErrorWithToken(node->op,
                      "GenerateForNode: Not implemented unary postfix op");
     } else if (node->left && node->right) {
-      if (IsEqualTokenWithCStr(node->op, "&&")) {
-        GenerateForNodeRValue(node->left);
-        int skip_label = GetLabelNumber();
-        EmitConvertToBool(node->reg, node->left->reg);
-        printf("jz L%d\n", skip_label);
-        GenerateForNodeRValue(node->right);
-        EmitConvertToBool(node->reg, node->right->reg);
-        printf("L%d:\n", skip_label);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "||")) {
-        GenerateForNodeRValue(node->left);
-        int skip_label = GetLabelNumber();
-        EmitConvertToBool(node->reg, node->left->reg);
-        printf("jnz L%d\n", skip_label);
-        GenerateForNodeRValue(node->right);
-        EmitConvertToBool(node->reg, node->right->reg);
-        printf("L%d:\n", skip_label);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, ",")) {
-        GenerateForNode(node->left);
-        GenerateForNodeRValue(node->right);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "=") ||
+      if (IsEqualTokenWithCStr(node->op, "=") ||
                  IsEqualTokenWithCStr(node->op, "+=") ||
                  IsEqualTokenWithCStr(node->op, "-=") ||
                  IsEqualTokenWithCStr(node->op, "*=") ||
@@ -450,11 +589,13 @@ static void GenerateForNode(struct Node *node) {
           return;
         }
         if (IsEqualTokenWithCStr(node->op, "+=")) {
-          EmitAddToMemory(node->op, node->left->reg, node->right->reg, size);
+          EmitOpToMemory(node->op, "add", node->left->reg,
+                         node->right->reg, size);
           return;
         }
         if (IsEqualTokenWithCStr(node->op, "-=")) {
-          EmitSubFromMemory(node->op, node->left->reg, node->right->reg, size);
+          EmitOpToMemory(node->op, "sub", node->left->reg,
+                         node->right->reg, size);
           return;
         }
         if (IsEqualTokenWithCStr(node->op, "*=")) {
@@ -462,105 +603,29 @@ static void GenerateForNode(struct Node *node) {
           return;
         }
         if (IsEqualTokenWithCStr(node->op, "/=")) {
-          EmitDivToMemory(node->op, node->left->reg, node->right->reg, size);
+          EmitDivToMemory(node->op, node->left->reg, node->right->reg, size,
+                          "eax");
           return;
         }
         if (IsEqualTokenWithCStr(node->op, "%=")) {
-          EmitModToMemory(node->op, node->left->reg, node->right->reg, size);
+          EmitDivToMemory(node->op, node->left->reg, node->right->reg, size,
+                          "edx");
           return;
         }
         if (IsEqualTokenWithCStr(node->op, "<<=")) {
-          EmitLShiftMemory(node->op, node->left->reg, node->right->reg, size);
+          EmitShiftMemory(node->op, "shl", node->left->reg,
+                          node->right->reg, size);
           return;
         }
         if (IsEqualTokenWithCStr(node->op, ">>=")) {
-          EmitRShiftMemory(node->op, node->left->reg, node->right->reg, size);
+          EmitShiftMemory(node->op, "shr", node->left->reg,
+                          node->right->reg, size);
           return;
         }
         assert(false);
       }
-      GenerateForNodeRValue(node->left);
-      GenerateForNodeRValue(node->right);
-      if (IsEqualTokenWithCStr(node->op, "+")) {
-        struct Node *left_expr_type = GetRValueType(node->left->expr_type);
-        if (IsPointerType(left_expr_type)) {
-          // some_pointer + something
-          int scale = GetScaleOfPointerType(left_expr_type);
-          fprintf(stderr, "scale = %d\n", scale);
-          assert(scale == 1 || scale == 4);
-          printf("lea %s, [%s + %d * %s]\n", reg_names_64[node->reg],
-                 reg_names_64[node->reg], scale,
-                 reg_names_64[node->right->reg]);
-
-          return;
-        }
-        printf("add %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "-")) {
-        printf("sub %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "*")) {
-        // rdx:rax <- rax * r/m
-        printf("xor rdx, rdx\n");
-        printf("mov rax, %s\n", reg_names_64[node->reg]);
-        printf("imul %s\n", reg_names_64[node->right->reg]);
-        printf("mov %s, rax\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "/")) {
-        // rax <- rdx:rax / r/m
-        printf("xor rdx, rdx\n");
-        printf("mov rax, %s\n", reg_names_64[node->reg]);
-        printf("idiv %s\n", reg_names_64[node->right->reg]);
-        printf("mov %s, rax\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "%")) {
-        // rdx <- rdx:rax % r/m
-        printf("xor rdx, rdx\n");
-        printf("mov rax, %s\n", reg_names_64[node->reg]);
-        printf("idiv %s\n", reg_names_64[node->right->reg]);
-        printf("mov %s, rdx\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "<<")) {
-        // r/m <<= CL
-        printf("mov rcx, %s\n", reg_names_64[node->right->reg]);
-        printf("sal %s, cl\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, ">>")) {
-        // r/m >>= CL
-        printf("mov rcx, %s\n", reg_names_64[node->right->reg]);
-        printf("sar %s, cl\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "<")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "l");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, ">")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "g");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "<=")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "le");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, ">=")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "ge");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "==")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "e");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "!=")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "ne");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "&")) {
-        printf("and %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "^")) {
-        printf("xor %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "|")) {
-        printf("or %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
+      if (IsBinOpOnChain(node)) {
+        GenerateForBinOpChain(node);
         return;
       }
     }
@@ -583,27 +648,27 @@ static void GenerateForNode(struct Node *node) {
     return;
   } else if (node->type == kASTJumpStmt) {
     if (IsTokenWithType(node->op, kTokenKwBreak)) {
-      if (!label_to_break) {
+      if (!compiler->label_to_break) {
         ErrorWithToken(node->op, "break is not allowed here");
       }
-      printf("jmp L%d\n", label_to_break);
+      EmitInst("jmp", 1, LabelOperand(compiler->label_to_break));
       return;
     }
     if (IsTokenWithType(node->op, kTokenKwContinue)) {
-      if (!label_to_continue) {
+      if (!compiler->label_to_continue) {
         ErrorWithToken(node->op, "continue is not allowed here");
       }
-      printf("jmp L%d\n", label_to_continue);
+      EmitInst("jmp", 1, LabelOperand(compiler->label_to_continue));
       return;
     }
     if (IsTokenWithType(node->op, kTokenKwReturn)) {
       if (node->right) {
         GenerateForNodeRValue(node->right);
-        printf("mov rax, %s\n", reg_names_64[node->right->reg]);
+        EmitInst("mov", 2, FixedRegOperand("rax"), Reg64(node->right->reg));
       }
-      printf("mov rsp, rbp\n");
-      printf("pop rbp\n");
-      printf("ret\n");
+      EmitInst("mov", 2, FixedRegOperand("rsp"), FixedRegOperand("rbp"));
+      EmitInst("pop", 1, FixedRegOperand("rbp"));
+      EmitInst("ret", 0);
       return;
     }
     ErrorWithToken(node->op, "GenerateForNode: Not implemented jump stmt");
@@ -613,58 +678,58 @@ static void GenerateForNode(struct Node *node) {
       int false_label = GetLabelNumber();
       int end_label = GetLabelNumber();
       EmitConvertToBool(node->cond->reg, node->cond->reg);
-      printf("jz L%d\n", false_label);
+      EmitInst("jz", 1, LabelOperand(false_label));
       GenerateForNodeRValue(node->if_true_stmt);
-      printf("jmp L%d\n", end_label);
-      printf("L%d:\n", false_label);
+      EmitInst("jmp", 1, LabelOperand(end_label));
+      EmitLabel(false_label);
       if (node->if_else_stmt) {
         GenerateForNodeRValue(node->if_else_stmt);
       }
-      printf("L%d:\n", end_label);
+      EmitLabel(end_label);
       return;
     }
     ErrorWithToken(node->op, "GenerateForNode: Not implemented jump stmt");
   } else if (node->type == kASTForStmt) {
     int loop_label = GetLabelNumber();
     int end_label = GetLabelNumber();
-    int old_label_to_break = label_to_break;
-    label_to_break = end_label;
-    int old_label_to_continue = label_to_break;
-    label_to_continue = loop_label;
+    int old_label_to_break = compiler->label_to_break;
+    compiler->label_to_break = end_label;
+    int old_label_to_continue = compiler->label_to_break;
+    compiler->label_to_continue = loop_label;
     if (node->init) {
       GenerateForNode(node->init);
     }
-    printf("L%d:\n", loop_label);
+    EmitLabel(loop_label);
     if (node->cond) {
       GenerateForNodeRValue(node->cond);
       EmitConvertToBool(node->cond->reg, node->cond->reg);
-      printf("jz L%d\n", end_label);
+      EmitInst("jz", 1, LabelOperand(end_label));
     }
     GenerateForNode(node->body);
     if (node->updt) {
       GenerateForNode(node->updt);
     }
-    printf("jmp L%d\n", loop_label);
-    printf("L%d:\n", end_label);
-    label_to_continue = old_label_to_continue;
-    label_to_break = old_label_to_break;
+    EmitInst("jmp", 1, LabelOperand(loop_label));
+    EmitLabel(end_label);
+    compiler->label_to_continue = old_label_to_continue;
+    compiler->label_to_break = old_label_to_break;
     return;
   } else if (node->type == kASTWhileStmt) {
     int loop_label = GetLabelNumber();
     int end_label = GetLabelNumber();
-    int old_label_to_break = label_to_break;
-    label_to_break = end_label;
-    int old_label_to_continue = label_to_break;
-    label_to_continue = loop_label;
-    printf("L%d:\n", loop_label);
+    int old_label_to_break = compiler->label_to_break;
+    compiler->label_to_break = end_label;
+    int old_label_to_continue = compiler->label_to_break;
+    compiler->label_to_continue = loop_label;
+    EmitLabel(loop_label);
     GenerateForNodeRValue(node->cond);
     EmitConvertToBool(node->cond->reg, node->cond->reg);
-    printf("jz L%d\n", end_label);
+    EmitInst("jz", 1, LabelOperand(end_label));
     GenerateForNode(node->body);
-    printf("jmp L%d\n", loop_label);
-    printf("L%d:\n", end_label);
-    label_to_continue = old_label_to_continue;
-    label_to_break = old_label_to_break;
+    EmitInst("jmp", 1, LabelOperand(loop_label));
+    EmitLabel(end_label);
+    compiler->label_to_continue = old_label_to_continue;
+    compiler->label_to_break = old_label_to_break;
     return;
   }
   ErrorWithToken(node->op, "GenerateForNode: Not implemented");
@@ -678,50 +743,100 @@ static void GenerateForNodeRValue(struct Node *node) {
       node->expr_type->right->type == kTypeArray)
     return;
   int size = GetSizeOfType(GetRValueType(node->expr_type));
+  struct MachineOperand src = MemOperand(0, node->reg);
+  src.is_legacy_tight_ptr = true;
   if (size == 8) {
-    printf("mov %s, [%s]\n", reg_names_64[node->reg], reg_names_64[node->reg]);
+    EmitInst("mov", 2, Reg64(node->reg), src);
     return;
   } else if (size == 4) {
-    printf("movsxd %s, dword ptr[%s]\n", reg_names_64[node->reg],
-           reg_names_64[node->reg]);
+    src.size = 4;
+    EmitInst("movsxd", 2, Reg64(node->reg), src);
     return;
   } else if (size == 1) {
-    printf("movsx %s, byte ptr[%s]\n", reg_names_64[node->reg],
-           reg_names_64[node->reg]);
+    src.size = 1;
+    EmitInst("movsx", 2, Reg64(node->reg), src);
     return;
   }
   ErrorWithToken(node->op, "Dereferencing %d bytes is not implemented.", size);
 }
 
 static void GenerateDataSection(struct SymbolEntry *toplevel_names) {
-  printf(".data\n");
-  for (int i = 0; i < GetSizeOfList(str_list); i++) {
-    struct Node *n = GetNodeAt(str_list, i);
-    printf("L%d: ", n->label_number);
-    printf(".asciz ");
-    PrintTokenStrToFile(n->op, stdout);
-    putchar('\n');
+  Emit(".data\n");
+  for (int i = 0; i < GetSizeOfList(compiler->str_list); i++) {
+    struct Node *n = GetNodeAt(compiler->str_list, i);
+    Emit("L%d: ", n->label_number);
+    Emit(".asciz ");
+    PrintTokenStrToFile(n->op, compiler->output);
+    Emit("\n");
   }
   struct SymbolEntry *e = toplevel_names;
   for (; e; e = e->prev) {
     if (e->type != kSymbolGlobalVar) continue;
     int size = GetSizeOfType(e->value);
-    fprintf(stderr, "Global Var: %s = %d bytes\n", e->key, size);
-    printf(".global %s%s\n", symbol_prefix, e->key);
-    printf("%s%s:\n", symbol_prefix, e->key);
-    printf(".byte ");
+    if (compiler->is_verbose) {
+      fprintf(stderr, "Global Var: %s = %d bytes\n", e->key, size);
+    }
+    Emit(".global %s%s\n", compiler->symbol_prefix, e->key);
+    Emit("%s%s:\n", compiler->symbol_prefix, e->key);
+    Emit(".byte ");
     for (int i = 0; i < size; i++) {
-      printf("0%s", i == (size - 1) ? "\n" : ", ");
+      Emit("0%s", i == (size - 1) ? "\n" : ", ");
     }
   }
 }
 
-void Generate(struct Node *ast, struct SymbolEntry *toplevel_names) {
-  label_to_break = 0;
-  label_to_continue = 0;
-  str_list = AllocList();
-  printf(".intel_syntax noprefix\n");
-  printf(".text\n");
-  GenerateForNode(ast);
+void InitGenerator(void) {
+  compiler->label_to_break = 0;
+  compiler->label_to_continue = 0;
+  compiler->str_list = AllocList();
+  ClearMachineInsts();  // left by an error in the previous compilation
+  Emit(".intel_syntax noprefix\n");
+  Emit(".text\n");
+}
+
+void GenerateExternalDecl(struct Node *node) {
+  GenerateForNode(node);
+  FlushMachineInsts();
+}
+
+void MergeFunctionOutput(struct EmittedFunction *f) {
+  // Appends the output of a function generated with local labels (L-1, L-2,
+  // ...) to the output of the translation unit. Local labels are renumbered
+  // after the labels used so far, so the result is the same as the output
+  // generated without local labels.
+  int base = compiler->label_number;
+  const char *buf = f->text;
+  size_t size = f->size;
+  size_t written = 0;
+  for (size_t i = 0; i + 1 < size; i++) {
+    if (buf[i] != 'L' || buf[i + 1] != '-') continue;
+    if (i && !IsLabelBoundaryChar(buf[i - 1])) continue;
+    fwrite(buf + written, 1, i - written, compiler->output);
+    char *end;
+    long n = strtol(buf + i + 2, &end, 10);
+    Emit("L%ld", base + n);
+    written = end - buf;
+    i = written - 1;
+  }
+  fwrite(buf + written, 1, size - written, compiler->output);
+  struct Arena *saved_arena = SwitchArena(compiler->str_list->list_arena);
+  for (int i = 0; i < GetSizeOfList(f->str_list); i++) {
+    struct Node *local = GetNodeAt(f->str_list, i);
+    struct Node *str = AllocNode(kASTExpr);
+    str->op = local->op;
+    str->label_number = base - local->label_number;
+    PushToList(compiler->str_list, str);
+  }
+  SwitchArena(saved_arena);
+  compiler->label_number += f->num_of_labels;
+}
+
+void FinishGenerator(struct SymbolEntry *toplevel_names) {
   GenerateDataSection(toplevel_names);
 }
+
+void Generate(struct Node *ast, struct SymbolEntry *toplevel_names) {
+  InitGenerator();
+  GenerateExternalDecl(ast);
+  FinishGenerator(toplevel_names);
+}
@@ -0,0 +1,6 @@
+#ifdef __APPLE__
+#define RTLD_DEFAULT ((void *)-2)
+#else
+#define RTLD_DEFAULT ((void *)0)
+#endif
+void *dlsym(void *handle, const char *symbol);
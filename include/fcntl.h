@@ -0,0 +1,10 @@
+#define F_SETFD 2
+#define FD_CLOEXEC 1
+int fcntl(int fd, int cmd, ...);
+#define O_RDWR 2
+#ifdef __APPLE__
+#define O_CREAT 0x200
+#else
+#define O_CREAT 0100
+#endif
+int open(const char *path, int flags, ...);
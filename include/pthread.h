@@ -0,0 +1,27 @@
+typedef unsigned long pthread_t;
+typedef struct pthread_attr_t pthread_attr_t;
+typedef struct pthread_mutexattr_t pthread_mutexattr_t;
+typedef union {
+  char size[64];
+  long align;
+} pthread_mutex_t;
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void *), void *arg);
+int pthread_join(pthread_t thread, void **value_ptr);
+int pthread_mutex_init(pthread_mutex_t *mutex,
+                       const pthread_mutexattr_t *attr);
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+#ifdef __APPLE__
+typedef struct {
+  long sig;
+  char opaque[8];
+} pthread_once_t;
+#define PTHREAD_ONCE_INIT \
+  { 0x30B1BCBA, {0} }
+#else
+typedef int pthread_once_t;
+#define PTHREAD_ONCE_INIT 0
+#endif
+int pthread_once(pthread_once_t *once_control, void (*init_routine)(void));
@@ -0,0 +1 @@
+int sched_yield(void);
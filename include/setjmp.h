@@ -0,0 +1,4 @@
+// Large enough for the jmp_buf of the supported platforms
+typedef long jmp_buf[32];
+int setjmp(jmp_buf env);
+_Noreturn void longjmp(jmp_buf env, int val);
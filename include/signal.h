@@ -0,0 +1,5 @@
+#define SIGKILL 9
+#define SIGPIPE 13
+#define SIG_IGN ((void (*)(int))1)
+void (*signal(int sig, void (*func)(int)))(int);
+int kill(int pid, int sig);
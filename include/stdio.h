@@ -22,7 +22,9 @@ extern FILE *stderr;
 
 #endif
 
+FILE *fdopen(int, const char *);
 FILE *fopen(const char *, const char *);
+FILE *open_memstream(char **, size_t *);
 int fclose(FILE *);
 int fflush(FILE *);
 int fgetc(FILE *);
@@ -30,8 +32,12 @@ int fprintf(FILE *, const char *, ...);
 int fputc(int c, FILE *);
 int puts(char *s);
 int fputs(const char *, FILE *);
+size_t fwrite(const void *, size_t, size_t, FILE *);
 int getchar(void);
 int printf(const char *, ...);
 int putchar(int c);
+int remove(const char *);
+int rename(const char *, const char *);
 int snprintf(char *, unsigned long, const char *, ...);
 int vfprintf(struct FILE *, const char *, va_list);
+int vsnprintf(char *, unsigned long, const char *, va_list);
@@ -1,7 +1,12 @@
 void* malloc(size_t size);
 void* calloc(size_t count, size_t size);
 void* realloc(void* ptr, size_t size);
+void free(void* ptr);
 #define EXIT_FAILURE 1
 #define EXIT_SUCCESS 0
 void exit(int status);
+char* getenv(const char* name);
 long strtol(const char* str, char** endptr, int base);
+unsigned long strtoul(const char* str, char** endptr, int base);
+void qsort(void* base, size_t nel, size_t width,
+           int (*compar)(const void*, const void*));
@@ -2,5 +2,8 @@ int strcmp(const char *s1, const char *s2);
 int strncmp(const char *s1, const char *s2, size_t n);
 size_t strlen(const char *s);
 void *memcpy(void *dst, const void *src, size_t n);
+void *memset(void *b, int c, size_t len);
 char *strcpy(char *dst, const char *src);
+char *strncpy(char *dst, const char *src, size_t len);
 char *strcat(char *s1, const char *s2);
+int memcmp(const void *s1, const void *s2, size_t n);
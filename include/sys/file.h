@@ -0,0 +1,3 @@
+#define LOCK_EX 2
+#define LOCK_UN 8
+int flock(int fd, int operation);
@@ -0,0 +1,10 @@
+#define AF_UNIX 1
+#define SOCK_STREAM 1
+typedef unsigned int socklen_t;
+struct sockaddr;
+int socket(int domain, int type, int protocol);
+int bind(int socket, const struct sockaddr *address, socklen_t address_len);
+int listen(int socket, int backlog);
+int accept(int socket, struct sockaddr *address, socklen_t *address_len);
+int connect(int socket, const struct sockaddr *address,
+            socklen_t address_len);
@@ -0,0 +1,12 @@
+#ifdef __APPLE__
+struct sockaddr_un {
+  unsigned char sun_len;
+  unsigned char sun_family;
+  char sun_path[104];
+};
+#else
+struct sockaddr_un {
+  unsigned short sun_family;
+  char sun_path[108];
+};
+#endif
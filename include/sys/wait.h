@@ -0,0 +1,2 @@
+typedef int pid_t;
+pid_t waitpid(pid_t pid, int *status, int options);
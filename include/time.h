@@ -0,0 +1,10 @@
+struct timespec {
+  long tv_sec;
+  long tv_nsec;
+};
+#ifdef __APPLE__
+#define CLOCK_MONOTONIC 6
+#else
+#define CLOCK_MONOTONIC 1
+#endif
+int clock_gettime(int clock_id, struct timespec *tp);
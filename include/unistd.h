@@ -0,0 +1,15 @@
+typedef int pid_t;
+typedef long ssize_t;
+pid_t getpid(void);
+ssize_t read(int fd, void *buf, size_t nbyte);
+ssize_t write(int fd, const void *buf, size_t nbyte);
+int close(int fd);
+int unlink(const char *path);
+char *getcwd(char *buf, size_t size);
+int chdir(const char *path);
+pid_t fork(void);
+int setpgid(pid_t pid, pid_t pgid);
+int execvp(const char *file, char *const argv[]);
+int dup2(int fd, int fd2);
+int pipe(int fds[2]);
+void _exit(int status);
@@ -0,0 +1,33 @@
+#ifndef LIBCOMPILIUM_H
+#define LIBCOMPILIUM_H
+
+// libcompilium
+//  Compiles C sources in memory without spawning a process. Link a host
+//  with libcompilium.a and -pthread. Compilations on different threads are
+//  independent of each other.
+
+#include <stddef.h>
+
+typedef struct CompileOptions {
+  const char *target_os;     // "Linux" or "Darwin" (default)
+  const char *include_path;  // ends with '/', NULL if none
+  int is_optimization_disabled;  // -O0
+  int should_assemble;  // output an ELF object instead of the assembly
+} CompileOptions;
+
+typedef struct OutputBuffer {
+  // Allocated with malloc, and should be freed by the host
+  char *data;
+  size_t size;
+} OutputBuffer;
+
+// Returns 0 and the output in output, or nonzero and the error messages.
+// The memory used for a compilation is kept by the calling thread and
+// reused by the next call, so repeated calls do not grow the heap.
+int CompileString(const char *src, size_t len, const CompileOptions *options,
+                  OutputBuffer *output);
+
+// Frees the memory kept by CompileString on the calling thread
+void ReleaseCompileMemory(void);
+
+#endif
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../libcompilium.h"
+
+// Compiles kernels in memory repeatedly, as a host of libcompilium does.
+
+static const char kernel[] =
+    "#include <stdio.h>\n"
+    "int square(int x) { return x * x; }\n"
+    "int main() { printf(\"%d\\n\", square(7)); return 0; }\n";
+
+static void Expect(int cond, const char *what) {
+  if (cond) {
+    printf("PASS %s\n", what);
+    return;
+  }
+  printf("FAIL %s\n", what);
+  exit(EXIT_FAILURE);
+}
+
+static long GetMaxRSS(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static int Compile(const char *src, const CompileOptions *options,
+                   OutputBuffer *output) {
+  return CompileString(src, strlen(src), options, output);
+}
+
+int main(int argc, char **argv) {
+  CompileOptions options = {.target_os = argc > 1 ? argv[1] : "Linux",
+                            .include_path = "../include/"};
+  OutputBuffer output;
+  Expect(Compile(kernel, &options, &output) == 0, "compile");
+  Expect(strstr(output.data, "square:") != NULL, "assembly");
+  FILE *fp = fopen("kernel.S", "wb");
+  fwrite(output.data, 1, output.size, fp);
+  fclose(fp);
+  free(output.data);
+
+  Expect(Compile("int main() { x; }", &options, &output) != 0, "error");
+  Expect(strstr(output.data, "Error: ") != NULL, "error message");
+  free(output.data);
+  Expect(Compile(kernel, &options, &output) == 0, "compile after error");
+  free(output.data);
+
+  if (strcmp(options.target_os, "Linux") == 0) {
+    options.should_assemble = 1;
+    Expect(Compile(kernel, &options, &output) == 0, "assemble");
+    Expect(output.size > 4 && memcmp(output.data, "\177ELF", 4) == 0,
+           "object");
+    free(output.data);
+  }
+
+  // The memory is reused by the next compilation
+  for (int i = 0; i < 100; i++) {
+    Compile(kernel, &options, &output);
+    free(output.data);
+  }
+  long rss = GetMaxRSS();
+  for (int i = 0; i < 1000; i++) {
+    Compile(i % 10 ? kernel : "int main() { x; }", &options, &output);
+    free(output.data);
+  }
+  printf("Max RSS: %ld -> %ld\n", rss, GetMaxRSS());
+  Expect(GetMaxRSS() - rss < rss / 10, "no growth in 1000 compilations");
+  ReleaseCompileMemory();
+  return 0;
+}
@@ -0,0 +1,5 @@
+#include "compilium.h"
+
+// The driver is in compilium.c, so that libcompilium.a has everything but
+// this entry point.
+int main(int argc, char *argv[]) { return CompiliumMain(argc, argv); }
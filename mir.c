@@ -0,0 +1,257 @@
+#include "compilium.h"
+
+// Machine IR
+//  The generator appends the instructions of each external declaration to
+//  compiler->machine_insts instead of printing them, so that the code can be
+//  inspected and rewritten before it is emitted. Operands keep the scratch
+//  registers assigned by the analyzer apart from the registers fixed by the
+//  instructions and the ABI (rax, rcx, rbp, ...). PrintMachineInsts renders
+//  the list in Intel syntax.
+//  With --legacy-asm-text, the text is byte for byte what the generator
+//  printed before the machine IR ("// arg[0]" comments and "dword ptr[rsi]"
+//  in some places), which proves that the IR carries everything of the old
+//  output. The other text differs only in the spacing and the comment
+//  marker, and is assembled into the same machine code.
+
+#define INITIAL_MACHINE_INSTS_CAPACITY 64
+
+struct MachineOperand RegOperand(int reg, int size) {
+  // reg: scratch register assigned by the analyzer
+  assert(1 <= reg && reg <= NUM_OF_SCRATCH_REGS);
+  struct MachineOperand o = {
+      .kind = kMachineOperandReg, .reg = reg, .size = size};
+  return o;
+}
+
+struct MachineOperand FixedRegOperand(const char *name) {
+  struct MachineOperand o = {.kind = kMachineOperandFixedReg, .name = name};
+  return o;
+}
+
+struct MachineOperand ImmOperand(long imm) {
+  struct MachineOperand o = {.kind = kMachineOperandImm, .imm = imm};
+  return o;
+}
+
+struct MachineOperand LabelOperand(int label) {
+  struct MachineOperand o = {.kind = kMachineOperandLabel, .label = label};
+  return o;
+}
+
+struct MachineOperand SymbolOperand(const char *symbol) {
+  struct MachineOperand o = {.kind = kMachineOperandSymbol, .symbol = symbol};
+  return o;
+}
+
+struct MachineOperand MemOperand(int size, int base_reg) {
+  // [base_reg], with "<size> ptr" if size is not 0
+  struct MachineOperand o = {
+      .kind = kMachineOperandMem, .size = size, .reg = base_reg};
+  return o;
+}
+
+struct MachineOperand FixedMemOperand(int size, const char *base, int disp) {
+  // [base + disp] where base is a fixed register
+  struct MachineOperand o = {
+      .kind = kMachineOperandMem, .size = size, .name = base, .disp = disp};
+  return o;
+}
+
+struct MachineOperand IndexedMemOperand(int base_reg, int scale,
+                                        int index_reg) {
+  // [base_reg + scale * index_reg]
+  struct MachineOperand o = {.kind = kMachineOperandMem,
+                             .reg = base_reg,
+                             .scale = scale,
+                             .index_reg = index_reg};
+  return o;
+}
+
+struct MachineOperand GOTEntryOperand(const char *symbol) {
+  // [rip + symbol@GOTPCREL]
+  struct MachineOperand o = {
+      .kind = kMachineOperandMem, .name = "rip", .symbol = symbol};
+  return o;
+}
+
+struct MachineOperand LabelAddressOperand(int label) {
+  // [rip + L<label>]
+  struct MachineOperand o = {
+      .kind = kMachineOperandMem, .name = "rip", .label = label};
+  return o;
+}
+
+struct MachineInst *AppendMachineInst(enum MachineInstKind kind,
+                                      const char *opcode) {
+  if (compiler->num_of_machine_insts == compiler->machine_insts_capacity) {
+    // The list lives in the current arena until it is printed
+    int capacity = compiler->machine_insts_capacity
+                       ? compiler->machine_insts_capacity * 2
+                       : INITIAL_MACHINE_INSTS_CAPACITY;
+    struct MachineInst *insts =
+        AllocMemory(sizeof(struct MachineInst) * capacity);
+    if (compiler->num_of_machine_insts) {
+      memcpy(insts, compiler->machine_insts,
+             sizeof(struct MachineInst) * compiler->num_of_machine_insts);
+    }
+    compiler->machine_insts = insts;
+    compiler->machine_insts_capacity = capacity;
+  }
+  struct MachineInst *inst =
+      &compiler->machine_insts[compiler->num_of_machine_insts++];
+  memset(inst, 0, sizeof(*inst));
+  inst->kind = kind;
+  inst->opcode = opcode;
+  return inst;
+}
+
+void ClearMachineInsts(void) {
+  compiler->machine_insts = NULL;
+  compiler->num_of_machine_insts = 0;
+  compiler->machine_insts_capacity = 0;
+}
+
+const char *GetMachineRegName(int reg, int size) {
+  if (size == 8) return reg_names_64[reg];
+  if (size == 4) return reg_names_32[reg];
+  if (size == 1) return reg_names_8[reg];
+  assert(false);
+}
+
+static const char *GetPtrName(int size) {
+  if (size == 8) return "qword";
+  if (size == 4) return "dword";
+  if (size == 1) return "byte";
+  assert(false);
+}
+
+static void PrintMachineOperand(FILE *fp, struct MachineOperand *o,
+                                bool is_legacy) {
+  if (o->kind == kMachineOperandReg) {
+    fputs(GetMachineRegName(o->reg, o->size), fp);
+    return;
+  }
+  if (o->kind == kMachineOperandFixedReg) {
+    fputs(o->name, fp);
+    return;
+  }
+  if (o->kind == kMachineOperandImm) {
+    fprintf(fp, "%ld", o->imm);
+    return;
+  }
+  if (o->kind == kMachineOperandLabel) {
+    fprintf(fp, "L%d", o->label);
+    return;
+  }
+  if (o->kind == kMachineOperandSymbol) {
+    fputs(o->symbol, fp);
+    return;
+  }
+  assert(o->kind == kMachineOperandMem);
+  if (o->size) {
+    fprintf(fp, "%s ptr%s", GetPtrName(o->size),
+            is_legacy && o->is_legacy_tight_ptr ? "" : " ");
+  }
+  fprintf(fp, "[%s", o->name ? o->name : reg_names_64[o->reg]);
+  if (o->index_reg) {
+    fprintf(fp, " + %d * %s", o->scale, reg_names_64[o->index_reg]);
+  }
+  if (o->disp) {
+    fprintf(fp, " %c %d", o->disp < 0 ? '-' : '+',
+            o->disp < 0 ? -o->disp : o->disp);
+  }
+  if (o->symbol) fprintf(fp, " + %s@GOTPCREL", o->symbol);
+  if (o->label) fprintf(fp, " + L%d", o->label);
+  fputc(']', fp);
+}
+
+void PrintMachineInsts(FILE *fp, struct MachineInst *insts, int n,
+                       bool is_legacy) {
+  for (int i = 0; i < n; i++) {
+    struct MachineInst *inst = &insts[i];
+    if (inst->kind == kMachineLabel) {
+      PrintMachineOperand(fp, &inst->operands[0], is_legacy);
+      fputs(":\n", fp);
+      continue;
+    }
+    fputs(inst->opcode, fp);
+    for (int k = 0; k < inst->num_of_operands; k++) {
+      fputs(k ? ", " : " ", fp);
+      PrintMachineOperand(fp, &inst->operands[k], is_legacy);
+    }
+    if (inst->comment) {
+      fprintf(fp, " %s %s",
+              is_legacy && inst->is_legacy_slash_comment ? "//" : "#",
+              inst->comment);
+    }
+    fputc('\n', fp);
+  }
+}
+
+static void ExpectMachineText(struct MachineInst *inst, bool is_legacy,
+                              const char *expected) {
+  char *text;
+  size_t size;
+  FILE *fp = open_memstream(&text, &size);
+  PrintMachineInsts(fp, inst, 1, is_legacy);
+  fclose(fp);
+  if (strcmp(text, expected) != 0) {
+    Error("Expected %s but got %s", expected, text);
+  }
+  free(text);
+  ClearMachineInsts();
+}
+
+static struct MachineInst *CreateTestInst(const char *opcode,
+                                          int num_of_operands,
+                                          struct MachineOperand a,
+                                          struct MachineOperand b) {
+  struct MachineInst *inst = AppendMachineInst(kMachineInst, opcode);
+  inst->num_of_operands = num_of_operands;
+  inst->operands[0] = a;
+  inst->operands[1] = b;
+  return inst;
+}
+
+void TestMachineIR(void) {
+  fprintf(stderr, "Testing MachineIR...");
+  struct MachineOperand none = {.kind = kMachineOperandNone};
+  ExpectMachineText(CreateTestInst("ret", 0, none, none), false, "ret\n");
+  ExpectMachineText(CreateTestInst("mov", 2, RegOperand(2, 8), ImmOperand(-5)),
+                    false, "mov rsi, -5\n");
+  ExpectMachineText(
+      CreateTestInst("movzx", 2, RegOperand(5, 8), RegOperand(5, 1)), false,
+      "movzx r10, r10b\n");
+  struct MachineInst *inst = CreateTestInst(
+      "mov", 2, FixedMemOperand(0, "rbp", -16), FixedRegOperand("edi"));
+  inst->comment = "arg[0]";
+  inst->is_legacy_slash_comment = true;
+  ExpectMachineText(inst, false, "mov [rbp - 16], edi # arg[0]\n");
+  inst = CreateTestInst("mov", 2, FixedMemOperand(0, "rbp", -16),
+                        FixedRegOperand("edi"));
+  inst->comment = "arg[0]";
+  inst->is_legacy_slash_comment = true;
+  ExpectMachineText(inst, true, "mov [rbp - 16], edi // arg[0]\n");
+  struct MachineOperand tight = MemOperand(4, 1);
+  tight.is_legacy_tight_ptr = true;
+  ExpectMachineText(CreateTestInst("movsxd", 2, RegOperand(1, 8), tight),
+                    false, "movsxd rdi, dword ptr [rdi]\n");
+  ExpectMachineText(CreateTestInst("movsxd", 2, RegOperand(1, 8), tight), true,
+                    "movsxd rdi, dword ptr[rdi]\n");
+  ExpectMachineText(
+      CreateTestInst("lea", 2, RegOperand(1, 8), IndexedMemOperand(1, 4, 2)),
+      false, "lea rdi, [rdi + 4 * rsi]\n");
+  ExpectMachineText(
+      CreateTestInst("mov", 2, RegOperand(3, 8), GOTEntryOperand("_g")), false,
+      "mov r8, [rip + _g@GOTPCREL]\n");
+  ExpectMachineText(
+      CreateTestInst("lea", 2, RegOperand(4, 8), LabelAddressOperand(-3)),
+      false, "lea r9, [rip + L-3]\n");
+  ExpectMachineText(CreateTestInst("jz", 1, LabelOperand(7), none), false,
+                    "jz L7\n");
+  inst = AppendMachineInst(kMachineLabel, NULL);
+  inst->operands[0] = SymbolOperand("_main");
+  ExpectMachineText(inst, false, "_main:\n");
+  fprintf(stderr, "PASS\n");
+  exit(EXIT_SUCCESS);
+}
@@ -4,7 +4,8 @@
 struct Node *CreateNodeFromValue(int value) {
   char s[12];
   snprintf(s, sizeof(s), "%d", value);
-  char *ds = strdup(s);  // duplicate because s is allocated on the stack
+  // duplicate because s is allocated on the stack
+  char *ds = AllocString(s, strlen(s));
   int line = 0;
   struct Node *node = AllocNode(kASTExpr);
 
@@ -20,54 +21,146 @@ struct Node *CreateNodeFromValue(int value) {
   return node;
 }
 
+// Optimization remarks
+//  -Rpass=PASSES and -Rpass-missed=PASSES print the optimizations which the
+//  passes applied and missed. PASSES is a comma separated list of fold,
+//  strength and tailrec, or all. Every remark is also written to the file of
+//  -foptimization-record-file= as a YAML document.
+
+static bool IsPassInList(const char *list, const char *pass) {
+  if (!list) return false;
+  if (strcmp(list, "all") == 0) return true;
+  int len = strlen(pass);
+  const char *p = list;
+  for (;;) {
+    int item_len = 0;
+    while (p[item_len] && p[item_len] != ',') item_len++;
+    if (item_len == len && strncmp(p, pass, len) == 0) return true;
+    if (!p[item_len]) return false;
+    p += item_len + 1;
+  }
+}
+
+static int GetColumnOfToken(struct Node *t) {
+  int column = 1;
+  for (const char *p = t->begin; p > t->src_str && p[-1] != '\n'; p--) {
+    column++;
+  }
+  return column;
+}
+
+static void EmitRemark(bool is_applied, const char *pass, struct Node *t,
+                       const char *fmt, ...) {
+  // t: the token where the optimization is applied or missed
+  // Missed remarks are reported only by the last iteration of the passes,
+  // where nothing is left for the others to enable
+  if (!is_applied && compiler->are_missed_remarks_muted) return;
+  bool should_print = IsPassInList(
+      is_applied ? compiler->remark_passes : compiler->missed_remark_passes,
+      pass);
+  FILE *record = compiler->optimization_record;
+  if (!should_print && !record) return;
+  char message[256];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(message, sizeof(message), fmt, ap);
+  va_end(ap);
+  const char *file = compiler->input_path ? compiler->input_path : "<stdin>";
+  int column = GetColumnOfToken(t);
+  if (should_print) {
+    fprintf(stderr, "%s:%d:%d: remark: %s [-Rpass%s=%s]\n", file, t->line,
+            column, message, is_applied ? "" : "-missed", pass);
+  }
+  if (!record) return;
+  // Single quotes are doubled in a single-quoted YAML scalar
+  char quoted[sizeof(message) * 2];
+  int len = 0;
+  for (const char *p = message; *p; p++) {
+    if (*p == '\'') quoted[len++] = '\'';
+    quoted[len++] = *p;
+  }
+  quoted[len] = 0;
+  struct Node *func = compiler->optimizing_function;
+  fprintf(record,
+          "--- !%s\nPass: %s\nFunction: %.*s\n"
+          "DebugLoc: { File: '%s', Line: %d, Column: %d }\n"
+          "Message: '%s'\n...\n",
+          is_applied ? "Passed" : "Missed", pass,
+          func ? func->func_name_token->length : 0,
+          func ? func->func_name_token->begin : "", file, t->line, column,
+          quoted);
+}
+
 // Strength Reduction
 // は式を受け取り、可能であればよりコストの低い演算に書き換える
 // 左辺または右辺が負の値である演算には対応していない
 // @param expr: 式を表すノード。NULL なら何もせず 0 を返す。
-void StrengthReduction(struct Node **exprp) {
+// @return 式が書き換わったら true
+int StrengthReduction(struct Node **exprp) {
   assert(exprp != NULL);
   struct Node *expr = *exprp;
   if (!expr || expr->type != kASTExpr) {
-    return;
+    return false;
   }
   if (!expr->left || !expr->right) {
-    return;
+    return false;
   }
   if (!expr->left->op || !expr->right->op) {
-    return;
+    return false;
   }
 
   if (expr->right->op->token_type != kTokenIntegerConstant) {
-    return;
+    return false;
   }
   int right_var = strtol(expr->right->op->begin, NULL, 10);
 
   if (strncmp(expr->op->begin, "/", expr->op->length) == 0) {
     if (right_var < 0) {
-      return;
+      EmitRemark(false, "strength", expr->op,
+                 "division by %d not strength-reduced: divisor is negative",
+                 right_var);
+      return false;
     }
     if (__builtin_popcount(right_var) != 1) {
-      return;
+      EmitRemark(false, "strength", expr->op,
+                 "division by %d not strength-reduced: divisor not a power "
+                 "of two",
+                 right_var);
+      return false;
     }
     int log2_right_var = __builtin_popcount(right_var - 1);
-    expr->op->begin = strdup(">>");
+    EmitRemark(true, "strength", expr->op,
+               "division by %d strength-reduced to shift by %d", right_var,
+               log2_right_var);
+    expr->op->begin = ">>";
     expr->op->length = strlen(">>");
     expr->right = CreateNodeFromValue(log2_right_var);
-    return;
+    return true;
   }
   if (strncmp(expr->op->begin, "/=", expr->op->length) == 0) {
     if (right_var < 0) {
-      return;
+      EmitRemark(false, "strength", expr->op,
+                 "division by %d not strength-reduced: divisor is negative",
+                 right_var);
+      return false;
     }
     if (__builtin_popcount(right_var) != 1) {
-      return;
+      EmitRemark(false, "strength", expr->op,
+                 "division by %d not strength-reduced: divisor not a power "
+                 "of two",
+                 right_var);
+      return false;
     }
     int log2_right_var = __builtin_popcount(right_var - 1);
-    expr->op->begin = strdup(">>=");
+    EmitRemark(true, "strength", expr->op,
+               "division by %d strength-reduced to shift by %d", right_var,
+               log2_right_var);
+    expr->op->begin = ">>=";
     expr->op->length = strlen(">>=");
     expr->right = CreateNodeFromValue(log2_right_var);
-    return;
+    return true;
   }
+  return false;
 }
 
 // ConstantPropagation は式を受け取り，左右が定数値であれば，
@@ -116,20 +209,33 @@ int ConstantPropagation(struct Node **exprp) {
   int left_var = strtol(expr->left->op->begin, NULL, 10);
   // PrintASTNode(expr);
 
+  struct Node *op = expr->op;
   int val;
-  if (strncmp(expr->op->begin, "+", expr->op->length) == 0) {
+  if (strncmp(op->begin, "+", op->length) == 0) {
     val = left_var + right_var;
-  } else if (strncmp(expr->op->begin, "-", expr->op->length) == 0) {
+  } else if (strncmp(op->begin, "-", op->length) == 0) {
     val = left_var - right_var;
-  } else if (strncmp(expr->op->begin, "*", expr->op->length) == 0) {
+  } else if (strncmp(op->begin, "*", op->length) == 0) {
     val = left_var * right_var;
-  } else if (strncmp(expr->op->begin, "/", expr->op->length) == 0) {
+  } else if ((strncmp(op->begin, "/", op->length) == 0 ||
+              strncmp(op->begin, "%", op->length) == 0) &&
+             right_var == 0) {
+    EmitRemark(false, "fold", op, "%d %.*s %d not folded: division by zero",
+               left_var, op->length, op->begin, right_var);
+    return false;
+  } else if (strncmp(op->begin, "/", op->length) == 0) {
     val = left_var / right_var;
-  } else if (strncmp(expr->op->begin, "%", expr->op->length) == 0) {
+  } else if (strncmp(op->begin, "%", op->length) == 0) {
     val = left_var % right_var;
   } else {
+    EmitRemark(false, "fold", op,
+               "%d %.*s %d not folded: operator %.*s is not supported",
+               left_var, op->length, op->begin, right_var, op->length,
+               op->begin);
     return false;
   }
+  EmitRemark(true, "fold", op, "folded %d %.*s %d into %d", left_var,
+             op->length, op->begin, right_var, val);
   *exprp = CreateNodeFromValue(val);
   return true;
 }
@@ -156,8 +262,13 @@ int IsTailRecursiveFunction(struct Node *fn, struct Node *n) {
     }
   }
   if (n->type == kASTExpr) {
-    return IsTailRecursiveFunction(fn, n->left) ||
-           IsTailRecursiveFunction(fn, n->right);
+    // 左側の枝はループで辿る
+    for (; n && n->type == kASTExpr; n = n->left) {
+      if (IsTailRecursiveFunction(fn, n->right)) {
+        return true;
+      }
+    }
+    return IsTailRecursiveFunction(fn, n);
   }
   if (n->type == kASTExprStmt) {
     return IsTailRecursiveFunction(fn, n->left) ||
@@ -187,7 +298,6 @@ int IsTailRecursiveFunction(struct Node *fn, struct Node *n) {
     if (!IsEqualToken(fn->func_name_token, fexpr->op)) {
       return false;
     }
-    fprintf(stderr, "Found Recursive Return Stmt \n");
     return true;
   }
   if (n->type == kASTList) {
@@ -207,10 +317,9 @@ int IsTailRecursiveFunction(struct Node *fn, struct Node *n) {
 
 struct Node *ParseStmt();
 static struct Node *CreateStmt(const char *s) {
-  char* ds = strdup(s);
+  char *ds = AllocString(s, strlen(s));
   struct Node *tokens = Tokenize(ds);
-  InitParser(&tokens);
-  return ParseStmt();
+  return ParseFromTokens(&tokens, ParseStmt);
 }
 
 // 末尾最適のASTを中身を実際にOptimizeする
@@ -242,6 +351,10 @@ void SubOptimizeRecursiveFunction(struct Node *fn, struct Node **np) {
     }
   }
   if (n->type == kASTExpr) {
+    // 左側の枝はループで辿る
+    for (; n->left && n->left->type == kASTExpr; n = n->left) {
+      SubOptimizeRecursiveFunction(fn, &n->right);
+    }
     SubOptimizeRecursiveFunction(fn, &n->left);
     SubOptimizeRecursiveFunction(fn, &n->right);
   }
@@ -288,17 +401,11 @@ void SubOptimizeRecursiveFunction(struct Node *fn, struct Node **np) {
       return;
     }
     
-    fprintf(stderr, "Arguments of callee RecursiveFunction\n");
     assert(fn->func_type->right->nodes[0]->left != NULL);
     // PrintASTNode(fn->func_type->right->nodes[0]->left);
 
     struct Node* call_expr_list = result_expr->left->arg_expr_list;
 
-    fprintf(stderr, "The arguments is {%.*s}\n", fn->func_type->right->nodes[0]->left->length, fn->func_type->right->nodes[0]->left->begin);
-    fprintf(stderr, "Call arguments is {%.*s}\n", call_expr_list->nodes[0]->op->length, call_expr_list->nodes[0]->op->begin);
-    
-    fprintf(stderr, "r: {%.*s}\n",  result_expr->right->op->length, result_expr->right->op->begin);
-    
     const int MAX_LEN = 256;
     char buf[MAX_LEN];
     
@@ -308,11 +415,9 @@ void SubOptimizeRecursiveFunction(struct Node *fn, struct Node **np) {
           call_expr_list->nodes[0]->op->length, call_expr_list->nodes[0]->op->begin,
           result_expr->right->op->length, result_expr->right->op->begin
     )>=0);
-    fprintf(stderr, "%s\n", buf);
     // _X += 1;
     
     *np = CreateStmt(buf);
-    PrintASTNode(*np);
     return;
   }
   if (n->type == kASTList) {
@@ -328,28 +433,68 @@ void SubOptimizeRecursiveFunction(struct Node *fn, struct Node **np) {
   return;
 }
 
+struct SelfCallSearch {
+  struct Node *fn;
+  int num_of_calls;
+  struct Node *first_call;
+};
+
+static bool FindSelfCall(struct Node **np, struct ASTVisitor *v) {
+  struct SelfCallSearch *search = v->data;
+  struct Node *n = *np;
+  if (n->type == kASTExprFuncCall && n->func_expr->op &&
+      IsEqualToken(search->fn->func_name_token, n->func_expr->op)) {
+    if (!search->first_call) search->first_call = n;
+    search->num_of_calls++;
+  }
+  return true;
+}
+
 struct Node *ParseDecl();
 static struct Node *CreateDecl(const char *s) {
   struct Node *tokens = Tokenize(s);
-  InitParser(&tokens);
-  return ParseDecl();
+  return ParseFromTokens(&tokens, ParseDecl);
 }
 
-void OptimizeRecursiveFunction(struct Node **fnp) {
+// @return 関数がループに書き換わったら true
+bool OptimizeRecursiveFunction(struct Node **fnp) {
   assert(fnp != NULL);
   struct Node *fn = *fnp;
   assert(fn != NULL);
   assert(fn->type == kASTFuncDef);
 
-  if (GetSizeOfList(fn->func_type->right) != 1) {
-    return;
+  struct Node *name = fn->func_name_token;
+  struct SelfCallSearch search = {.fn = fn};
+  struct ASTVisitor visitor = {.pre = FindSelfCall, .data = &search};
+  VisitAST(&fn->func_body, &visitor);
+  struct Node *self_call = search.first_call;
+  int num_of_self_calls = search.num_of_calls;
+  int num_of_params = GetSizeOfList(fn->func_type->right);
+  if (num_of_params != 1) {
+    if (num_of_self_calls) {
+      EmitRemark(false, "tailrec", self_call->func_expr->op,
+                 "recursive call in %.*s not transformed: %d parameters",
+                 name->length, name->begin, num_of_params);
+    }
+    return false;
   }
 
   if (!IsTailRecursiveFunction(fn, fn->func_body)) {
-    return;
+    if (num_of_self_calls > 1) {
+      EmitRemark(false, "tailrec", self_call->func_expr->op,
+                 "recursive call in %.*s not transformed: %d self-calls",
+                 name->length, name->begin, num_of_self_calls);
+    } else if (num_of_self_calls) {
+      EmitRemark(false, "tailrec", self_call->func_expr->op,
+                 "recursive call in %.*s not transformed: not in the form of "
+                 "return %.*s(x) + C",
+                 name->length, name->begin, name->length, name->begin);
+    }
+    return false;
   }
-  fprintf(stderr, "OptimizeRecusiveFunction %.*s\n",
-          fn->func_name_token->length, fn->func_name_token->begin);
+  EmitRemark(true, "tailrec", name,
+             "recursive calls in %.*s transformed into a loop", name->length,
+             name->begin);
 
   SubOptimizeRecursiveFunction(fn, &fn->func_body);
 
@@ -365,60 +510,213 @@ void OptimizeRecursiveFunction(struct Node **fnp) {
   PushToList(new_fn_body, CreateStmt("return _X;"));
 
   fn->func_body = new_fn_body;
+  return true;
 }
 
-void Optimize(struct Node **np) {
-  if (!np) {
-    return;
+// Pass manager
+//  compiler->passes is the pipeline, a comma separated list of the passes
+//  below, which runs on each external declaration. The pipeline is repeated
+//  while it changes the declaration, at most compiler->max_pass_iterations
+//  times, since a pass may give the others a chance to optimize. The AST is
+//  checked after each pass with --verify-passes, and the time of the passes
+//  is summed up per unit with --time-passes.
+
+#define MAX_PASS_ITERATIONS 8
+
+static bool RunTailrecPass(struct Node **np) {
+  if ((*np)->type != kASTFuncDef) return false;
+  return OptimizeRecursiveFunction(np);
+}
+
+static void FoldExpr(struct Node **np, struct ASTVisitor *v) {
+  v->changed |= ConstantPropagation(np);
+}
+
+static bool RunFoldPass(struct Node **np) {
+  struct ASTVisitor visitor = {.post = FoldExpr};
+  VisitAST(np, &visitor);
+  return visitor.changed;
+}
+
+static void ReduceExpr(struct Node **np, struct ASTVisitor *v) {
+  v->changed |= StrengthReduction(np);
+}
+
+static bool RunStrengthPass(struct Node **np) {
+  struct ASTVisitor visitor = {.post = ReduceExpr};
+  VisitAST(np, &visitor);
+  return visitor.changed;
+}
+
+struct OptimizationPass {
+  const char *name;
+  bool (*run)(struct Node **np);  // returns true if *np is changed
+};
+
+static struct OptimizationPass passes[NUM_OF_OPTIMIZATION_PASSES] = {
+    {"fold", RunFoldPass},
+    {"strength", RunStrengthPass},
+    {"tailrec", RunTailrecPass},
+};
+
+struct OptimizationLevel {
+  const char *option;
+  const char *passes;
+  int max_pass_iterations;
+};
+
+static struct OptimizationLevel levels[] = {
+    {"-O0", "", 1},
+    {"-O1", "fold,strength", 1},
+    {"-O2", "tailrec,fold,strength", MAX_PASS_ITERATIONS},
+    // None of the passes makes the code larger for speed yet
+    {"-Os", "tailrec,fold,strength", MAX_PASS_ITERATIONS},
+};
+
+static int FindPass(const char *name, int len) {
+  for (int i = 0; i < NUM_OF_OPTIMIZATION_PASSES; i++) {
+    if ((int)strlen(passes[i].name) == len &&
+        strncmp(passes[i].name, name, len) == 0) {
+      return i;
+    }
   }
-  struct Node *n = *np;
-  if (!n) {
-    return;
+  return -1;
+}
+
+bool SetOptimizationLevel(const char *option) {
+  // Returns false if option is not a known level
+  int num_of_levels = sizeof(levels) / sizeof(levels[0]);
+  for (int i = 0; i < num_of_levels; i++) {
+    if (strcmp(option, levels[i].option) == 0) {
+      compiler->passes = levels[i].passes;
+      compiler->max_pass_iterations = levels[i].max_pass_iterations;
+      return true;
+    }
   }
-  fprintf(stderr, "AST before optimization:\n");
-  if (n->type == kASTFuncDef) {
-    //関数の再起呼び出しの検知
-    OptimizeRecursiveFunction(np);
-    Optimize(&n->func_body);
-    return;
+  return false;
+}
+
+void SetPasses(const char *passes) {
+  // passes: comma separated names of the passes, which run once in the order
+  for (const char *p = passes; *p;) {
+    int len = 0;
+    while (p[len] && p[len] != ',') len++;
+    if (FindPass(p, len) < 0) {
+      Error("Unknown optimization pass: %.*s", len, p);
+    }
+    p += p[len] ? len + 1 : len;
+  }
+  compiler->passes = passes;
+  compiler->max_pass_iterations = 1;
+}
+
+static const char *GetASTProblem(struct Node *n) {
+  // Returns what breaks the assumptions of the later stages on n, or NULL
+  if (n->type == kASTExpr) {
+    if (!n->op) return "expression without an operator";
+    if (IsTokenWithType(n->op, kTokenIntegerConstant) &&
+        (n->left || n->right)) {
+      return "integer constant with operands";
+    }
   }
   if (n->type == kASTExprFuncCall) {
-    Optimize(&n->left);
-    Optimize(&n->arg_expr_list);
-    return;
+    if (!n->func_expr) return "function call without a callee";
+    if (!n->arg_expr_list || n->arg_expr_list->type != kASTList) {
+      return "function call without an argument list";
+    }
   }
-  if (n->type == kASTExpr) {
-    fprintf(stderr, "Optimize:\n");
-    // PrintASTNode(n);
-    Optimize(&n->left);
-    Optimize(&n->right);
-    // left と right が定数なら，ここで定数の計算
-    ConstantPropagation(np);
-    StrengthReduction(np);
-    return;
+  if (n->type == kASTList) {
+    for (int i = 0; i < GetSizeOfList(n); i++) {
+      if (!GetNodeAt(n, i)) return "NULL in a list";
+    }
+  }
+  if (n->type == kASTJumpStmt && !n->op) return "jump without a keyword";
+  if (n->type == kASTForStmt && !n->body) return "loop without a body";
+  if (n->type == kASTSelectionStmt && (!n->cond || !n->if_true_stmt)) {
+    return "if statement without a condition or a body";
   }
-  if (n->type == kASTExprStmt || n->type == kASTJumpStmt) {
-    if (n->left) {
-      Optimize(&n->left);
+  if (n->type == kASTFuncDef &&
+      (!n->func_body || n->func_body->type != kASTList)) {
+    return "function definition without a body";
+  }
+  return NULL;
+}
+
+static bool VerifyNode(struct Node **np, struct ASTVisitor *v) {
+  const char *pass = v->data;
+  struct Node *n = *np;
+  const char *problem = GetASTProblem(n);
+  if (problem && n->op) {
+    ErrorWithToken(n->op, "AST is broken by pass %s: %s", pass, problem);
+  } else if (problem) {
+    Error("AST is broken by pass %s: %s", pass, problem);
+  }
+  return true;
+}
+
+static void VerifyAST(struct Node **np, const char *pass) {
+  struct ASTVisitor visitor = {.pre = VerifyNode, .data = (void *)pass};
+  VisitAST(np, &visitor);
+}
+
+static bool RunPasses(struct Node **np) {
+  // Runs the pipeline once, and returns true if a pass changed *np
+  bool changed = false;
+  for (const char *p = compiler->passes; *p;) {
+    int len = 0;
+    while (p[len] && p[len] != ',') len++;
+    int index = FindPass(p, len);
+    p += p[len] ? len + 1 : len;
+    struct OptimizationPass *pass = &passes[index];
+    struct PassTiming *timing = &compiler->pass_timings[index];
+    double begin = compiler->should_time_passes ? GetMonotonicSeconds() : 0;
+    bool pass_changed = pass->run(np);
+    if (compiler->should_time_passes) {
+      timing->seconds += GetMonotonicSeconds() - begin;
     }
-    if (n->right) {
-      Optimize(&n->right);
+    timing->num_of_runs++;
+    timing->num_of_changes += pass_changed;
+    if (compiler->should_verify_passes) {
+      VerifyAST(np, pass->name);
     }
+    changed |= pass_changed;
+  }
+  return changed;
+}
+
+void Optimize(struct Node **np) {
+  if (!np || !*np || !compiler->passes[0]) {
     return;
   }
-  if (n->type == kASTList) {
-    for (int l = 0; l < GetSizeOfList(n); l++) {
-      struct Node *stmt = GetNodeAt(n, l);
-      Optimize(&stmt);
+  struct Node *n = *np;
+  compiler->optimizing_function = n->type == kASTFuncDef ? n : NULL;
+  if (compiler->should_verify_passes) {
+    VerifyAST(np, "(input)");
+  }
+  bool should_report_missed =
+      compiler->missed_remark_passes || compiler->optimization_record;
+  int max_iterations = compiler->max_pass_iterations;
+  for (int i = 0; i < max_iterations; i++) {
+    compiler->are_missed_remarks_muted = i < max_iterations - 1;
+    if (RunPasses(np)) continue;
+    // Converged. One more run changes nothing but reports the missed ones.
+    if (compiler->are_missed_remarks_muted && should_report_missed) {
+      compiler->are_missed_remarks_muted = false;
+      RunPasses(np);
     }
-    return;
+    break;
   }
-  if (n->type == kASTForStmt) {
-    Optimize(&n->body);
-    return;
+  compiler->are_missed_remarks_muted = false;
+  compiler->optimizing_function = NULL;
+}
+
+void PrintPassTimings(void) {
+  // Printed with --time-passes at the end of each unit
+  for (int i = 0; i < NUM_OF_OPTIMIZATION_PASSES; i++) {
+    struct PassTiming *timing = &compiler->pass_timings[i];
+    if (!timing->num_of_runs) continue;
+    fprintf(stderr, "Pass: name=%s runs=%ld changes=%ld seconds=%.6f\n",
+            passes[i].name, timing->num_of_runs,
+            timing->num_of_changes, timing->seconds);
   }
-  // Show the result
-  fprintf(stderr, "AST after optimization:\n");
-  // PrintASTNode(ast);
-  // fputs("Optimization end\n", stderr);
 }
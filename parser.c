@@ -1,8 +1,5 @@
 #include "compilium.h"
 
-// 6.2.3 Name spaces of identifiers
-static struct Node *ord_idents;  // ordinary identifiers
-
 struct Node *ParseStmt();
 struct Node *ParseCompStmt();
 struct Node *ParseDeclBody();
@@ -375,7 +372,8 @@ struct Node *ParseDeclSpecs() {
       continue;
     }
     // typedef name
-    struct Node *typedef_type = GetNodeByTokenKey(ord_idents, PeekToken());
+    struct Node *typedef_type =
+        GetNodeByTokenKey(compiler->ord_idents, PeekToken());
     if (typedef_type) {
       PushToList(decl_specs, typedef_type);
       NextToken();
@@ -465,7 +463,9 @@ struct Node *ParseDecltor() {
   struct Node *pointer = NULL;
   struct Node *t;
   while ((t = ConsumePunctuator("*"))) {
-    pointer = CreateTypePointer(pointer);
+    struct Node *p = AllocNode(kTypePointer);
+    p->right = pointer;
+    pointer = p;
   }
   n->left = pointer;
   n->right = ParseDirectDecltor();
@@ -521,43 +521,70 @@ struct Node *ParseCompStmt() {
   return list;
 }
 
-struct Node *ParseFuncDef(struct Node *decl_body) {
+struct Node *ParseFuncDef(struct Node *decl_body, struct Arena *body_arena) {
+  // The body is allocated in body_arena so that it can be released after
+  // the function is emitted. The declaration stays alive since the function
+  // can be referred from the rest of the translation unit.
+  struct Arena *saved_arena = SwitchArena(body_arena);
   struct Node *comp_stmt = ParseCompStmt();
+  SwitchArena(saved_arena);
   if (!comp_stmt) return NULL;
   return CreateASTFuncDef(decl_body, comp_stmt);
 }
 
 void InitParser(struct Node **head_token) {
+  // Tokens from the pipe are received lazily and have no delimiters
+  InitTokenStream(compiler->token_input_pipe
+                      ? head_token
+                      : RemoveDelimiterTokens(head_token));
+  compiler->ord_idents = AllocList();
+}
+
+struct Node *ParseExternalDecl(struct Arena *body_arena) {
+  // Returns a declaration or a function definition, or NULL at the end of
+  // the input.
+  struct Node *decl_body = ParseDeclBody();
+  if (!decl_body) {
+    struct Node *t;
+    if (!(t = NextToken())) return NULL;
+    ErrorWithToken(t, "Unexpected token");
+  }
+  if (ConsumePunctuator(";")) {
+    assert(IsASTList(decl_body->op));
+    if (IsASTDeclOfTypedef(decl_body)) {
+      // typedef case
+      struct Node *typedef_type = CreateTypeFromDecl(decl_body);
+      struct Node *typedef_name = GetIdentifierTokenFromTypeAttr(typedef_type);
+      PrintASTNode(typedef_name);
+      PushKeyValueToList(compiler->ord_idents, CreateTokenStr(typedef_name),
+                         GetTypeWithoutAttr(typedef_type));
+    }
+    return decl_body;
+  }
+  struct Node *func_def = ParseFuncDef(decl_body, body_arena);
+  if (!func_def) {
+    ErrorWithToken(NextToken(), "Unexpected token");
+  }
+  return func_def;
+}
+
+struct Node *ParseFromTokens(struct Node **head_token,
+                             struct Node *(*parser)(void)) {
+  // Parses a separate token sequence without disturbing the token stream
+  // of the translation unit.
+  struct Node **saved_stream = GetTokenStream();
   InitTokenStream(RemoveDelimiterTokens(head_token));
-  ord_idents = AllocList();
+  struct Node *n = parser();
+  InitTokenStream(saved_stream);
+  return n;
 }
 
 struct Node *Parse(struct Node **head_token) {
   InitParser(head_token);
   struct Node *list = AllocList();
-  struct Node *decl_body;
-  while ((decl_body = ParseDeclBody())) {
-    if (ConsumePunctuator(";")) {
-      PushToList(list, decl_body);
-      assert(IsASTList(decl_body->op));
-      if (IsASTDeclOfTypedef(decl_body)) {
-        // typedef case
-        struct Node *typedef_type = CreateTypeFromDecl(decl_body);
-        struct Node *typedef_name =
-            GetIdentifierTokenFromTypeAttr(typedef_type);
-        PrintASTNode(typedef_name);
-        PushKeyValueToList(ord_idents, CreateTokenStr(typedef_name),
-                           GetTypeWithoutAttr(typedef_type));
-      }
-      continue;
-    }
-    struct Node *func_def = ParseFuncDef(decl_body);
-    if (!func_def) {
-      ErrorWithToken(NextToken(), "Unexpected token");
-    }
-    PushToList(list, func_def);
+  struct Node *decl;
+  while ((decl = ParseExternalDecl(GetCurrentArena()))) {
+    PushToList(list, decl);
   }
-  struct Node *t;
-  if (!(t = NextToken())) return list;
-  ErrorWithToken(t, "Unexpected token");
+  return list;
 }
@@ -1,5 +1,47 @@
 #include "compilium.h"
 
+static struct Node *TokenizeHeader(const char *path, FILE *fp) {
+  const char *input = ReadFile(fp);
+  if (compiler->unit_arena) {
+    // Tokens refer to the content, so it is released with them
+    char *copy = AllocMemoryInArena(compiler->unit_arena, strlen(input) + 1);
+    strcpy(copy, input);
+    free((char *)input);
+    input = copy;
+  }
+  if (!compiler->header_cache) return Tokenize(input);
+  // The compile server keeps the tokens of headers. They are reused while
+  // the content of the file is unchanged, and copied since the preprocessor
+  // rewrites the token sequence.
+  // header_cache: path -> Node(key: content, value: tokens)
+  struct Node *cached = GetNodeByKey(compiler->header_cache, path);
+  if (cached && strcmp(cached->key, input) == 0) {
+    free((char *)input);
+    return DuplicateTokenSequence(cached->value);
+  }
+  struct Arena *saved_arena = SwitchArena(NULL);
+  if (!cached) {
+    cached = AllocNode(kNodeNone);
+    PushKeyValueToList(compiler->header_cache, strdup(path), cached);
+  }
+  cached->key = input;
+  cached->value = Tokenize(input);
+  SwitchArena(saved_arena);
+  return DuplicateTokenSequence(cached->value);
+}
+
+static void AddDependency(const char *path) {
+  // Records an included file for -M and -MD
+  struct Node *deps = compiler->dependencies;
+  if (!deps) return;
+  for (int i = 0; i < GetSizeOfList(deps); i++) {
+    if (strcmp(GetNodeAt(deps, i)->key, path) == 0) return;
+  }
+  struct Node *dep = AllocNode(kNodeNone);
+  dep->key = path;
+  PushToList(deps, dep);
+}
+
 static struct Node *SkipDelimiterTokensInLogicalLine(struct Node *t) {
   while (t && t->token_type == kTokenDelimiter &&
          !IsEqualTokenWithCStr(t, "\n"))
@@ -14,7 +56,7 @@ static const char *CreateStrFromTokenRange(struct Node *begin,
   for (struct Node *t = begin; t && t != end; t = t->next_token) {
     len += t->length;
   }
-  return strndup(begin->begin, len);
+  return AllocString(begin->begin, len);
 }
 
 static void PreprocessRemoveBlock(void) {
@@ -62,22 +104,31 @@ static struct Node *TryReadIdentListWrappedByParens(struct Node **tp) {
 
 static char *CreateJoinedString(const char *s1, const char *s2) {
   assert(s1 && s2);
-  char *s = malloc(strlen(s1) + strlen(s2) + 1);
-  assert(s);
+  char *s = AllocMemory(strlen(s1) + strlen(s2) + 1);
   strcpy(s, s1);
   strcat(s, s2);
   return s;
 }
 
+static void PassToken(void) {
+  // Tokens behind the cursor are not rewritten anymore, so they can be
+  // parsed while the rest is preprocessed.
+  struct Node *t = NextToken();
+  if (compiler->token_output_pipe) {
+    SendTokenToPipe(compiler->token_output_pipe, t);
+  }
+}
+
 static void PreprocessBlock(struct Node *replacement_list, int level) {
   struct Node *t;
   while (PeekToken()) {
-    if ((t = ConsumeTokenStr("__LINE__"))) {
+    if (IsEqualTokenWithCStr((t = PeekToken()), "__LINE__")) {
       char s[32];
       snprintf(s, sizeof(s), "%d", t->line);
       t->token_type = kTokenIntegerConstant;
-      t->begin = t->src_str = strdup(s);
+      t->begin = t->src_str = AllocString(s, strlen(s));
       t->length = strlen(t->begin);
+      PassToken();
       continue;
     }
     if ((t = ReadToken(kTokenLineComment))) {
@@ -142,22 +193,24 @@ static void PreprocessBlock(struct Node *replacement_list, int level) {
           struct Node *end = t;
           fname = CreateStrFromTokenRange(begin, end);
           RemoveTokensTo(end->next_token);
-          if (!include_path) {
+          if (!compiler->include_path) {
             ErrorWithToken(token_include,
                            "Include path is not provided in compiler args");
           }
-          path = CreateJoinedString(include_path, fname);
+          path = CreateJoinedString(compiler->include_path, fname);
         } else {
           ErrorWithToken(t, "Expected < or \" here");
         }
         assert(path);
-        fprintf(stderr, "Include from: %s\n", path);
+        if (compiler->is_verbose) {
+          fprintf(stderr, "Include from: %s\n", path);
+        }
         FILE *fp = fopen(path, "rb");
         if (!fp) {
           ErrorWithToken(token_include, "File not found: %s", path);
         }
-        const char *include_input = ReadFile(fp);
-        InsertTokens(Tokenize(include_input));
+        AddDependency(path);
+        InsertTokens(TokenizeHeader(path, fp));
         fclose(fp);
         continue;
       }
@@ -245,11 +298,12 @@ static void PreprocessBlock(struct Node *replacement_list, int level) {
       InsertTokensWithIdentReplace(rep, arg_rep_list);
       continue;
     }
-    NextToken();
+    PassToken();
   }
 }
 
 void Preprocess(struct Node **head_holder, struct Node *replacement_list) {
   InitTokenStream(head_holder);
   PreprocessBlock(replacement_list, 0);
+  if (compiler->token_output_pipe) CloseTokenPipe(compiler->token_output_pipe);
 }
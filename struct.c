@@ -65,7 +65,9 @@ void ResolveTypesOfMembersOfStruct(struct SymbolEntry *ctx, struct Node *spec) {
     return;
   }
   struct Node *dict = spec->struct_member_dict;
-  fprintf(stderr, "Resolving types of struct...\n");
+  if (compiler->is_verbose) {
+    fprintf(stderr, "Resolving types of struct...\n");
+  }
   struct Node *resolved_dict = AllocList();
   for (int i = 0; i < GetSizeOfList(dict); i++) {
     struct Node *kv = GetNodeAt(dict, i);
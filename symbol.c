@@ -2,26 +2,24 @@
 
 static void PushSymbol(struct SymbolEntry **prev, struct SymbolEntry *sym) {
   sym->prev = *prev;
+  sym->frame_ofs = *prev ? (*prev)->frame_ofs : 0;
   *prev = sym;
 }
 
 static struct SymbolEntry *AllocSymbolEntry(enum SymbolType type,
                                             const char *key,
                                             struct Node *value) {
-  struct SymbolEntry *e = calloc(1, sizeof(struct SymbolEntry));
+  struct SymbolEntry *e = AllocMemory(sizeof(struct SymbolEntry));
   e->type = type;
   e->key = key;
   e->value = value;
   return e;
 }
 
+// Each entry has the size of the local variables in use at that point, so
+// restoring ctx at the end of a scope frees the variables of the scope.
 int GetLastLocalVarOffset(struct SymbolEntry *e) {
-  for (; e; e = e->prev) {
-    if (e->type != kSymbolLocalVar) continue;
-    assert(e->value && e->value->type == kASTLocalVar);
-    return e->value->byte_offset;
-  }
-  return 0;
+  return e ? e->frame_ofs : 0;
 }
 
 struct Node *AddLocalVar(struct SymbolEntry **ctx, const char *key,
@@ -29,28 +27,33 @@ struct Node *AddLocalVar(struct SymbolEntry **ctx, const char *key,
   assert(ctx);
   int ofs = GetLastLocalVarOffset(*ctx);
   ofs += GetSizeOfType(var_type);
-  int align = GetSizeOfType(var_type);
+  int align = GetAlignOfType(var_type);
   ofs = (ofs + align - 1) / align * align;
   struct Node *local_var = CreateASTLocalVar(ofs, var_type);
   struct SymbolEntry *e = AllocSymbolEntry(kSymbolLocalVar, key, local_var);
   PushSymbol(ctx, e);
+  e->frame_ofs = ofs;
   return local_var;
 }
 
 void AddGlobalVar(struct SymbolEntry **ctx, const char *key,
                   struct Node *var_type) {
-  fprintf(stderr, "Gvar: %s: ", key);
-  PrintASTNode(var_type);
-  fprintf(stderr, "\n");
+  if (compiler->is_verbose) {
+    fprintf(stderr, "Gvar: %s: ", key);
+    PrintASTNode(var_type);
+    fprintf(stderr, "\n");
+  }
   assert(ctx);
   struct SymbolEntry *e = AllocSymbolEntry(kSymbolGlobalVar, key, var_type);
   PushSymbol(ctx, e);
 }
 void AddExternVar(struct SymbolEntry **ctx, const char *key,
                   struct Node *var_type) {
-  fprintf(stderr, "Evar: %s: ", key);
-  PrintASTNode(var_type);
-  fprintf(stderr, "\n");
+  if (compiler->is_verbose) {
+    fprintf(stderr, "Evar: %s: ", key);
+    PrintASTNode(var_type);
+    fprintf(stderr, "\n");
+  }
   assert(ctx);
   struct SymbolEntry *e = AllocSymbolEntry(kSymbolExternVar, key, var_type);
   PushSymbol(ctx, e);
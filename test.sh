@@ -1,19 +1,48 @@
 #!/bin/bash -e
 
+# Set COMPILIUM to run the tests with another command (e.g. a client of the
+# compile server, see `make test_with_server`)
+COMPILIUM=${COMPILIUM:-./compilium}
+
+# Set ASSEMBLE=1 to run the tests with objects assembled by compilium -c
+if [ -n "$ASSEMBLE" ]; then
+  OUTPUT_ARGS="-c -o out.o"
+  OUTPUT=out.o
+else
+  OUTPUT_ARGS=""
+  OUTPUT=out.S
+fi
+
+# Set RUN=1 to run the tests in the process of compilium with --run
+function compile_and_run {
+  if [ -n "$RUN" ]; then
+    $COMPILIUM --run --target-os `uname` <<< "$input" \
+      > out.stdout 2> out.stderr || actual=$?
+    if grep -q "^Error: " out.stderr; then
+      echo "Source Input : $input"
+      echo "$input" > failcase.c
+      echo "Compilation failed."
+      exit 1
+    fi
+    return
+  fi
+  $COMPILIUM $OUTPUT_ARGS --target-os `uname` <<< "$input" > out.S || { \
+    echo "Source Input : $input"
+    echo "$input" > failcase.c; \
+    echo "Compilation failed."; \
+    exit 1; }
+  gcc $OUTPUT
+  ./a.out > out.stdout || actual=$?
+}
+
 function test_result {
   input="$1"
   expected="$2"
   expected_stdout="$3"
   testname="$4"
   printf "$expected_stdout" > expected.stdout
-  ./compilium --target-os `uname` <<< "$input" > out.S || { \
-    echo "Source Input : $input"
-    echo "$input" > failcase.c; \
-    echo "Compilation failed."; \
-    exit 1; }
-  gcc out.S
   actual=0
-  ./a.out > out.stdout || actual=$?
+  compile_and_run
   if [ $expected = $actual ]; then
       diff -u expected.stdout out.stdout \
         && echo "PASS $testname returns $expected" \
@@ -244,6 +273,11 @@ test_stmt_result 'int a ; int b = 262144; a =  b/32768; return a;' 8
 test_stmt_result 'int a ; int b = 262145; a =  b/32768; return a;' 8
 
 
+# conditional operator with the branches of different types
+test_stmt_result 'char c; c = 3; return 1 ? c : 0;' 3
+test_stmt_result 'char c; c = 3; return 0 ? 0 : c;' 3
+test_stmt_result 'int a = 5; int *p = &a; return *(1 ? p : 0);' 5
+
 # Non-printable
 test_expr_result ' 0 ' 0
 
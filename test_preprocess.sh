@@ -243,3 +243,12 @@ printf("Two %s %d", "1 + 1", 3);
 EOS
 `" \
 'Function-like macros with #expr macro'
+
+printf "int f(void);\n" > testinput.h
+printf "#include \"testinput.h\"\n#include \"testinput.h\"\n" > testinput.c
+./compilium -M -MT testinput.S --target-os `uname` < testinput.c > out.stdout
+printf "testinput.S: \\\\\n  ./testinput.h\n\n./testinput.h:\n" > expected.stdout
+diff -y expected.stdout out.stdout \
+  && printf "\nPASS Dependencies\n" \
+  || { printf "\nFAIL Dependencies: stdout diff\n"; exit 1; }
+rm testinput.h testinput.c expected.stdout out.stdout
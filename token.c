@@ -38,7 +38,7 @@ struct Node *DuplicateTokenSequence(struct Node *base_head) {
 
 char *CreateTokenStr(struct Node *t) {
   assert(IsToken(t));
-  return strndup(t->begin, t->length);
+  return AllocString(t->begin, t->length);
 }
 
 int IsEqualTokenWithCStr(struct Node *t, const char *s) {
@@ -77,7 +77,7 @@ void OutputTokenSequenceAsCSource(struct Node *t) {
     if (t->token_type == kTokenZeroWidthNoBreakSpace) {
       continue;
     }
-    fprintf(stdout, "%.*s", t->length, t->begin);
+    fprintf(compiler->output, "%.*s", t->length, t->begin);
   }
 }
 
@@ -106,52 +106,63 @@ static bool ShouldRemoveToken(struct Node *t) {
 
 // Token stream
 
-static struct Node **next_token_holder;
-
 void InitTokenStream(struct Node **head_token_holder) {
   assert(head_token_holder);
-  next_token_holder = head_token_holder;
+  compiler->next_token_holder = head_token_holder;
+}
+
+struct Node **GetTokenStream(void) { return compiler->next_token_holder; }
+
+static void ReceiveTokenFromPipe(void);
+
+static struct Node *GetCurrentToken(void) {
+  // Waits for the preprocessor if the stream has reached the received tokens
+  if (!*compiler->next_token_holder &&
+      compiler->next_token_holder == compiler->token_pipe_tail) {
+    ReceiveTokenFromPipe();
+  }
+  return *compiler->next_token_holder;
 }
 
 static void AdvanceTokenStream(void) {
-  if (!*next_token_holder) return;
-  next_token_holder = &(*next_token_holder)->next_token;
+  if (!GetCurrentToken()) return;
+  compiler->next_token_holder = &(*compiler->next_token_holder)->next_token;
 }
 
 struct Node *PeekToken(void) {
-  assert(next_token_holder);
-  return *next_token_holder;
+  assert(compiler->next_token_holder);
+  return GetCurrentToken();
 }
 
 struct Node *ReadToken(enum TokenType type) {
-  struct Node *t = *next_token_holder;
+  struct Node *t = GetCurrentToken();
   if (!t || !IsTokenWithType(t, type)) return NULL;
   return t;
 }
 
 struct Node *ConsumeToken(enum TokenType type) {
-  struct Node *t = *next_token_holder;
+  struct Node *t = GetCurrentToken();
   if (!t || !IsTokenWithType(t, type)) return NULL;
   AdvanceTokenStream();
   return t;
 }
 
 struct Node *ConsumeTokenStr(const char *s) {
-  struct Node *t = *next_token_holder;
+  struct Node *t = GetCurrentToken();
   if (!t || !IsEqualTokenWithCStr(t, s)) return NULL;
   AdvanceTokenStream();
   return t;
 }
 
 struct Node *ExpectTokenStr(const char *s) {
-  struct Node *t = *next_token_holder;
+  struct Node *t = GetCurrentToken();
   if (!t) Error("Expect token %s but got EOF", s);
   if (!ConsumeTokenStr(s)) ErrorWithToken(t, "Expected token %s here", s);
   return t;
 }
 
 struct Node *ConsumePunctuator(const char *s) {
-  struct Node *t = *next_token_holder;
+  struct Node *t = GetCurrentToken();
   if (!t || !IsTokenWithType(t, kTokenPunctuator) ||
       !IsEqualTokenWithCStr(t, s))
     return NULL;
@@ -160,25 +171,25 @@ struct Node *ConsumePunctuator(const char *s) {
 }
 
 struct Node *ExpectPunctuator(const char *s) {
-  struct Node *t = *next_token_holder;
+  struct Node *t = GetCurrentToken();
   if (!t) Error("Expect token %s but got EOF", s);
   if (!ConsumePunctuator(s)) ErrorWithToken(t, "Expected token %s here", s);
   return t;
 }
 
 struct Node *NextToken(void) {
-  struct Node *t = *next_token_holder;
+  struct Node *t = GetCurrentToken();
   AdvanceTokenStream();
   return t;
 }
 
 void RemoveCurrentToken(void) {
-  if (!*next_token_holder) return;
-  *next_token_holder = (*next_token_holder)->next_token;
+  if (!*compiler->next_token_holder) return;
+  *compiler->next_token_holder = (*compiler->next_token_holder)->next_token;
 }
 
 void RemoveTokensTo(struct Node *end) {
-  while (*next_token_holder && *next_token_holder != end) {
+  while (*compiler->next_token_holder && *compiler->next_token_holder != end) {
     RemoveCurrentToken();
   }
 }
@@ -189,7 +200,7 @@ void InsertTokens(struct Node *seq_first) {
   struct Node *seq_last = seq_first;
   while (seq_last->next_token) seq_last = seq_last->next_token;
   seq_last->next_token = PeekToken();
-  *next_token_holder = seq_first;
+  *compiler->next_token_holder = seq_first;
 }
 
 static struct Node *CreateStringLiteralOfTokens(struct Node *head) {
@@ -198,8 +209,7 @@ static struct Node *CreateStringLiteralOfTokens(struct Node *head) {
   for (struct Node *t = head; t; t = t->next_token) {
     len += t->length;
   }
-  char *s = malloc(len + 1 + 2);
-  assert(s);
+  char *s = AllocMemory(len + 1 + 2);
   char *p = s;
   *p = '"';
   p++;
@@ -220,7 +230,7 @@ void InsertTokensWithIdentReplace(struct Node *seq, struct Node *rep_list) {
   // if seq contains token in rep_list, replace it with tokens rep_list[token];
   // elements of seq will be inserted directly.
   if (!IsToken(seq)) return;
-  struct Node **next_holder = next_token_holder;
+  struct Node **next_holder = compiler->next_token_holder;
   while (seq) {
     struct Node *e;
     if (IsEqualTokenWithCStr(seq, "#") && seq->next_token &&
@@ -267,3 +277,86 @@ struct Node **RemoveDelimiterTokens(struct Node **head_holder) {
   }
   return head_holder;
 }
+
+// Token pipe
+//  Tokens are sent from the preprocessor thread to the parser through a
+//  single-producer/single-consumer ring. The preprocessor rewrites the link
+//  to the next token until it passes the next one, so each token is sent one
+//  token later, and the parser relinks the tokens it receives.
+
+#define TOKEN_PIPE_CAPACITY 4096
+
+struct TokenPipe {
+  struct Node *ring[TOKEN_PIPE_CAPACITY];
+  unsigned long head;  // written by the parser
+  unsigned long tail;  // written by the preprocessor
+  bool is_closed;
+  struct Node *pending;  // passed but its link can still be rewritten
+};
+
+struct TokenPipe *AllocTokenPipe(void) {
+  struct TokenPipe *pipe = calloc(1, sizeof(struct TokenPipe));
+  assert(pipe);
+  return pipe;
+}
+
+static void PushTokenToRing(struct TokenPipe *pipe, struct Node *t) {
+  unsigned long tail = pipe->tail;
+  while (tail - __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) >=
+         TOKEN_PIPE_CAPACITY) {
+    sched_yield();
+  }
+  pipe->ring[tail % TOKEN_PIPE_CAPACITY] = t;
+  __atomic_store_n(&pipe->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void SendTokenToPipe(struct TokenPipe *pipe, struct Node *t) {
+  // Called when the preprocessor passes t. Delimiters are not sent since
+  // the parser removes them anyway.
+  if (pipe->pending && !ShouldRemoveToken(pipe->pending)) {
+    PushTokenToRing(pipe, pipe->pending);
+  }
+  pipe->pending = t;
+}
+
+void CloseTokenPipe(struct TokenPipe *pipe) {
+  SendTokenToPipe(pipe, NULL);
+  __atomic_store_n(&pipe->is_closed, true, __ATOMIC_RELEASE);
+}
+
+static struct Node *PopTokenFromRing(struct TokenPipe *pipe) {
+  // Returns NULL at the end of the tokens
+  unsigned long head = pipe->head;
+  for (;;) {
+    if (head != __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE)) break;
+    if (__atomic_load_n(&pipe->is_closed, __ATOMIC_ACQUIRE)) {
+      // The last token may be pushed just before closing
+      if (head != __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE)) break;
+      return NULL;
+    }
+    sched_yield();
+  }
+  struct Node *t = pipe->ring[head % TOKEN_PIPE_CAPACITY];
+  __atomic_store_n(&pipe->head, head + 1, __ATOMIC_RELEASE);
+  return t;
+}
+
+void InitTokenStreamFromPipe(struct Node **head_token, struct TokenPipe *pipe) {
+  *head_token = NULL;
+  InitTokenStream(head_token);
+  compiler->token_input_pipe = pipe;
+  compiler->token_pipe_tail = head_token;
+}
+
+static void ReceiveTokenFromPipe(void) {
+  struct Node *t = PopTokenFromRing(compiler->token_input_pipe);
+  if (!t) {
+    free(compiler->token_input_pipe);
+    compiler->token_input_pipe = NULL;
+    compiler->token_pipe_tail = NULL;
+    return;
+  }
+  t->next_token = NULL;
+  *compiler->token_pipe_tail = t;
+  compiler->token_pipe_tail = &t->next_token;
+}
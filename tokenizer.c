@@ -228,6 +228,7 @@ struct Node *Tokenize(const char *input) {
     *last_next_token = t;
     last_next_token = &t->next_token;
     p = t->begin + t->length;
+    compiler->num_of_tokens++;
   }
   return token_head;
 }
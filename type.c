@@ -12,26 +12,153 @@ int GetScaleOfPointerType(struct Node *n) {
   return GetSizeOfType(n->right);
 }
 
-int IsSameTypeExceptAttr(struct Node *a, struct Node *b) {
-  assert(a && b);
-  a = GetTypeWithoutAttr(a);
-  b = GetTypeWithoutAttr(b);
+// Canonical types
+//  Types are hash-consed: CreateType* returns the same node for structurally
+//  equal types whose components are canonical. Types that carry attributes
+//  (identifiers of params, lvalue-ness) are mapped to canonical ones lazily
+//  by GetCanonicalType().
+
+static unsigned long HashTypeKey(struct Node *key) {
+  unsigned long h = key->type;
+  if (key->type == kTypeBase) {
+    return h * 31 + key->op->token_type;
+  }
+  h = h * 31 + (unsigned long)key->left;
+  h = h * 31 + (unsigned long)key->type_array_type_of;
+  h = h * 31 + key->type_array_length;
+  if (key->type == kTypeFunction) {
+    for (int i = 0; i < GetSizeOfList(key->right); i++) {
+      h = h * 31 + (unsigned long)GetNodeAt(key->right, i);
+    }
+    return h;
+  }
+  return h * 31 + (unsigned long)key->right;
+}
+
+static int IsSameTypeKey(struct Node *a, struct Node *b) {
   if (a->type != b->type) return 0;
-  if (a->type == kTypeBase) {
-    assert(a->op && b->op);
-    return a->op->type == b->op->type;
-  } else if (a->type == kTypePointer) {
-    return IsSameTypeExceptAttr(a->right, b->right);
-  } else if (a->type == kTypeFunction) {
-    if (!IsSameTypeExceptAttr(a->left, b->left)) return 0;
-    if (GetSizeOfList(a->right) != GetSizeOfList(b->right)) return 0;
-    for (int i = 0; i < GetSizeOfList(a->right); i++) {
-      if (!IsSameTypeExceptAttr(GetNodeAt(a->right, i), GetNodeAt(b->right, i)))
-        return 0;
+  if (a->type == kTypeBase) return a->op->token_type == b->op->token_type;
+  if (a->left != b->left) return 0;
+  if (a->type_array_type_of != b->type_array_type_of) return 0;
+  if (a->type_array_length != b->type_array_length) return 0;
+  if (a->type != kTypeFunction) return a->right == b->right;
+  if (GetSizeOfList(a->right) != GetSizeOfList(b->right)) return 0;
+  for (int i = 0; i < GetSizeOfList(a->right); i++) {
+    if (GetNodeAt(a->right, i) != GetNodeAt(b->right, i)) return 0;
+  }
+  return 1;
+}
+
+static struct Node *AllocCanonicalType(struct Node *key, unsigned long h) {
+  // Canonical types are shared by the whole translation unit, so they should
+  // not refer to anything which is released with the arena of a function.
+  struct Arena *saved_arena = SwitchArena(compiler->unit_arena);
+  struct Node *n = AllocNode(key->type);
+  memcpy(n, key, sizeof(*n));
+  if (n->type == kTypeBase) n->op = DuplicateToken(key->op);
+  if (n->type == kTypeFunction) {
+    n->right = AllocList();
+    for (int i = 0; i < GetSizeOfList(key->right); i++) {
+      PushToList(n->right, GetNodeAt(key->right, i));
+    }
+  }
+  n->type_array_index_decl = NULL;
+  n->canonical_type = n;
+  n->next_hashed_type = compiler->type_hash_table[h];
+  compiler->type_hash_table[h] = n;
+  SwitchArena(saved_arena);
+  return n;
+}
+
+struct Node *InternType(struct Node *key) {
+  // Returns the canonical node which has the same structure as key.
+  // key can be a temporary node since it is copied on the first lookup.
+  unsigned long h = HashTypeKey(key) % TYPE_HASH_TABLE_SIZE;
+  if (!compiler->type_hash_table) {
+    compiler->type_hash_table = AllocMemoryInArena(
+        compiler->unit_arena, TYPE_HASH_TABLE_SIZE * sizeof(struct Node *));
+  }
+  // The table is shared by the threads of the parallel backend
+  if (compiler->type_table_lock) {
+    pthread_mutex_lock(compiler->type_table_lock);
+  }
+  struct Node *n = compiler->type_hash_table[h];
+  for (; n; n = n->next_hashed_type) {
+    if (IsSameTypeKey(n, key)) break;
+  }
+  if (!n) n = AllocCanonicalType(key, h);
+  if (compiler->type_table_lock) {
+    pthread_mutex_unlock(compiler->type_table_lock);
+  }
+  return n;
+}
+
+int IsCanonicalType(struct Node *t) { return t && t->canonical_type == t; }
+
+int IsCanonicalTypeList(struct Node *list) {
+  // NULL elements represent "..." in canonical function types.
+  for (int i = 0; i < GetSizeOfList(list); i++) {
+    struct Node *t = GetNodeAt(list, i);
+    if (t && !IsCanonicalType(t)) return 0;
+  }
+  return 1;
+}
+
+struct Node *GetCanonicalType(struct Node *t) {
+  if (!t) return NULL;
+  // The memo is filled racily by the parallel backend; every thread computes
+  // the same canonical node, so only the publication needs ordering.
+  struct Node *c = __atomic_load_n(&t->canonical_type, __ATOMIC_ACQUIRE);
+  if (c) return c;
+  if (t->type == kTypeAttrIdent) {
+    c = GetCanonicalType(t->right);
+  } else if (t->type == kTypeLValue) {
+    c = CreateTypeLValue(GetCanonicalType(t->right));
+  } else if (t->type == kTypePointer) {
+    c = CreateTypePointer(GetCanonicalType(t->right));
+  } else if (t->type == kTypeArray) {
+    struct Node key = {.type = kTypeArray,
+                       .type_array_type_of =
+                           GetCanonicalType(t->type_array_type_of),
+                       .type_array_index_decl = t->type_array_index_decl,
+                       .type_array_length = t->type_array_length};
+    c = InternType(&key);
+  } else if (t->type == kTypeFunction) {
+    struct Node *arg_type_list = AllocList();
+    for (int i = 0; i < GetSizeOfList(t->right); i++) {
+      struct Node *arg = GetNodeAt(t->right, i);
+      PushToList(arg_type_list, IsToken(arg) ? NULL : GetCanonicalType(arg));
     }
-    return 1;
+    struct Node key = {.type = kTypeFunction,
+                       .left = GetCanonicalType(t->left),
+                       .right = arg_type_list};
+    c = InternType(&key);
+  } else {
+    PrintASTNode(t);
+    Error("GetCanonicalType: Not a type node");
+  }
+  __atomic_store_n(&t->canonical_type, c, __ATOMIC_RELEASE);
+  return c;
+}
+
+struct Node *GetIntType(void) {
+  if (!compiler->int_type) {
+    compiler->int_type = CreateTypeBase(CreateToken("int"));
   }
-  Error("IsSameTypeExceptAttr: Comparing non-type nodes");
+  return compiler->int_type;
+}
+
+struct Node *GetCharType(void) {
+  if (!compiler->char_type) {
+    compiler->char_type = CreateTypeBase(CreateToken("char"));
+  }
+  return compiler->char_type;
+}
+
+int IsSameTypeExceptAttr(struct Node *a, struct Node *b) {
+  assert(a && b);
+  return GetCanonicalType(GetTypeWithoutAttr(a)) ==
+         GetCanonicalType(GetTypeWithoutAttr(b));
 }
 
 struct Node *GetTypeWithoutAttr(struct Node *t) {
@@ -70,72 +197,80 @@ int EvalExprAsInt(struct Node *n) {
   assert(false);
 }
 
-int GetSizeOfType(struct Node *t) {
-  t = GetTypeWithoutAttr(t);
-  assert(t);
+static void CalcSizeAndAlignOfType(struct Node *t) {
+  // Computes size and alignment of canonical type t and stores them in t.
+  assert(IsCanonicalType(t));
+  int size = 0;
+  int align = 0;
   if (t->type == kTypeBase) {
     assert(IsToken(t->op));
     switch (t->op->token_type) {
       case kTokenKwInt:
       case kTokenKwLong:
-        return 4;
+        size = 4;
+        align = 4;
+        break;
       case kTokenKwChar:
-        return 1;
+        size = 1;
+        align = 1;
+        break;
       case kTokenKwVoid:
-        return 0;
+        size = 0;
+        align = 1;
+        break;
       default:
         PrintASTNode(t->op);
         assert(false);
     }
   } else if (t->type == kTypePointer) {
-    return 8;
+    size = 8;
+    align = 8;
   } else if (t->type == kTypeStruct) {
     if (!t->type_struct_spec) {
       ErrorWithToken(t->tag, "Cannot take sizeof incomplete struct");
     }
-    return CalcStructSize(t->type_struct_spec);
+    size = CalcStructSize(t->type_struct_spec);
+    align = CalcStructAlign(t->type_struct_spec);
   } else if (t->type == kTypeArray) {
-    return GetSizeOfType(t->type_array_type_of) *
-           EvalExprAsInt(t->type_array_index_decl);
+    size = GetSizeOfType(t->type_array_type_of) * t->type_array_length;
+    align = GetAlignOfType(t->type_array_type_of);
+  } else {
+    PrintASTNode(t);
+    assert(false);
   }
-  PrintASTNode(t);
-  assert(false);
+  // Canonical types are shared between the threads of the parallel backend.
+  // Threads may race to fill the cache, but they store the same values, and
+  // type_align is published last so that a reader never sees a stale size.
+  t->type_size = size;
+  __atomic_store_n(&t->type_align, align, __ATOMIC_RELEASE);
+}
+
+static int IsLayoutCalculated(struct Node *t) {
+  // type_align is never 0 once the layout is calculated.
+  return __atomic_load_n(&t->type_align, __ATOMIC_ACQUIRE) != 0;
+}
+
+int GetSizeOfType(struct Node *t) {
+  t = GetCanonicalType(GetTypeWithoutAttr(t));
+  assert(t);
+  if (!IsLayoutCalculated(t)) CalcSizeAndAlignOfType(t);
+  return t->type_size;
 }
 
 int GetAlignOfType(struct Node *t) {
-  t = GetTypeWithoutAttr(t);
+  t = GetCanonicalType(GetTypeWithoutAttr(t));
   assert(t);
-  if (t->type == kTypeBase) {
-    assert(IsToken(t->op));
-    switch (t->op->token_type) {
-      case kTokenKwInt:
-        return 4;
-      case kTokenKwChar:
-        return 1;
-      default:
-        assert(false);
-    }
-  } else if (t->type == kTypePointer) {
-    return 8;
-  } else if (t->type == kTypeStruct) {
-    return CalcStructAlign(t->type_struct_spec);
-  }
-  PrintASTNode(t);
-  assert(false);
+  if (!IsLayoutCalculated(t)) CalcSizeAndAlignOfType(t);
+  return t->type_align;
 }
 
 struct Node *CreateTypeFromDecl(struct Node *decl);
 struct Node *CreateType(struct Node *decl_spec, struct Node *decltor);
 struct Node *CreateTypeFromDecltor(struct Node *decltor, struct Node *type) {
   assert(decltor && decltor->type == kASTDecltor);
-  struct Node *pointer = decltor->left;
-  if (pointer) {
-    struct Node *p = pointer;
-    while (p->right) {
-      p = p->right;
-    }
-    p->right = type;
-    type = pointer;
+  // decltor->left is a chain of pointer nodes which only counts '*'s.
+  for (struct Node *p = decltor->left; p; p = p->right) {
+    type = CreateTypePointer(type);
   }
   for (struct Node *dd = decltor->right; dd; dd = dd->left) {
     assert(dd->type == kASTDirectDecltor);
@@ -278,8 +413,16 @@ _Noreturn void TestType() {
   assert(GetSizeOfType(int_type) == 4);
   assert(GetSizeOfType(pointer_of_int_type) == 8);
 
+  // Canonical types are shared
+  assert(int_type == another_int_type);
+  assert(int_type == GetIntType());
+  assert(pointer_of_int_type == another_pointer_of_int_type);
+  assert(lvalue_int_type == CreateTypeLValue(another_int_type));
+
   struct Node *char_type = CreateTypeBase(CreateToken("char"));
   assert(GetSizeOfType(char_type) == 1);
+  assert(char_type == GetCharType());
+  assert(!IsSameTypeExceptAttr(int_type, char_type));
 
   struct Node *long_type = CreateTypeBase(CreateToken("long"));
   assert(GetSizeOfType(long_type) == 4);
@@ -296,6 +439,10 @@ _Noreturn void TestType() {
   struct Node *if_pi_type = CreateTypeFunction(int_type, args_pi);
   struct Node *ppif_pi_type = CreateTypeFunction(ppi_type, args_pi);
 
+  struct Node *another_args_i = AllocList();
+  PushToList(another_args_i, another_int_type);
+  assert(if_i_type == CreateTypeFunction(int_type, another_args_i));
+
   struct Node *type;
 
   type = CreateTypeFromInput("void* (*f)(int size);");
@@ -319,6 +466,14 @@ _Noreturn void TestType() {
   type = CreateTypeFromInput("int **p;");
   PrintASTNode(type);
   assert(IsSameTypeExceptAttr(type, ppi_type));
+  assert(GetTypeWithoutAttr(type) == ppi_type);
+
+  type = CreateTypeFromInput("int a[2 + 3];");
+  PrintASTNode(type);
+  assert(GetTypeWithoutAttr(type) ==
+         GetTypeWithoutAttr(CreateTypeFromInput("int b[5];")));
+  assert(GetSizeOfType(type) == 20);
+  assert(GetAlignOfType(type) == 4);
 
   type = CreateTypeFromInput("int f(int a);");
   PrintASTNode(type);